@@ -0,0 +1,219 @@
+//===- FileIDIndex.h - Fast SourceLocation to FileID lookups ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines FileIDIndex, a side index of the local SLocEntries of a
+/// SourceManager for clients that map many locations to FileIDs.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_BASIC_FILEIDINDEX_H
+#define LLVM_CLANG_BASIC_FILEIDINDEX_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/MathExtras.h"
+#include <cassert>
+#include <vector>
+
+namespace clang {
+
+/// An index that maps source locations to the FileIDs containing them.
+///
+/// \c SourceManager::getFileID only caches the last lookup, and otherwise
+/// probes a few entries before binary searching the SLocEntry table. With
+/// heavy macro use, locations from many different expansions are interleaved
+/// and nearly every lookup takes the slow path. This index copies the offsets
+/// of the local SLocEntries into an Eytzinger (breadth-first) layout, which
+/// makes the binary search cache friendly and branch free, and puts a small
+/// MRU cache of recently found entries in front of it.
+///
+/// The index covers the local entries that existed when it was built; other
+/// locations (loaded from AST files, or created later) are looked up through
+/// the \c SourceManager. Call \c update to index entries created since. Like
+/// \c SourceManager::getFileID, lookups are not thread-safe.
+class FileIDIndex {
+public:
+  explicit FileIDIndex(const SourceManager &SM) : SM(SM) { update(); }
+
+  FileIDIndex(const FileIDIndex &) = delete;
+  FileIDIndex &operator=(const FileIDIndex &) = delete;
+
+  /// Rebuilds the index if local entries were created since it was built.
+  void update() {
+    unsigned NumEntries = SM.local_sloc_entry_size();
+    if (NumEntries == Offsets.size())
+      return;
+
+    // The SLocEntry table only grows, so existing entries stay valid.
+    unsigned NumIndexed = Offsets.size();
+    Offsets.resize(NumEntries);
+    FileIDs.resize(NumEntries);
+    for (unsigned I = NumIndexed; I != NumEntries; ++I) {
+      Offsets[I] = SM.getLocalSLocEntry(I).getOffset();
+      // Entry 0 is a sentinel that does not belong to any file.
+      FileIDs[I] = I == 0 ? FileID()
+                          : SM.getFileID(SourceLocation::getFromRawEncoding(
+                                Offsets[I]));
+    }
+    EndOffset = SM.getNextLocalOffset();
+
+    Layout.resize(NumEntries + 1);
+    SortedIndex.resize(NumEntries + 1);
+    buildLayout(0, 1);
+    for (CacheEntry &Entry : Cache)
+      Entry = CacheEntry();
+  }
+
+  /// Returns the FileID containing \p Loc, like \c SourceManager::getFileID.
+  FileID getFileID(SourceLocation Loc) {
+    if (Loc.isInvalid())
+      return FileID();
+    SourceLocation::UIntTy Offset = getOffset(Loc);
+    if (Offset >= EndOffset)
+      return SM.getFileID(Loc);
+
+    for (const CacheEntry &Entry : Cache)
+      if (Entry.Begin <= Offset && Offset < Entry.End)
+        return Entry.FID;
+
+    unsigned Index = findEntry(Offset);
+    CacheEntry &Victim = Cache[NextVictim];
+    NextVictim = (NextVictim + 1) % NumCacheEntries;
+    Victim.Begin = Offsets[Index];
+    Victim.End = getEntryEnd(Index);
+    Victim.FID = FileIDs[Index];
+    return Victim.FID;
+  }
+
+  /// Resolves the FileIDs of \p Locs into \p FIDs, which must have the same
+  /// size.
+  ///
+  /// Locations are resolved in a single pass over the index if they are
+  /// sorted by offset (e.g. the locations of a token stream); unsorted input
+  /// is supported but not faster than calling \c getFileID repeatedly.
+  void getFileIDs(ArrayRef<SourceLocation> Locs,
+                  MutableArrayRef<FileID> FIDs) {
+    assert(Locs.size() == FIDs.size() && "mismatched output size");
+    unsigned Cursor = 0;
+    for (size_t I = 0, E = Locs.size(); I != E; ++I) {
+      SourceLocation Loc = Locs[I];
+      if (Loc.isInvalid()) {
+        FIDs[I] = FileID();
+        continue;
+      }
+      SourceLocation::UIntTy Offset = getOffset(Loc);
+      if (Offset >= EndOffset) {
+        FIDs[I] = SM.getFileID(Loc);
+        continue;
+      }
+      if (Offset < Offsets[Cursor]) {
+        // Out of order: start over from a regular lookup.
+        Cursor = findEntry(Offset);
+      } else if (Offset >= getEntryEnd(Cursor)) {
+        Cursor = gallop(Cursor, Offset);
+      }
+      FIDs[I] = FileIDs[Cursor];
+    }
+  }
+
+  /// \returns The number of local entries covered by the index.
+  unsigned getNumIndexedEntries() const { return Offsets.size(); }
+
+private:
+  struct CacheEntry {
+    SourceLocation::UIntTy Begin = 0;
+    SourceLocation::UIntTy End = 0;
+    FileID FID;
+  };
+
+  /// Returns the offset of \p Loc in the source location address space, as
+  /// the private \c SourceLocation::getOffset does.
+  static SourceLocation::UIntTy getOffset(SourceLocation Loc) {
+    constexpr SourceLocation::UIntTy MacroIDBit =
+        SourceLocation::UIntTy(1) << (8 * sizeof(SourceLocation::UIntTy) - 1);
+    return Loc.getRawEncoding() & ~MacroIDBit;
+  }
+
+  /// Fills the Eytzinger layout rooted at node \p Node with the entries
+  /// starting at sorted index \p I. \returns The next sorted index.
+  unsigned buildLayout(unsigned I, size_t Node) {
+    if (Node >= Layout.size())
+      return I;
+    I = buildLayout(I, 2 * Node);
+    Layout[Node] = Offsets[I];
+    SortedIndex[Node] = I;
+    ++I;
+    return buildLayout(I, 2 * Node + 1);
+  }
+
+  /// Returns the index of the last entry starting at or before \p Offset.
+  unsigned findEntry(SourceLocation::UIntTy Offset) const {
+    // Descend to the first entry starting after Offset; the path taken encodes
+    // it as the node where the search last went left.
+    size_t Node = 1;
+    while (Node < Layout.size())
+      Node = 2 * Node + (Layout[Node] <= Offset);
+    Node >>= llvm::countTrailingOnes(Node) + 1;
+    unsigned After = Node ? SortedIndex[Node] : Offsets.size();
+    assert(After > 0 && "offset before the first entry");
+    return After - 1;
+  }
+
+  /// Returns the index of the last entry starting at or before \p Offset,
+  /// searching forward from \p From with exponentially growing steps.
+  unsigned gallop(unsigned From, SourceLocation::UIntTy Offset) const {
+    unsigned Low = From;
+    unsigned Step = 1;
+    unsigned High = From + Step;
+    while (High < Offsets.size() && Offsets[High] <= Offset) {
+      Low = High;
+      Step *= 2;
+      High = From + Step;
+    }
+    if (High > Offsets.size())
+      High = Offsets.size();
+    // Offsets[Low] <= Offset < Offsets[High] (or High is the end).
+    while (High - Low > 1) {
+      unsigned Mid = Low + (High - Low) / 2;
+      if (Offsets[Mid] <= Offset)
+        Low = Mid;
+      else
+        High = Mid;
+    }
+    return Low;
+  }
+
+  SourceLocation::UIntTy getEntryEnd(unsigned Index) const {
+    return Index + 1 < Offsets.size() ? Offsets[Index + 1] : EndOffset;
+  }
+
+  const SourceManager &SM;
+
+  /// The offsets of the indexed entries, in the order of the SLocEntry table.
+  std::vector<SourceLocation::UIntTy> Offsets;
+  /// The FileIDs of the indexed entries.
+  std::vector<FileID> FileIDs;
+  /// The end of the last indexed entry.
+  SourceLocation::UIntTy EndOffset = 0;
+
+  /// \c Offsets in Eytzinger order, starting at index 1.
+  std::vector<SourceLocation::UIntTy> Layout;
+  /// Map from Eytzinger nodes to indices into \c Offsets.
+  std::vector<unsigned> SortedIndex;
+
+  static constexpr unsigned NumCacheEntries = 4;
+  CacheEntry Cache[NumCacheEntries];
+  unsigned NextVictim = 0;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_BASIC_FILEIDINDEX_H
@@ -0,0 +1,331 @@
+//===- LineOffsetIndex.h - Fast line offset computation ---------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines a vectorized newline scanner, a lazily built line table for large
+/// buffers, and a cache that shares line tables between SourceManagers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_BASIC_LINEOFFSETINDEX_H
+#define LLVM_CLANG_BASIC_LINEOFFSETINDEX_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <cassert>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLANG_LINEOFFSETINDEX_SSE2 1
+#endif
+
+namespace clang {
+
+/// Calls \p Callback with the offset of every line start in \p Buffer that
+/// is introduced by a newline character in [\p Begin, \p End).
+///
+/// Newlines are recognized like \c SrcMgr::LineOffsetMapping::get does: '\n',
+/// '\r' and "\r\n" each end a line. The line start of a "\r\n" pair belongs to
+/// its '\n', so the results for adjacent ranges can be concatenated even if a
+/// pair straddles the boundary. The first line start (offset 0) is not
+/// reported.
+template <typename CallbackT>
+void forEachLineStart(StringRef Buffer, size_t Begin, size_t End,
+                      CallbackT Callback) {
+  assert(Begin <= End && End <= Buffer.size() && "invalid range");
+  const char *Buf = Buffer.data();
+  size_t Size = Buffer.size();
+  auto Visit = [&](size_t Pos) {
+    if (Buf[Pos] == '\r' && Pos + 1 < Size && Buf[Pos + 1] == '\n')
+      return;
+    Callback(static_cast<unsigned>(Pos + 1));
+  };
+
+  size_t I = Begin;
+#ifdef CLANG_LINEOFFSETINDEX_SSE2
+  // Compare 16 bytes at a time and only visit the positions that matched.
+  const __m128i LF = _mm_set1_epi8('\n');
+  const __m128i CR = _mm_set1_epi8('\r');
+  for (; I + 16 <= End; I += 16) {
+    __m128i Bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Buf + I));
+    unsigned Mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(Bytes, LF), _mm_cmpeq_epi8(Bytes, CR)));
+    while (Mask) {
+      Visit(I + llvm::countTrailingZeros(Mask));
+      Mask &= Mask - 1;
+    }
+  }
+#endif
+  for (; I < End; ++I)
+    if (Buf[I] == '\n' || Buf[I] == '\r')
+      Visit(I);
+}
+
+/// Computes the same line table as \c SrcMgr::LineOffsetMapping::get, using
+/// the vectorized scanner.
+inline SrcMgr::LineOffsetMapping
+computeLineOffsetMapping(llvm::MemoryBufferRef Buffer,
+                         llvm::BumpPtrAllocator &Alloc) {
+  SmallVector<unsigned, 256> LineOffsets;
+  LineOffsets.push_back(0);
+  StringRef Data = Buffer.getBuffer();
+  forEachLineStart(Data, 0, Data.size(),
+                   [&](unsigned Offset) { LineOffsets.push_back(Offset); });
+  return SrcMgr::LineOffsetMapping(LineOffsets, Alloc);
+}
+
+/// A line table for a single buffer that is built one chunk at a time.
+///
+/// \c SrcMgr::LineOffsetMapping records the start of every line in the
+/// buffer the first time any line number is requested. For very large
+/// (typically generated) files this is a noticeable stall and memory cost
+/// when only a few locations are ever looked up. This table only counts the
+/// lines of the chunks before a queried position, which needs no memory, and
+/// records the line starts of the chunk containing it.
+///
+/// Line numbers are 1-based and match \c SourceManager::getLineNumber. The
+/// buffer must outlive the table. Not thread-safe.
+class ChunkedLineOffsetMapping {
+public:
+  explicit ChunkedLineOffsetMapping(StringRef Buffer,
+                                    unsigned ChunkSize = 1 << 20)
+      : Buffer(Buffer), ChunkSize(ChunkSize) {
+    assert(ChunkSize > 0 && "empty chunks");
+    Chunks.resize(Buffer.size() / ChunkSize + 1);
+    LinesBefore.push_back(0);
+  }
+
+  /// \returns The line containing \p Offset, which may be the end of the
+  /// buffer.
+  unsigned getLineNumber(unsigned Offset) {
+    assert(Offset <= Buffer.size() && "offset out of range");
+    unsigned Chunk = Offset / ChunkSize;
+    ArrayRef<unsigned> Starts = getChunk(Chunk);
+    return 1 + getLinesBefore(Chunk) +
+           (std::upper_bound(Starts.begin(), Starts.end(), Offset) -
+            Starts.begin());
+  }
+
+  /// \returns The offset of the first character of \p Line, or None if the
+  /// buffer has fewer lines.
+  Optional<unsigned> getLineOffset(unsigned Line) {
+    assert(Line > 0 && "lines are 1-based");
+    if (Line == 1)
+      return 0u;
+    // Line starts are numbered from 0 after the implicit start of line 1.
+    unsigned Index = Line - 2;
+    unsigned Chunk = 0;
+    while (Chunk + 1 < Chunks.size() && getLinesBefore(Chunk + 1) <= Index)
+      ++Chunk;
+    ArrayRef<unsigned> Starts = getChunk(Chunk);
+    Index -= getLinesBefore(Chunk);
+    if (Index >= Starts.size())
+      return None;
+    return Starts[Index];
+  }
+
+  /// \returns The number of chunks whose line starts have been recorded.
+  unsigned getNumIndexedChunks() const {
+    return std::count_if(Chunks.begin(), Chunks.end(),
+                         [](const ChunkInfo &C) { return C.Indexed; });
+  }
+
+private:
+  struct ChunkInfo {
+    std::vector<unsigned> LineStarts;
+    bool Indexed = false;
+  };
+
+  /// Returns the number of line starts in the chunks before \p Chunk.
+  unsigned getLinesBefore(unsigned Chunk) {
+    while (LinesBefore.size() <= Chunk) {
+      unsigned Prev = LinesBefore.size() - 1;
+      unsigned Count = 0;
+      if (Chunks[Prev].Indexed) {
+        Count = Chunks[Prev].LineStarts.size();
+      } else {
+        auto Range = getChunkRange(Prev);
+        forEachLineStart(Buffer, Range.first, Range.second,
+                         [&](unsigned) { ++Count; });
+      }
+      LinesBefore.push_back(LinesBefore.back() + Count);
+    }
+    return LinesBefore[Chunk];
+  }
+
+  ArrayRef<unsigned> getChunk(unsigned Chunk) {
+    ChunkInfo &Info = Chunks[Chunk];
+    if (!Info.Indexed) {
+      auto Range = getChunkRange(Chunk);
+      forEachLineStart(Buffer, Range.first, Range.second, [&](unsigned Start) {
+        Info.LineStarts.push_back(Start);
+      });
+      Info.Indexed = true;
+    }
+    return Info.LineStarts;
+  }
+
+  std::pair<size_t, size_t> getChunkRange(unsigned Chunk) const {
+    size_t Begin = size_t(Chunk) * ChunkSize;
+    return {Begin, std::min(Begin + ChunkSize, Buffer.size())};
+  }
+
+  StringRef Buffer;
+  const unsigned ChunkSize;
+  std::vector<ChunkInfo> Chunks;
+  /// The number of line starts before each chunk, computed up to the last
+  /// chunk that was needed.
+  std::vector<unsigned> LinesBefore;
+};
+
+/// Shares line tables between the \c ContentCaches of different
+/// SourceManagers that read the same file.
+///
+/// Tools that build many translation units (or reparse the same one) compute
+/// the line table of every commonly included header again in each
+/// SourceManager. \c install fills in \c ContentCache::SourceLineCache from
+/// this cache instead, computing it with the vectorized scanner on first use.
+/// A \c LineOffsetMapping is a view of storage owned by an allocator, so all
+/// ContentCaches point at the same table, which is owned by this cache; the
+/// cache must outlive the SourceManagers it is installed into.
+///
+/// Buffers are identified by their size and a hash of their contents, so
+/// identical buffers share a table and a file edited in place gets a new one,
+/// whatever its modification time. Tables cannot be freed one by one while
+/// SourceManagers may point at them: once the tables take more than the
+/// configured size, no new ones are cached until \c clear is called.
+/// Thread-safe.
+class SharedLineOffsetMappings {
+public:
+  /// \param MaxBytes The memory above which no more tables are cached.
+  explicit SharedLineOffsetMappings(size_t MaxBytes = 64 << 20)
+      : MaxBytes(MaxBytes) {}
+  SharedLineOffsetMappings(const SharedLineOffsetMappings &) = delete;
+  SharedLineOffsetMappings &
+  operator=(const SharedLineOffsetMappings &) = delete;
+
+  /// Makes the line table of \p FID in \p SM available, loading its buffer if
+  /// needed.
+  ///
+  /// \returns false if the buffer cannot be loaded, or the cache is full and
+  /// does not have its table yet; the SourceManager then computes the table
+  /// itself when needed.
+  bool install(const SourceManager &SM, FileID FID) {
+    bool Invalid = false;
+    const SrcMgr::SLocEntry &Entry = SM.getSLocEntry(FID, &Invalid);
+    if (Invalid || !Entry.isFile())
+      return false;
+    const SrcMgr::ContentCache &Content = Entry.getFile().getContentCache();
+    if (Content.SourceLineCache)
+      return true;
+
+    // The table must match the buffer the SourceManager uses, whether it was
+    // read from the file or overridden.
+    Optional<llvm::MemoryBufferRef> Buffer =
+        Content.getBufferOrNone(SM.getDiagnostics(), SM.getFileManager());
+    if (!Buffer)
+      return false;
+    StringRef Data = Buffer->getBuffer();
+    Key K(Data.size(), llvm::xxHash64(Data));
+    {
+      std::lock_guard<std::mutex> LockGuard(Lock);
+      auto It = Mappings.find(K);
+      if (It != Mappings.end()) {
+        Content.SourceLineCache = It->second;
+        ++NumHits;
+        return true;
+      }
+      if (Alloc.getTotalMemory() >= MaxBytes)
+        return false;
+    }
+
+    // Scan outside the lock; if another thread won the race, its table is
+    // used and this one stays unused in the allocator.
+    SmallVector<unsigned, 256> LineOffsets;
+    LineOffsets.push_back(0);
+    forEachLineStart(Data, 0, Data.size(),
+                     [&](unsigned Offset) { LineOffsets.push_back(Offset); });
+
+    std::lock_guard<std::mutex> LockGuard(Lock);
+    auto Inserted = Mappings.emplace(K, SrcMgr::LineOffsetMapping());
+    if (Inserted.second)
+      Inserted.first->second = SrcMgr::LineOffsetMapping(LineOffsets, Alloc);
+    Content.SourceLineCache = Inserted.first->second;
+    return true;
+  }
+
+  /// Calls \c install for every local file entry of \p SM.
+  ///
+  /// \returns The number of files whose line table is available.
+  unsigned installAll(const SourceManager &SM) {
+    unsigned NumInstalled = 0;
+    for (unsigned I = 1, E = SM.local_sloc_entry_size(); I != E; ++I) {
+      const SrcMgr::SLocEntry &Entry = SM.getLocalSLocEntry(I);
+      if (!Entry.isFile())
+        continue;
+      FileID FID = SM.getFileID(
+          SourceLocation::getFromRawEncoding(Entry.getOffset()));
+      NumInstalled += install(SM, FID);
+    }
+    return NumInstalled;
+  }
+
+  /// Drops all cached tables. Only call this when none of the SourceManagers
+  /// that tables were installed into are alive anymore.
+  void clear() {
+    std::lock_guard<std::mutex> LockGuard(Lock);
+    Mappings.clear();
+    Alloc.Reset();
+  }
+
+  /// \returns The number of distinct buffers with a cached line table.
+  size_t size() const {
+    std::lock_guard<std::mutex> LockGuard(Lock);
+    return Mappings.size();
+  }
+
+  /// \returns The number of \c install calls served from the cache.
+  unsigned getNumHits() const {
+    std::lock_guard<std::mutex> LockGuard(Lock);
+    return NumHits;
+  }
+
+private:
+  /// The size of a buffer and the hash of its contents.
+  using Key = std::pair<size_t, uint64_t>;
+
+  const size_t MaxBytes;
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex Lock;
+  /// Owns the storage of all cached line tables.
+  llvm::BumpPtrAllocator Alloc;
+  std::map<Key, SrcMgr::LineOffsetMapping> Mappings;
+  unsigned NumHits = 0;
+};
+
+} // namespace clang
+
+#undef CLANG_LINEOFFSETINDEX_SSE2
+
+#endif // LLVM_CLANG_BASIC_LINEOFFSETINDEX_H
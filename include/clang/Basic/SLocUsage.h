@@ -0,0 +1,245 @@
+//===- SLocUsage.h - Source location address space usage --------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines SLocUsage, a breakdown of how the source location address space of
+/// a SourceManager is used by files and macro expansions.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_BASIC_SLOCUSAGE_H
+#define LLVM_CLANG_BASIC_SLOCUSAGE_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace clang {
+
+/// How the source location address space of a \c SourceManager is used.
+///
+/// Every file inclusion takes as much address space as the file is long, and
+/// every macro expansion takes as much as the tokens it produces. Local
+/// entries grow upwards from 0 and entries loaded from AST files grow
+/// downwards from the middle of the address space; "ran out of source
+/// locations" is reported when they meet. This report attributes the local
+/// space to the files that are included and to the files and macro
+/// definitions that expansions come from. Expansions of macros defined in AST
+/// files, such as a preamble or PCH, are counted together, so that no loaded
+/// entries are deserialized.
+struct SLocUsage {
+  /// The usage attributed to a single file.
+  struct FileUsage {
+    /// The first inclusion of the file.
+    FileID FID;
+    StringRef Name;
+    /// The number of times the file was entered.
+    unsigned NumInclusions = 0;
+    /// The space taken by the inclusions of the file.
+    uint64_t FileBytes = 0;
+    /// The number of macro expansions in the file.
+    unsigned NumExpansions = 0;
+    /// The space taken by the macro expansions in the file.
+    uint64_t ExpansionBytes = 0;
+
+    uint64_t getTotalBytes() const { return FileBytes + ExpansionBytes; }
+  };
+
+  /// The usage attributed to the expansions of the macro body tokens on one
+  /// line of a macro definition.
+  struct MacroUsage {
+    /// The start of the spelling of the expanded tokens.
+    SourceLocation SpellingLoc;
+    unsigned NumExpansions = 0;
+    uint64_t Bytes = 0;
+  };
+
+  /// The end of the local address space.
+  uint64_t LocalBytes = 0;
+  /// The space taken by entries loaded from AST files.
+  uint64_t LoadedBytes = 0;
+  /// The space that local entries can grow into before hitting the loaded
+  /// ones.
+  uint64_t LocalLimit = 0;
+  unsigned NumLocalEntries = 0;
+  unsigned NumLoadedEntries = 0;
+  /// The space taken by expansions of macro arguments.
+  uint64_t MacroArgBytes = 0;
+  /// The number of expansions of macros defined in AST files.
+  unsigned NumLoadedMacroExpansions = 0;
+  /// The space taken by expansions of macros defined in AST files.
+  uint64_t LoadedMacroBytes = 0;
+
+  /// Files by decreasing total usage.
+  std::vector<FileUsage> Files;
+  /// Macro definition lines by decreasing usage of their expansions.
+  std::vector<MacroUsage> Macros;
+
+  /// \returns The fraction of the local address space that is used.
+  double getLocalFraction() const {
+    return LocalLimit ? double(LocalBytes) / LocalLimit : 1.0;
+  }
+
+  /// Computes the usage of the address space of \p SM.
+  ///
+  /// \param Detailed If false, only the totals are computed, which is cheap
+  /// enough to do after every parse.
+  static SLocUsage compute(const SourceManager &SM, bool Detailed = true) {
+    SLocUsage Usage;
+    Usage.LocalBytes = SM.getNextLocalOffset();
+    Usage.NumLocalEntries = SM.local_sloc_entry_size();
+    Usage.NumLoadedEntries = SM.loaded_sloc_entry_size();
+    SourceLocation::UIntTy LoadedBegin = getLoadedBegin(SM);
+    Usage.LocalLimit = LoadedBegin;
+    Usage.LoadedBytes = getMaxLoadedOffset() - LoadedBegin;
+    if (!Detailed)
+      return Usage;
+
+    llvm::DenseMap<const SrcMgr::ContentCache *, unsigned> FileIndices;
+    llvm::DenseMap<std::pair<FileID, unsigned>, unsigned> MacroIndices;
+    auto GetFile = [&](FileID FID) -> FileUsage & {
+      const SrcMgr::FileInfo &Info = SM.getSLocEntry(FID).getFile();
+      auto Inserted =
+          FileIndices.try_emplace(&Info.getContentCache(), Usage.Files.size());
+      if (Inserted.second) {
+        Usage.Files.emplace_back();
+        Usage.Files.back().FID = FID;
+        Usage.Files.back().Name = Info.getName();
+      }
+      return Usage.Files[Inserted.first->second];
+    };
+
+    // Entry 0 is a sentinel.
+    for (unsigned I = 1, E = Usage.NumLocalEntries; I != E; ++I) {
+      const SrcMgr::SLocEntry &Entry = SM.getLocalSLocEntry(I);
+      uint64_t Size = (I + 1 != E ? SM.getLocalSLocEntry(I + 1).getOffset()
+                                  : Usage.LocalBytes) -
+                      Entry.getOffset();
+      if (Entry.isFile()) {
+        FileUsage &File = GetFile(SM.getFileID(
+            SourceLocation::getFromRawEncoding(Entry.getOffset())));
+        ++File.NumInclusions;
+        File.FileBytes += Size;
+        continue;
+      }
+
+      const SrcMgr::ExpansionInfo &Expansion = Entry.getExpansion();
+      FileID ExpandedIn =
+          SM.getFileID(SM.getExpansionLoc(Expansion.getExpansionLocStart()));
+      if (ExpandedIn.isValid() && SM.getSLocEntry(ExpandedIn).isFile()) {
+        FileUsage &File = GetFile(ExpandedIn);
+        ++File.NumExpansions;
+        File.ExpansionBytes += Size;
+      }
+      if (Expansion.isMacroArgExpansion()) {
+        Usage.MacroArgBytes += Size;
+        continue;
+      }
+
+      // Only follow local entries: looking up a loaded location would
+      // deserialize the entries around it.
+      SourceLocation Spelling = Expansion.getSpellingLoc();
+      while (Spelling.isMacroID() && !SM.isLoadedSourceLocation(Spelling))
+        Spelling = SM.getImmediateSpellingLoc(Spelling);
+      if (SM.isLoadedSourceLocation(Spelling)) {
+        ++Usage.NumLoadedMacroExpansions;
+        Usage.LoadedMacroBytes += Size;
+        continue;
+      }
+      std::pair<FileID, unsigned> Decomposed = SM.getDecomposedLoc(Spelling);
+      std::pair<FileID, unsigned> Key(
+          Decomposed.first,
+          SM.getLineNumber(Decomposed.first, Decomposed.second));
+      auto Inserted = MacroIndices.try_emplace(Key, Usage.Macros.size());
+      if (Inserted.second) {
+        Usage.Macros.emplace_back();
+        Usage.Macros.back().SpellingLoc = Spelling;
+      }
+      MacroUsage &Macro = Usage.Macros[Inserted.first->second];
+      ++Macro.NumExpansions;
+      Macro.Bytes += Size;
+    }
+
+    llvm::stable_sort(Usage.Files, [](const FileUsage &L, const FileUsage &R) {
+      return L.getTotalBytes() > R.getTotalBytes();
+    });
+    llvm::stable_sort(Usage.Macros,
+                      [](const MacroUsage &L, const MacroUsage &R) {
+                        return L.Bytes > R.Bytes;
+                      });
+    return Usage;
+  }
+
+  /// Prints the report, listing at most \p MaxEntries files and macros.
+  void print(raw_ostream &OS, const SourceManager &SM,
+             unsigned MaxEntries = 10) const {
+    OS << "*** Source location address space usage:\n";
+    OS << LocalBytes << " of " << LocalLimit << " bytes ("
+       << llvm::format("%.1f", 100 * getLocalFraction()) << "%) used by "
+       << NumLocalEntries << " local entries\n";
+    OS << LoadedBytes << " bytes used by " << NumLoadedEntries
+       << " loaded entries\n";
+    OS << MacroArgBytes << " bytes used by macro argument expansions\n";
+    OS << LoadedMacroBytes << " bytes used by " << NumLoadedMacroExpansions
+       << " expansions of macros defined in AST files\n";
+
+    if (!Files.empty())
+      OS << "Files:\n";
+    for (const FileUsage &File :
+         ArrayRef<FileUsage>(Files).take_front(MaxEntries))
+      OS << "  " << File.Name << ": " << File.FileBytes << " bytes in "
+         << File.NumInclusions << " inclusions, " << File.ExpansionBytes
+         << " bytes in " << File.NumExpansions << " macro expansions\n";
+
+    if (!Macros.empty())
+      OS << "Macro definitions:\n";
+    for (const MacroUsage &Macro :
+         ArrayRef<MacroUsage>(Macros).take_front(MaxEntries)) {
+      OS << "  ";
+      Macro.SpellingLoc.print(OS, SM);
+      OS << ": " << Macro.Bytes << " bytes in " << Macro.NumExpansions
+         << " expansions\n";
+    }
+  }
+
+private:
+  static SourceLocation::UIntTy getMaxLoadedOffset() {
+    return SourceLocation::UIntTy(1)
+           << (8 * sizeof(SourceLocation::UIntTy) - 1);
+  }
+
+  /// Returns the lowest offset of the loaded entries, which the
+  /// \c SourceManager does not expose directly.
+  static SourceLocation::UIntTy getLoadedBegin(const SourceManager &SM) {
+    // isLoadedSourceLocation compares against the beginning of the loaded
+    // entries, so binary search for the first offset it accepts.
+    SourceLocation::UIntTy Low = SM.getNextLocalOffset();
+    SourceLocation::UIntTy High = getMaxLoadedOffset();
+    while (Low < High) {
+      SourceLocation::UIntTy Mid = Low + (High - Low) / 2;
+      if (SM.isLoadedSourceLocation(SourceLocation::getFromRawEncoding(Mid)))
+        High = Mid;
+      else
+        Low = Mid + 1;
+    }
+    return Low;
+  }
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_BASIC_SLOCUSAGE_H
@@ -0,0 +1,270 @@
+//===- SharedBufferCache.h - Process-wide file buffer cache -----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines SharedBufferCache, a reference-counted cache of read-only file
+/// contents shared by every FileManager of a tool run, and the VFS adaptor
+/// that plugs it into FileManager and ClangTool.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_BASIC_SHAREDBUFFERCACHE_H
+#define LLVM_CLANG_BASIC_SHAREDBUFFERCACHE_H
+
+#include "clang/Basic/LLVM.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem/UniqueID.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+
+namespace clang {
+
+/// A thread-safe cache of file contents keyed by file identity.
+///
+/// Every \c SourceManager reads the files it needs into buffers of its own,
+/// so a multi-threaded tool run holds one copy of a popular header per
+/// thread; small files and files opened as volatile are even copied instead
+/// of mapped. This cache hands out read-only views of a single buffer per
+/// file instead. Buffers are reference counted: the cache only keeps a weak
+/// reference, so a file's contents are released once no \c SourceManager uses
+/// them any more.
+///
+/// Files are identified by their unique ID, size and modification time, so a
+/// file that is modified during the run is read again rather than served
+/// stale. The cache is sharded by file identity to reduce lock contention.
+class SharedBufferCache {
+public:
+  using BufferPtr = std::shared_ptr<const llvm::MemoryBuffer>;
+
+  explicit SharedBufferCache(unsigned NumShards = 0)
+      : NumShards(NumShards ? NumShards
+                            : std::max(2u, llvm::hardware_concurrency()
+                                                   .compute_thread_count() /
+                                               4)),
+        Shards(new CacheShard[this->NumShards]) {}
+
+  SharedBufferCache(const SharedBufferCache &) = delete;
+  SharedBufferCache &operator=(const SharedBufferCache &) = delete;
+
+  /// Returns the cache shared by the whole process.
+  static SharedBufferCache &getProcessCache() {
+    static SharedBufferCache Cache;
+    return Cache;
+  }
+
+  /// Identifies the contents of a file.
+  struct Key {
+    llvm::sys::fs::UniqueID UID;
+    llvm::sys::TimePoint<> ModTime;
+    uint64_t Size;
+
+    bool operator<(const Key &RHS) const {
+      return std::make_tuple(UID, ModTime, Size) <
+             std::make_tuple(RHS.UID, RHS.ModTime, RHS.Size);
+    }
+  };
+
+  /// Builds the key of the file described by \p Status.
+  static Key getKey(const llvm::vfs::Status &Status) {
+    return {Status.getUniqueID(), Status.getLastModificationTime(),
+            Status.getSize()};
+  }
+
+  /// Returns the live buffer for \p K, if any.
+  BufferPtr lookup(const Key &K) const {
+    const CacheShard &Shard = getShard(K);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto It = Shard.Entries.find(K);
+    if (It != Shard.Entries.end())
+      if (BufferPtr Buffer = It->second.lock()) {
+        Hits.fetch_add(1, std::memory_order_relaxed);
+        return Buffer;
+      }
+    Misses.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  /// Records \p Buffer as the contents of \p K.
+  ///
+  /// \returns The buffer to use, which is an existing one if another thread
+  /// recorded the same file in the meantime.
+  BufferPtr insert(const Key &K, std::unique_ptr<llvm::MemoryBuffer> Buffer) {
+    CacheShard &Shard = getShard(K);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    std::weak_ptr<const llvm::MemoryBuffer> &Entry = Shard.Entries[K];
+    if (BufferPtr Existing = Entry.lock())
+      return Existing;
+    BufferPtr Shared(std::move(Buffer));
+    Entry = Shared;
+    // Forget entries whose buffers were released, amortized over insertions.
+    if (++Shard.NumInsertions % 64 == 0) {
+      for (auto It = Shard.Entries.begin(); It != Shard.Entries.end();)
+        It = It->second.expired() ? Shard.Entries.erase(It) : std::next(It);
+    }
+    return Shared;
+  }
+
+  /// Returns a buffer named \p Name that refers to the contents of \p Shared
+  /// and keeps them alive.
+  static std::unique_ptr<llvm::MemoryBuffer>
+  makeView(BufferPtr Shared, const Twine &Name, bool RequiresNullTerminator) {
+    return std::make_unique<BufferView>(std::move(Shared), Name.str(),
+                                        RequiresNullTerminator);
+  }
+
+  /// \returns The number of lookups that found a live buffer.
+  uint64_t getNumHits() const { return Hits.load(std::memory_order_relaxed); }
+  /// \returns The number of lookups that did not find a live buffer.
+  uint64_t getNumMisses() const {
+    return Misses.load(std::memory_order_relaxed);
+  }
+
+  /// \returns The total size of the buffers currently held by clients.
+  uint64_t getLiveBytes() const {
+    uint64_t Bytes = 0;
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      for (const auto &Entry : Shards[I].Entries)
+        if (!Entry.second.expired())
+          Bytes += Entry.first.Size;
+    }
+    return Bytes;
+  }
+
+private:
+  /// A named view of a shared buffer.
+  class BufferView : public llvm::MemoryBuffer {
+  public:
+    BufferView(BufferPtr Shared, std::string Name,
+               bool RequiresNullTerminator)
+        : Shared(std::move(Shared)), Name(std::move(Name)) {
+      init(this->Shared->getBufferStart(), this->Shared->getBufferEnd(),
+           RequiresNullTerminator);
+    }
+
+    StringRef getBufferIdentifier() const override { return Name; }
+
+    BufferKind getBufferKind() const override {
+      return Shared->getBufferKind();
+    }
+
+  private:
+    BufferPtr Shared;
+    std::string Name;
+  };
+
+  struct CacheShard {
+    /// The mutex that needs to be locked before mutation of any member.
+    mutable std::mutex CacheLock;
+    /// Map from file identities to the buffers handed out for them.
+    std::map<Key, std::weak_ptr<const llvm::MemoryBuffer>> Entries;
+    unsigned NumInsertions = 0;
+  };
+
+  CacheShard &getShard(const Key &K) const {
+    return Shards[llvm::hash_combine(K.UID.getDevice(), K.UID.getFile()) %
+                  NumShards];
+  }
+
+  const unsigned NumShards;
+  std::unique_ptr<CacheShard[]> Shards;
+  mutable std::atomic<uint64_t> Hits{0};
+  mutable std::atomic<uint64_t> Misses{0};
+};
+
+/// A file system whose files return their contents from a
+/// \c SharedBufferCache.
+///
+/// Like \c SharedStatCacheFileSystem, an instance is meant to be used by a
+/// single thread while the cache it refers to is shared by all threads. To use
+/// it with \c ClangTool, pass it as the \c BaseFS constructor argument:
+///
+/// \code
+///   ClangTool Tool(Compilations, Files,
+///                  std::make_shared<PCHContainerOperations>(),
+///                  llvm::makeIntrusiveRefCnt<SharedBufferFileSystem>(
+///                      SharedBufferCache::getProcessCache(),
+///                      llvm::vfs::createPhysicalFileSystem()));
+/// \endcode
+///
+/// Requests for volatile buffers, and files that are not regular files, are
+/// passed through to the underlying file system.
+class SharedBufferFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+  SharedBufferFileSystem(SharedBufferCache &Cache,
+                         IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+      : ProxyFileSystem(std::move(FS)), Cache(Cache) {}
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const Twine &Path) override {
+    auto Result = ProxyFileSystem::openFileForRead(Path);
+    if (!Result)
+      return Result;
+    return std::unique_ptr<llvm::vfs::File>(
+        std::make_unique<SharedBufferFile>(std::move(*Result), Cache));
+  }
+
+private:
+  class SharedBufferFile : public llvm::vfs::File {
+  public:
+    SharedBufferFile(std::unique_ptr<llvm::vfs::File> F,
+                     SharedBufferCache &Cache)
+        : F(std::move(F)), Cache(Cache) {}
+
+    llvm::ErrorOr<llvm::vfs::Status> status() override { return F->status(); }
+
+    llvm::ErrorOr<std::string> getName() override { return F->getName(); }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+    getBuffer(const Twine &Name, int64_t FileSize, bool RequiresNullTerminator,
+              bool IsVolatile) override {
+      llvm::ErrorOr<llvm::vfs::Status> Status = F->status();
+      if (IsVolatile || !Status || !Status->isRegularFile())
+        return F->getBuffer(Name, FileSize, RequiresNullTerminator,
+                            IsVolatile);
+
+      SharedBufferCache::Key K = SharedBufferCache::getKey(*Status);
+      if (SharedBufferCache::BufferPtr Shared = Cache.lookup(K))
+        return SharedBufferCache::makeView(std::move(Shared), Name,
+                                           RequiresNullTerminator);
+
+      // Always read with a null terminator so that the shared buffer can
+      // serve every client.
+      auto Buffer = F->getBuffer(Name, Status->getSize(),
+                                 /*RequiresNullTerminator=*/true,
+                                 /*IsVolatile=*/false);
+      if (!Buffer || (*Buffer)->getBufferSize() != Status->getSize())
+        return Buffer;
+      return SharedBufferCache::makeView(Cache.insert(K, std::move(*Buffer)),
+                                         Name, RequiresNullTerminator);
+    }
+
+    std::error_code close() override { return F->close(); }
+
+  private:
+    std::unique_ptr<llvm::vfs::File> F;
+    SharedBufferCache &Cache;
+  };
+
+  SharedBufferCache &Cache;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_BASIC_SHAREDBUFFERCACHE_H
@@ -0,0 +1,269 @@
+//===- SharedStatCache.h - Thread-safe 'stat' cache -------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines SharedStatCache, a thread-safe cache of 'stat' and failed 'open'
+/// results that can be shared by every FileManager of a multi-threaded tool
+/// run, together with the FileSystemStatCache and VFS adaptors that plug it
+/// into FileManager and ClangTool.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_BASIC_SHAREDSTATCACHE_H
+#define LLVM_CLANG_BASIC_SHAREDSTATCACHE_H
+
+#include "clang/Basic/FileSystemStatCache.h"
+#include "clang/Basic/LLVM.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <system_error>
+
+namespace clang {
+
+/// A thread-safe cache of the results of 'stat' calls, keyed by absolute path.
+///
+/// Both successful lookups and lookups of paths that do not exist are cached;
+/// the latter is what makes repeated header search over long include paths
+/// cheap, since most probes miss. Other errors (e.g. permission problems) are
+/// not cached.
+///
+/// The cache is sharded by the hash of the path to reduce lock contention
+/// between worker threads. It assumes that the file system does not change
+/// while it is in use; call \c invalidate or \c clear otherwise.
+class SharedStatCache {
+public:
+  explicit SharedStatCache(unsigned NumShards = 0)
+      : NumShards(NumShards ? NumShards
+                            : std::max(2u, llvm::hardware_concurrency()
+                                                   .compute_thread_count() /
+                                               4)),
+        Shards(new CacheShard[this->NumShards]) {}
+
+  SharedStatCache(const SharedStatCache &) = delete;
+  SharedStatCache &operator=(const SharedStatCache &) = delete;
+
+  /// Returns the cached result for the absolute path \p Path, if any. The
+  /// name of a returned status is empty unless the file system reported a
+  /// name other than the requested path (e.g. an external name through a
+  /// redirecting file system); see \c withRequestedName.
+  Optional<llvm::ErrorOr<llvm::vfs::Status>> lookup(StringRef Path) const {
+    const CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto It = Shard.Entries.find(Path);
+    if (It == Shard.Entries.end()) {
+      Misses.fetch_add(1, std::memory_order_relaxed);
+      return None;
+    }
+    Hits.fetch_add(1, std::memory_order_relaxed);
+    return It->second;
+  }
+
+  /// Records the result of a 'stat' of the absolute path \p Path, which was
+  /// requested as \p RequestedPath. Results that are not worth caching are
+  /// ignored.
+  void insert(StringRef Path, const llvm::ErrorOr<llvm::vfs::Status> &Result,
+              StringRef RequestedPath) {
+    if (!Result && !isNegativeLookup(Result.getError()))
+      return;
+    llvm::ErrorOr<llvm::vfs::Status> Entry = Result;
+    if (Result && Result->getName() == RequestedPath)
+      Entry = llvm::vfs::Status::copyWithNewName(*Result, "");
+    CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    Shard.Entries.insert({Path, std::move(Entry)});
+  }
+
+  /// Forgets the cached result for \p Path.
+  void invalidate(StringRef Path) {
+    CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    Shard.Entries.erase(Path);
+  }
+
+  /// Forgets all cached results.
+  void clear() {
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      Shards[I].Entries.clear();
+    }
+  }
+
+  /// \returns The number of lookups that were answered from the cache.
+  uint64_t getNumHits() const { return Hits.load(std::memory_order_relaxed); }
+  /// \returns The number of lookups that were not answered from the cache.
+  uint64_t getNumMisses() const {
+    return Misses.load(std::memory_order_relaxed);
+  }
+
+  /// Returns the status \p Cached returned by \c lookup, named after the path
+  /// that was requested by the client.
+  static llvm::vfs::Status withRequestedName(const llvm::vfs::Status &Cached,
+                                             const Twine &RequestedPath) {
+    if (!Cached.getName().empty())
+      return Cached;
+    return llvm::vfs::Status::copyWithNewName(Cached, RequestedPath);
+  }
+
+  /// \returns True if \p EC means that the looked up path does not exist.
+  static bool isNegativeLookup(std::error_code EC) {
+    return EC == std::errc::no_such_file_or_directory ||
+           EC == std::errc::not_a_directory;
+  }
+
+private:
+  struct CacheShard {
+    /// The mutex that needs to be locked before mutation of any member.
+    mutable std::mutex CacheLock;
+    /// Map from absolute paths to cached 'stat' results.
+    llvm::StringMap<llvm::ErrorOr<llvm::vfs::Status>, llvm::BumpPtrAllocator>
+        Entries;
+  };
+
+  CacheShard &getShard(StringRef Path) const {
+    return Shards[llvm::hash_value(Path) % NumShards];
+  }
+
+  const unsigned NumShards;
+  std::unique_ptr<CacheShard[]> Shards;
+  mutable std::atomic<uint64_t> Hits{0};
+  mutable std::atomic<uint64_t> Misses{0};
+};
+
+/// A file system that answers 'stat' calls, and 'open' calls of files that do
+/// not exist, from a \c SharedStatCache before falling back to the underlying
+/// file system.
+///
+/// Like \c DependencyScanningWorkerFilesystem, an instance is meant to be used
+/// by a single thread (it has its own working directory), while the cache it
+/// refers to is shared by all threads. To use it with \c ClangTool, pass it as
+/// the \c BaseFS constructor argument:
+///
+/// \code
+///   SharedStatCache Cache;
+///   ClangTool Tool(Compilations, Files,
+///                  std::make_shared<PCHContainerOperations>(),
+///                  llvm::makeIntrusiveRefCnt<SharedStatCacheFileSystem>(
+///                      Cache, llvm::vfs::createPhysicalFileSystem()));
+/// \endcode
+class SharedStatCacheFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+  SharedStatCacheFileSystem(SharedStatCache &Cache,
+                            IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+      : ProxyFileSystem(std::move(FS)), Cache(Cache) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const Twine &Path) override {
+    SmallString<256> Key;
+    if (!getCacheKey(Path, Key))
+      return ProxyFileSystem::status(Path);
+    if (Optional<llvm::ErrorOr<llvm::vfs::Status>> Cached = Cache.lookup(Key)) {
+      if (!*Cached)
+        return Cached->getError();
+      return SharedStatCache::withRequestedName(**Cached, Path);
+    }
+    llvm::ErrorOr<llvm::vfs::Status> Result = ProxyFileSystem::status(Path);
+    Cache.insert(Key, Result, Path.str());
+    return Result;
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const Twine &Path) override {
+    SmallString<256> Key;
+    if (!getCacheKey(Path, Key))
+      return ProxyFileSystem::openFileForRead(Path);
+    if (Optional<llvm::ErrorOr<llvm::vfs::Status>> Cached = Cache.lookup(Key))
+      if (!*Cached)
+        return Cached->getError();
+    auto Result = ProxyFileSystem::openFileForRead(Path);
+    if (!Result)
+      Cache.insert(Key, Result.getError(), Path.str());
+    return Result;
+  }
+
+private:
+  /// Computes the absolute path used to key \p Path in the shared cache.
+  /// \returns False if the path cannot be made absolute.
+  bool getCacheKey(const Twine &Path, SmallVectorImpl<char> &Key) const {
+    Path.toVector(Key);
+    if (makeAbsolute(Key))
+      return false;
+    llvm::sys::path::remove_dots(Key, /*remove_dot_dot=*/false);
+    return true;
+  }
+
+  SharedStatCache &Cache;
+};
+
+/// Adapts a \c SharedStatCache to the \c FileSystemStatCache interface, for
+/// clients that install stat caches on a \c FileManager directly.
+///
+/// Note that \c FileManager::setStatCache takes ownership of the adaptor but
+/// not of the shared cache, and that \c ClangTool clears the stat cache of its
+/// file manager after each translation unit; use \c SharedStatCacheFileSystem
+/// there instead.
+class SharedFileSystemStatCache : public FileSystemStatCache {
+public:
+  explicit SharedFileSystemStatCache(SharedStatCache &Cache) : Cache(Cache) {}
+
+  std::error_code getStat(StringRef Path, llvm::vfs::Status &Status,
+                          bool isFile, std::unique_ptr<llvm::vfs::File> *F,
+                          llvm::vfs::FileSystem &FS) override {
+    SmallString<256> Key(Path);
+    bool Cacheable = !FS.makeAbsolute(Key);
+    if (Cacheable) {
+      llvm::sys::path::remove_dots(Key, /*remove_dot_dot=*/false);
+      if (Optional<llvm::ErrorOr<llvm::vfs::Status>> Cached =
+              Cache.lookup(Key)) {
+        if (!*Cached)
+          return Cached->getError();
+        Status = SharedStatCache::withRequestedName(**Cached, Path);
+        return std::error_code();
+      }
+    }
+
+    // Compute the raw result in the same way as FileSystemStatCache::get does
+    // without a cache; it checks the "directoryness" of the result itself.
+    llvm::ErrorOr<llvm::vfs::Status> Result = std::error_code();
+    if (!isFile || !F) {
+      Result = FS.status(Path);
+    } else {
+      auto OwnedFile = FS.openFileForRead(Path);
+      if (!OwnedFile) {
+        Result = OwnedFile.getError();
+      } else {
+        Result = (*OwnedFile)->status();
+        if (Result)
+          *F = std::move(*OwnedFile);
+      }
+    }
+
+    if (Cacheable)
+      Cache.insert(Key, Result, Path);
+    if (!Result)
+      return Result.getError();
+    Status = *Result;
+    return std::error_code();
+  }
+
+private:
+  SharedStatCache &Cache;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_BASIC_SHAREDSTATCACHE_H
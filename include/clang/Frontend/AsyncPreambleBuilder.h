@@ -0,0 +1,249 @@
+//===--- AsyncPreambleBuilder.h - Background preamble rebuilds --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Rebuilds precompiled preambles on a background thread while callers keep
+// parsing with the last preamble that was built.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_FRONTEND_ASYNCPREAMBLEBUILDER_H
+#define LLVM_CLANG_FRONTEND_ASYNCPREAMBLEBUILDER_H
+
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
+#include "clang/Frontend/PreambleStore.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+namespace clang {
+
+/// Keeps the preamble of a single main file up to date without blocking the
+/// callers that parse it.
+///
+/// When the current preamble cannot be reused for the latest contents of the
+/// main file, a new one is built on a background thread, and callers keep
+/// receiving the stale preamble until the new one is swapped in. Requests that
+/// arrive while a build is in progress replace each other, so only the most
+/// recent contents are built next.
+///
+/// A stale preamble is only handed out while the preamble region of the main
+/// file is byte for byte the one it was built from, e.g. when only a header
+/// it includes changed. The preprocessor skips the preamble region of the new
+/// contents, so a preamble built from other directives would silently drop
+/// the added ones; when the directives themselves changed, no preamble is
+/// handed out until the rebuilt one is available. A stale preamble still
+/// reflects the old contents of the headers it includes.
+class AsyncPreambleBuilder {
+public:
+  using PreamblePtr = std::shared_ptr<const PrecompiledPreamble>;
+
+  /// A preamble handed out by \c getPreamble.
+  struct Result {
+    /// The preamble to use, or null if none has been built yet or the built
+    /// one cannot be used for the requested contents.
+    PreamblePtr Preamble;
+    /// Whether \c Preamble is out of date for the requested contents.
+    bool IsStale = false;
+  };
+
+  /// \param Store If set, preambles are looked up in and added to this store.
+  AsyncPreambleBuilder(std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                       bool StoreInMemory = true,
+                       PreambleStore *Store = nullptr)
+      : PCHContainerOps(std::move(PCHContainerOps)),
+        StoreInMemory(StoreInMemory), Store(Store) {}
+
+  AsyncPreambleBuilder(const AsyncPreambleBuilder &) = delete;
+  AsyncPreambleBuilder &operator=(const AsyncPreambleBuilder &) = delete;
+
+  ~AsyncPreambleBuilder() {
+    {
+      std::lock_guard<std::mutex> LockGuard(BuildLock);
+      Next.reset();
+    }
+    wait();
+  }
+
+  /// Returns the preamble to use for \p MainFileBuffer compiled with
+  /// \p Invocation, scheduling a rebuild if the current preamble is not
+  /// reusable. Never blocks on a build.
+  Result getPreamble(const CompilerInvocation &Invocation,
+                     const llvm::MemoryBuffer &MainFileBuffer,
+                     IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS) {
+    PreambleBounds Bounds = ComputePreambleBounds(
+        *Invocation.getLangOpts(), MainFileBuffer.getMemBufferRef(), 0);
+    PreamblePtr Latest = getCurrentPreamble();
+    if (Latest && Latest->CanReuse(Invocation, MainFileBuffer.getMemBufferRef(),
+                                   Bounds, *VFS))
+      return {Latest, false};
+
+    PreambleStore::Key K = PreambleStore::computeKey(
+        Invocation, MainFileBuffer.getMemBufferRef(), Bounds);
+    std::lock_guard<std::mutex> LockGuard(BuildLock);
+    if (BuildingKey && *BuildingKey == K) {
+      // The preamble being built is the one we want; drop anything older
+      // that was queued behind it.
+      Next.reset();
+    } else {
+      Next = BuildRequest{std::make_shared<CompilerInvocation>(Invocation),
+                          llvm::MemoryBuffer::getMemBufferCopy(
+                              MainFileBuffer.getBuffer(),
+                              MainFileBuffer.getBufferIdentifier()),
+                          Bounds, std::move(VFS), K};
+      if (!Building) {
+        Building = true;
+        Worker = std::async(std::launch::async, [this] { runBuilds(); });
+      }
+    }
+    // Serving a preamble built from other directives would skip the new ones.
+    StringRef PreambleText =
+        MainFileBuffer.getBuffer().take_front(Bounds.Size);
+    if (Current && CurrentPreambleText == PreambleText &&
+        CurrentBounds.PreambleEndsAtStartOfLine ==
+            Bounds.PreambleEndsAtStartOfLine)
+      return {Current, true};
+    return {nullptr, true};
+  }
+
+  /// Configures \p CI and \p VFS to parse \p MainFileBuffer with the preamble
+  /// in \p R, if any.
+  static void apply(const Result &R, CompilerInvocation &CI,
+                    IntrusiveRefCntPtr<llvm::vfs::FileSystem> &VFS,
+                    llvm::MemoryBuffer *MainFileBuffer) {
+    if (!R.Preamble)
+      return;
+    if (R.IsStale)
+      R.Preamble->OverridePreamble(CI, VFS, MainFileBuffer);
+    else
+      R.Preamble->AddImplicitPreamble(CI, VFS, MainFileBuffer);
+  }
+
+  /// Returns the most recently built preamble, if any.
+  PreamblePtr getCurrentPreamble() const {
+    std::lock_guard<std::mutex> LockGuard(BuildLock);
+    return Current;
+  }
+
+  /// Blocks until all scheduled builds have finished.
+  void wait() {
+    std::shared_future<void> Pending;
+    {
+      std::lock_guard<std::mutex> LockGuard(BuildLock);
+      Pending = Worker;
+    }
+    if (Pending.valid())
+      Pending.wait();
+  }
+
+  /// Returns the error of the last build, if it failed.
+  std::error_code getLastError() const {
+    std::lock_guard<std::mutex> LockGuard(BuildLock);
+    return LastError;
+  }
+
+private:
+  struct BuildRequest {
+    std::shared_ptr<CompilerInvocation> Invocation;
+    std::unique_ptr<llvm::MemoryBuffer> MainFileBuffer;
+    PreambleBounds Bounds;
+    IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS;
+    PreambleStore::Key K;
+  };
+
+  /// Body of the background thread: builds requests until none are left.
+  void runBuilds() {
+    while (true) {
+      Optional<BuildRequest> Request;
+      {
+        std::lock_guard<std::mutex> LockGuard(BuildLock);
+        if (!Next) {
+          Building = false;
+          BuildingKey.reset();
+          return;
+        }
+        Request = std::move(Next);
+        Next.reset();
+        BuildingKey = Request->K;
+      }
+
+      // Diagnostics of background builds are dropped; parses that use the
+      // preamble report their own.
+      IgnoringDiagConsumer DiagConsumer;
+      IntrusiveRefCntPtr<DiagnosticsEngine> Diags =
+          CompilerInstance::createDiagnostics(new DiagnosticOptions,
+                                              &DiagConsumer,
+                                              /*ShouldOwnClient=*/false);
+      PreambleCallbacks Callbacks;
+      llvm::ErrorOr<PreamblePtr> Built = std::error_code();
+      if (Store) {
+        Built = Store->getOrBuild(*Request->Invocation,
+                                  Request->MainFileBuffer.get(),
+                                  Request->Bounds, *Diags, Request->VFS,
+                                  PCHContainerOps, StoreInMemory, Callbacks);
+      } else {
+        llvm::ErrorOr<PrecompiledPreamble> Preamble =
+            PrecompiledPreamble::Build(*Request->Invocation,
+                                       Request->MainFileBuffer.get(),
+                                       Request->Bounds, *Diags, Request->VFS,
+                                       PCHContainerOps, StoreInMemory,
+                                       Callbacks);
+        if (Preamble)
+          Built = std::make_shared<const PrecompiledPreamble>(
+              std::move(*Preamble));
+        else
+          Built = Preamble.getError();
+      }
+
+      std::lock_guard<std::mutex> LockGuard(BuildLock);
+      if (Built) {
+        Current = std::move(*Built);
+        CurrentPreambleText = Request->MainFileBuffer->getBuffer()
+                                  .take_front(Request->Bounds.Size)
+                                  .str();
+        CurrentBounds = Request->Bounds;
+        LastError = std::error_code();
+      } else {
+        LastError = Built.getError();
+      }
+    }
+  }
+
+  std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+  const bool StoreInMemory;
+  PreambleStore *Store;
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex BuildLock;
+  /// The most recently built preamble.
+  PreamblePtr Current;
+  /// The preamble region of the main file that Current was built from.
+  std::string CurrentPreambleText;
+  PreambleBounds CurrentBounds{0, false};
+  /// The request to build once the current build finishes.
+  Optional<BuildRequest> Next;
+  /// The key of the preamble that is currently being built.
+  Optional<PreambleStore::Key> BuildingKey;
+  /// Whether the background thread is running.
+  bool Building = false;
+  std::shared_future<void> Worker;
+  std::error_code LastError;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_FRONTEND_ASYNCPREAMBLEBUILDER_H
@@ -0,0 +1,406 @@
+//===--- ChainedPreambleBuilder.h - Incremental preamble builds -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// Builds precompiled preambles as PCHs chained on top of a PCH of the part of
+// the preamble that did not change since the previous build.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_FRONTEND_CHAINEDPREAMBLEBUILDER_H
+#define LLVM_CLANG_FRONTEND_CHAINEDPREAMBLEBUILDER_H
+
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/FrontendOptions.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
+#include "clang/Frontend/PreambleStore.h"
+#include "clang/Lex/HeaderSearch.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <algorithm>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace clang {
+
+/// A PCH of the leading directives of a preamble, which preambles with the
+/// same leading directives can be chained on.
+///
+/// The directives are compiled as a header that lives next to the main file
+/// (so that quoted includes resolve in the same way), and that only exists
+/// in the file system returned by \c overlay. The PCH is a temporary file
+/// that is removed once the prefix, and every preamble chained on it, is
+/// destroyed.
+class PreamblePrefix {
+public:
+  PreamblePrefix(const PreamblePrefix &) = delete;
+  PreamblePrefix &operator=(const PreamblePrefix &) = delete;
+
+  ~PreamblePrefix() {
+    if (!PCHPath.empty())
+      llvm::sys::fs::remove(PCHPath);
+  }
+
+  /// Builds a PCH of \p Text, the leading part of the preamble of the main
+  /// file of \p Invocation.
+  ///
+  /// \returns null if the PCH could not be built, or if chaining preambles on
+  /// it would be unsafe because a header included by \p Text has no include
+  /// guard (it would be entered a second time by the chained build).
+  static std::shared_ptr<const PreamblePrefix>
+  build(const CompilerInvocation &Invocation, StringRef Text,
+        IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS,
+        std::shared_ptr<PCHContainerOperations> PCHContainerOps) {
+    const FrontendOptions &FrontendOpts = Invocation.getFrontendOpts();
+    if (FrontendOpts.Inputs.size() != 1 || !FrontendOpts.Inputs[0].isFile())
+      return nullptr;
+    const FrontendInputFile &MainInput = FrontendOpts.Inputs[0];
+
+    std::shared_ptr<PreamblePrefix> Prefix(new PreamblePrefix);
+    Prefix->Text = Text.str();
+    Prefix->K = PreambleStore::computeKey(
+        Invocation, llvm::MemoryBufferRef(Text, MainInput.getFile()),
+        PreambleBounds(Text.size(), /*PreambleEndsAtStartOfLine=*/true));
+    SmallString<256> HeaderPath(MainInput.getFile());
+    HeaderPath += ".preamble-prefix.h";
+    if (VFS->makeAbsolute(HeaderPath))
+      return nullptr;
+    Prefix->HeaderPath = std::string(HeaderPath);
+    SmallString<128> PCHPath;
+    if (llvm::sys::fs::createTemporaryFile("preamble-prefix", "pch", PCHPath))
+      return nullptr;
+    Prefix->PCHPath = std::string(PCHPath);
+
+    auto CI = std::make_shared<CompilerInvocation>(Invocation);
+    FrontendOptions &PrefixFrontendOpts = CI->getFrontendOpts();
+    PrefixFrontendOpts.Inputs.clear();
+    PrefixFrontendOpts.Inputs.emplace_back(Prefix->HeaderPath,
+                                           MainInput.getKind().getHeader());
+    PrefixFrontendOpts.ProgramAction = frontend::GeneratePCH;
+    PrefixFrontendOpts.OutputFile = Prefix->PCHPath;
+    PreprocessorOptions &PPOpts = CI->getPreprocessorOpts();
+    PPOpts.PrecompiledPreambleBytes = {0, false};
+    PPOpts.GeneratePreamble = false;
+
+    // The prefix is built speculatively; its diagnostics are reported again
+    // by the builds of the preambles that contain it.
+    IgnoringDiagConsumer DiagConsumer;
+    CompilerInstance Clang(std::move(PCHContainerOps));
+    Clang.setInvocation(std::move(CI));
+    Clang.createDiagnostics(&DiagConsumer, /*ShouldOwnClient=*/false);
+    Clang.createFileManager(Prefix->overlay(std::move(VFS)));
+
+    PrefixAction Action(*Prefix);
+    if (!Clang.ExecuteAction(Action) ||
+        Clang.getDiagnostics().hasErrorOccurred() || !Action.IsSafe)
+      return nullptr;
+    return Prefix;
+  }
+
+  /// \returns The text of the directives compiled into the PCH.
+  StringRef getText() const { return Text; }
+
+  /// \returns The path of the PCH.
+  StringRef getPCHPath() const { return PCHPath; }
+
+  /// Checks whether a preamble of \p PreambleText built with \p Invocation
+  /// can be chained on this prefix, i.e. whether it starts with the same
+  /// directives, is compiled with the same options, and none of the files
+  /// compiled into the PCH changed.
+  bool canChain(const CompilerInvocation &Invocation, StringRef PreambleText,
+                llvm::vfs::FileSystem &VFS) const {
+    if (!PreambleText.startswith(Text))
+      return false;
+    StringRef MainFile = Invocation.getFrontendOpts().Inputs[0].getFile();
+    PreambleStore::Key Current = PreambleStore::computeKey(
+        Invocation, llvm::MemoryBufferRef(Text, MainFile),
+        PreambleBounds(Text.size(), /*PreambleEndsAtStartOfLine=*/true));
+    if (Current != K)
+      return false;
+    for (const Dependency &Dep : Dependencies) {
+      llvm::ErrorOr<llvm::vfs::Status> Status = VFS.status(Dep.Path);
+      if (!Status || Status->getSize() != Dep.Size ||
+          llvm::sys::toTimeT(Status->getLastModificationTime()) !=
+              Dep.ModificationTime)
+        return false;
+    }
+    return true;
+  }
+
+  /// Returns \p VFS overlaid with the header holding the prefix directives,
+  /// which the PCH refers to.
+  IntrusiveRefCntPtr<llvm::vfs::FileSystem>
+  overlay(IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS) const {
+    auto Header = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+    Header->addFile(HeaderPath, /*ModificationTime=*/0,
+                    llvm::MemoryBuffer::getMemBufferCopy(Text, HeaderPath));
+    auto Overlay =
+        llvm::makeIntrusiveRefCnt<llvm::vfs::OverlayFileSystem>(std::move(VFS));
+    Overlay->pushOverlay(std::move(Header));
+    return Overlay;
+  }
+
+private:
+  /// A file compiled into the PCH, as it was when the PCH was built.
+  struct Dependency {
+    std::string Path;
+    uint64_t Size;
+    time_t ModificationTime;
+  };
+
+  /// Generates the PCH and records what is needed to validate it.
+  class PrefixAction : public GeneratePCHAction {
+  public:
+    explicit PrefixAction(PreamblePrefix &Prefix) : Prefix(Prefix) {}
+
+    bool IsSafe = true;
+
+  protected:
+    void EndSourceFileAction() override {
+      CompilerInstance &CI = getCompilerInstance();
+      SourceManager &SM = CI.getSourceManager();
+      HeaderSearch &HS = CI.getPreprocessor().getHeaderSearchInfo();
+      FileID MainFID = SM.getMainFileID();
+
+      // A chained build enters the main file from the start, so it includes
+      // the headers included directly by the prefix again. That is only a
+      // no-op for headers that have an include guard or '#pragma once'.
+      for (unsigned I = 0, N = SM.local_sloc_entry_size(); I != N; ++I) {
+        const SrcMgr::SLocEntry &Entry = SM.getLocalSLocEntry(I);
+        if (!Entry.isFile())
+          continue;
+        const SrcMgr::FileInfo &File = Entry.getFile();
+        SourceLocation IncludeLoc = File.getIncludeLoc();
+        if (IncludeLoc.isInvalid() || SM.getFileID(IncludeLoc) != MainFID)
+          continue;
+        const FileEntry *FE = File.getContentCache().OrigEntry;
+        if (!FE)
+          continue;
+        const HeaderFileInfo &HFI = HS.getFileInfo(FE);
+        if (!HFI.isPragmaOnce && !HFI.ControllingMacro &&
+            !HFI.ControllingMacroID)
+          IsSafe = false;
+      }
+
+      for (auto It = SM.fileinfo_begin(), E = SM.fileinfo_end(); It != E;
+           ++It) {
+        const FileEntry *FE = It->first;
+        if (FE->getName() == Prefix.HeaderPath || SM.isFileOverridden(FE))
+          continue;
+        Prefix.Dependencies.push_back(
+            {FE->getName().str(), static_cast<uint64_t>(FE->getSize()),
+             FE->getModificationTime()});
+      }
+      GeneratePCHAction::EndSourceFileAction();
+    }
+
+  private:
+    PreamblePrefix &Prefix;
+  };
+
+  PreamblePrefix() = default;
+
+  std::string Text;
+  /// The key of \c Text and the options it was compiled with.
+  PreambleStore::Key K;
+  std::string HeaderPath;
+  std::string PCHPath;
+  std::vector<Dependency> Dependencies;
+};
+
+/// A precompiled preamble that may be chained on a \c PreamblePrefix.
+///
+/// Use the members of this class rather than those of the underlying
+/// \c PrecompiledPreamble: they make the PCH of the prefix reachable and
+/// validate it too.
+class ChainedPreamble {
+public:
+  ChainedPreamble(std::shared_ptr<const PrecompiledPreamble> Preamble,
+                  std::shared_ptr<const PreamblePrefix> Prefix)
+      : Preamble(std::move(Preamble)), Prefix(std::move(Prefix)) {}
+
+  const PrecompiledPreamble &getPreamble() const { return *Preamble; }
+
+  /// \returns The prefix this preamble is chained on, or null if it was built
+  /// from scratch.
+  const PreamblePrefix *getPrefix() const { return Prefix.get(); }
+
+  /// Like \c PrecompiledPreamble::CanReuse.
+  bool CanReuse(const CompilerInvocation &Invocation,
+                const llvm::MemoryBufferRef &MainFileBuffer,
+                PreambleBounds Bounds,
+                IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS) const {
+    if (!Prefix)
+      return Preamble->CanReuse(Invocation, MainFileBuffer, Bounds, *VFS);
+    return Prefix->canChain(Invocation,
+                            MainFileBuffer.getBuffer().take_front(Bounds.Size),
+                            *VFS) &&
+           Preamble->CanReuse(Invocation, MainFileBuffer, Bounds,
+                              *Prefix->overlay(VFS));
+  }
+
+  /// Like \c PrecompiledPreamble::AddImplicitPreamble.
+  void AddImplicitPreamble(CompilerInvocation &CI,
+                           IntrusiveRefCntPtr<llvm::vfs::FileSystem> &VFS,
+                           llvm::MemoryBuffer *MainFileBuffer) const {
+    if (Prefix)
+      VFS = Prefix->overlay(std::move(VFS));
+    Preamble->AddImplicitPreamble(CI, VFS, MainFileBuffer);
+  }
+
+  /// Like \c PrecompiledPreamble::OverridePreamble.
+  void OverridePreamble(CompilerInvocation &CI,
+                        IntrusiveRefCntPtr<llvm::vfs::FileSystem> &VFS,
+                        llvm::MemoryBuffer *MainFileBuffer) const {
+    if (Prefix)
+      VFS = Prefix->overlay(std::move(VFS));
+    Preamble->OverridePreamble(CI, VFS, MainFileBuffer);
+  }
+
+private:
+  std::shared_ptr<const PrecompiledPreamble> Preamble;
+  /// Keeps the PCH the preamble is chained on alive.
+  std::shared_ptr<const PreamblePrefix> Prefix;
+};
+
+/// Builds the preambles of a single main file, reusing the work done for the
+/// directives that did not change since the previous build.
+///
+/// After each full build, the builder compiles the leading directives that
+/// the new preamble shares with the previous one into a \c PreamblePrefix.
+/// Later preambles that start with the same directives are built with the PCH
+/// of the prefix as implicit PCH include, which makes \c ASTWriter emit a PCH
+/// chained on it: the headers of the prefix are skipped thanks to their
+/// include guards, and only the directives after the prefix are parsed.
+///
+/// A full build is done instead when the prefix changed, when any of its
+/// files changed, when it includes a header without include guard, or when
+/// the chained build fails without reporting an error.
+///
+/// Diagnostics of a chained build only cover the directives after the
+/// prefix. The PCH of the prefix is a temporary file that must be reachable
+/// through the file systems passed to the preambles. This class is not
+/// thread-safe.
+class ChainedPreambleBuilder {
+public:
+  explicit ChainedPreambleBuilder(
+      std::shared_ptr<PCHContainerOperations> PCHContainerOps)
+      : PCHContainerOps(std::move(PCHContainerOps)) {}
+
+  /// Builds the preamble of \p MainFileBuffer. The parameters are as for
+  /// \c PrecompiledPreamble::Build.
+  llvm::ErrorOr<ChainedPreamble>
+  build(const CompilerInvocation &Invocation,
+        const llvm::MemoryBuffer *MainFileBuffer, PreambleBounds Bounds,
+        DiagnosticsEngine &Diagnostics,
+        IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS, bool StoreInMemory,
+        PreambleCallbacks &Callbacks) {
+    StringRef Text = MainFileBuffer->getBuffer().take_front(Bounds.Size);
+
+    if (Prefix && Prefix->canChain(Invocation, Text, *VFS)) {
+      CompilerInvocation CI(Invocation);
+      PreprocessorOptions &PPOpts = CI.getPreprocessorOpts();
+      PPOpts.ImplicitPCHInclude = Prefix->getPCHPath().str();
+      // The files compiled into the prefix were validated by canChain.
+      PPOpts.DisablePCHOrModuleValidation = DisableValidationForModuleKind::PCH;
+
+      DiagnosticConsumer *Client = Diagnostics.getClient();
+      unsigned ErrorsBefore = Client ? Client->getNumErrors() : 0;
+      llvm::ErrorOr<PrecompiledPreamble> Chained = PrecompiledPreamble::Build(
+          CI, MainFileBuffer, Bounds, Diagnostics, Prefix->overlay(VFS),
+          PCHContainerOps, StoreInMemory, Callbacks);
+      if (Chained) {
+        ++NumChainedBuilds;
+        LastText = Text.str();
+        return ChainedPreamble(
+            std::make_shared<const PrecompiledPreamble>(std::move(*Chained)),
+            Prefix);
+      }
+      Prefix.reset();
+      // Errors in the new directives would be reported by a full build too.
+      if (Client && Client->getNumErrors() != ErrorsBefore)
+        return Chained.getError();
+    }
+
+    llvm::ErrorOr<PrecompiledPreamble> Full = PrecompiledPreamble::Build(
+        Invocation, MainFileBuffer, Bounds, Diagnostics, VFS, PCHContainerOps,
+        StoreInMemory, Callbacks);
+    if (!Full)
+      return Full.getError();
+    ++NumFullBuilds;
+
+    StringRef Stable = getStablePrefix(LastText, Text);
+    if (Stable.empty())
+      Prefix.reset();
+    else if (!Prefix || Prefix->getText() != Stable ||
+             !Prefix->canChain(Invocation, Stable, *VFS))
+      Prefix = PreamblePrefix::build(Invocation, Stable, VFS, PCHContainerOps);
+    LastText = Text.str();
+    return ChainedPreamble(
+        std::make_shared<const PrecompiledPreamble>(std::move(*Full)),
+        nullptr);
+  }
+
+  /// \returns The prefix the next preamble may be chained on, if any.
+  std::shared_ptr<const PreamblePrefix> getPrefix() const { return Prefix; }
+
+  /// \returns The number of preambles built from scratch.
+  unsigned getNumFullBuilds() const { return NumFullBuilds; }
+
+  /// \returns The number of preambles chained on a prefix.
+  unsigned getNumChainedBuilds() const { return NumChainedBuilds; }
+
+private:
+  /// Returns the leading lines that \p Previous and \p Current share, not
+  /// counting a trailing line that is continued on the next one.
+  static StringRef getStablePrefix(StringRef Previous, StringRef Current) {
+    size_t Common = 0;
+    size_t Max = std::min(Previous.size(), Current.size());
+    while (Common != Max && Previous[Common] == Current[Common])
+      ++Common;
+    StringRef Stable = Current.take_front(Common);
+    while (true) {
+      size_t LastNewline = Stable.rfind('\n');
+      if (LastNewline == StringRef::npos)
+        return StringRef();
+      Stable = Stable.take_front(LastNewline + 1);
+      if (!Stable.rtrim("\r\n").endswith("\\"))
+        break;
+      Stable = Stable.rtrim("\r\n");
+    }
+    if (Stable.trim().empty())
+      return StringRef();
+    return Stable;
+  }
+
+  std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+  /// The prefix the next preamble may be chained on.
+  std::shared_ptr<const PreamblePrefix> Prefix;
+  /// The text of the most recently built preamble.
+  std::string LastText;
+  unsigned NumFullBuilds = 0;
+  unsigned NumChainedBuilds = 0;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_FRONTEND_CHAINEDPREAMBLEBUILDER_H
@@ -0,0 +1,250 @@
+//===--- PreambleStore.h - Shared precompiled preambles ---------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// A content-addressed store that lets many clients share one
+// PrecompiledPreamble per distinct preamble.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_FRONTEND_PREAMBLESTORE_H
+#define LLVM_CLANG_FRONTEND_PREAMBLESTORE_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+
+namespace clang {
+
+/// A thread-safe, content-addressed store of precompiled preambles.
+///
+/// Preambles are keyed by a hash of the preamble text and of the compiler
+/// invocation (as a cc1 command line, which includes the main file), and are
+/// validated against the current file system with
+/// \c PrecompiledPreamble::CanReuse on lookup, which covers the files the
+/// preamble was built from. Clients that open the same file with the same
+/// options therefore share a single preamble instead of building and holding
+/// byte-identical copies.
+///
+/// Stored preambles are reference counted: evicting a preamble only drops the
+/// store's reference, and preambles that are still in use are never evicted.
+/// When the total size of the stored preambles that are not in use (in memory
+/// or on disk, as reported by \c PrecompiledPreamble::getSize) exceeds the
+/// size budget, the least recently used of them are evicted. Preambles in use
+/// do not count against the budget.
+class PreambleStore {
+public:
+  using PreamblePtr = std::shared_ptr<const PrecompiledPreamble>;
+
+  /// The content hash used to look up preambles.
+  using Key = llvm::MD5::MD5Result;
+
+  /// \param SizeBudget The total size, in bytes, of unused preambles that may
+  /// be kept in the store.
+  explicit PreambleStore(std::size_t SizeBudget) : SizeBudget(SizeBudget) {}
+
+  PreambleStore(const PreambleStore &) = delete;
+  PreambleStore &operator=(const PreambleStore &) = delete;
+
+  /// Computes the key of the preamble of \p MainFileBuffer with \p Bounds,
+  /// built with \p Invocation.
+  static Key computeKey(const CompilerInvocation &Invocation,
+                        const llvm::MemoryBufferRef &MainFileBuffer,
+                        PreambleBounds Bounds) {
+    llvm::MD5 Hash;
+    Hash.update(MainFileBuffer.getBuffer().take_front(Bounds.Size));
+    Hash.update(StringRef(Bounds.PreambleEndsAtStartOfLine ? "\1" : "\0", 1));
+
+    llvm::BumpPtrAllocator Alloc;
+    llvm::StringSaver Saver(Alloc);
+    SmallVector<const char *, 64> Args;
+    Invocation.generateCC1CommandLine(
+        Args, [&](const Twine &Arg) { return Saver.save(Arg).data(); });
+    for (const char *Arg : Args) {
+      Hash.update(StringRef(Arg));
+      Hash.update(StringRef("\0", 1));
+    }
+    return Hash.final();
+  }
+
+  /// Returns a stored preamble that can be reused for the given inputs, or
+  /// null if there is none.
+  PreamblePtr lookup(const Key &K, const CompilerInvocation &Invocation,
+                     const llvm::MemoryBufferRef &MainFileBuffer,
+                     PreambleBounds Bounds, llvm::vfs::FileSystem &VFS) {
+    SmallVector<PreamblePtr, 2> Candidates;
+    {
+      std::lock_guard<std::mutex> LockGuard(StoreLock);
+      auto It = EntriesByKey.find(toMapKey(K));
+      if (It != EntriesByKey.end())
+        for (EntryIterator E : It->second)
+          Candidates.push_back(E->Preamble);
+    }
+
+    // Validation touches the file system, so do it without holding the lock.
+    for (PreamblePtr &Candidate : Candidates) {
+      if (!Candidate->CanReuse(Invocation, MainFileBuffer, Bounds, VFS))
+        continue;
+      std::lock_guard<std::mutex> LockGuard(StoreLock);
+      ++NumHits;
+      touch(K, Candidate.get());
+      return std::move(Candidate);
+    }
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    ++NumMisses;
+    return nullptr;
+  }
+
+  /// Adds \p Preamble to the store under \p K and returns the shared copy.
+  PreamblePtr insert(const Key &K, PrecompiledPreamble Preamble) {
+    auto Shared = std::make_shared<const PrecompiledPreamble>(
+        std::move(Preamble));
+    std::size_t Size = Shared->getSize();
+
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    LRU.push_front(Entry{K, Shared, Size});
+    EntriesByKey[toMapKey(K)].push_back(LRU.begin());
+    TotalSize += Size;
+    evict();
+    return Shared;
+  }
+
+  /// Returns a stored preamble for the given inputs, building and storing a
+  /// new one with \c PrecompiledPreamble::Build if necessary. \p Callbacks
+  /// are only invoked if a new preamble is built.
+  llvm::ErrorOr<PreamblePtr>
+  getOrBuild(const CompilerInvocation &Invocation,
+             const llvm::MemoryBuffer *MainFileBuffer, PreambleBounds Bounds,
+             DiagnosticsEngine &Diagnostics,
+             IntrusiveRefCntPtr<llvm::vfs::FileSystem> VFS,
+             std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+             bool StoreInMemory, PreambleCallbacks &Callbacks) {
+    Key K = computeKey(Invocation, MainFileBuffer->getMemBufferRef(), Bounds);
+    if (PreamblePtr Stored = lookup(K, Invocation,
+                                    MainFileBuffer->getMemBufferRef(), Bounds,
+                                    *VFS))
+      return Stored;
+
+    llvm::ErrorOr<PrecompiledPreamble> Built = PrecompiledPreamble::Build(
+        Invocation, MainFileBuffer, Bounds, Diagnostics, VFS,
+        std::move(PCHContainerOps), StoreInMemory, Callbacks);
+    if (!Built)
+      return Built.getError();
+    return insert(K, std::move(*Built));
+  }
+
+  /// Changes the size budget, evicting preambles as needed.
+  void setSizeBudget(std::size_t Budget) {
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    SizeBudget = Budget;
+    evict();
+  }
+
+  /// Drops the store's references to all preambles that are not in use.
+  void clear() {
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    std::size_t Budget = SizeBudget;
+    SizeBudget = 0;
+    evict();
+    SizeBudget = Budget;
+  }
+
+  /// \returns The number of stored preambles.
+  std::size_t size() const {
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    return LRU.size();
+  }
+
+  /// \returns The total size, in bytes, of the stored preambles.
+  std::size_t getTotalSize() const {
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    return TotalSize;
+  }
+
+  /// \returns The number of lookups that found a reusable preamble.
+  unsigned getNumHits() const {
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    return NumHits;
+  }
+
+  /// \returns The number of lookups that did not find a reusable preamble.
+  unsigned getNumMisses() const {
+    std::lock_guard<std::mutex> LockGuard(StoreLock);
+    return NumMisses;
+  }
+
+private:
+  struct Entry {
+    Key K;
+    PreamblePtr Preamble;
+    std::size_t Size;
+  };
+  using EntryIterator = std::list<Entry>::iterator;
+  using MapKey = std::pair<uint64_t, uint64_t>;
+
+  static MapKey toMapKey(const Key &K) { return {K.high(), K.low()}; }
+
+  /// Moves the entry holding \p Preamble to the front of the LRU list.
+  void touch(const Key &K, const PrecompiledPreamble *Preamble) {
+    auto It = EntriesByKey.find(toMapKey(K));
+    if (It == EntriesByKey.end())
+      return;
+    for (EntryIterator E : It->second)
+      if (E->Preamble.get() == Preamble)
+        LRU.splice(LRU.begin(), LRU, E);
+  }
+
+  /// Evicts least recently used preambles that are not in use until their
+  /// total size fits the budget.
+  void evict() {
+    // Evicting a preamble that is still in use would not free anything, so
+    // only unused ones count against the budget.
+    std::size_t UnusedSize = 0;
+    for (const Entry &E : LRU)
+      if (E.Preamble.use_count() == 1)
+        UnusedSize += E.Size;
+    for (auto It = LRU.end(); UnusedSize > SizeBudget && It != LRU.begin();) {
+      --It;
+      if (It->Preamble.use_count() > 1)
+        continue;
+      auto &Bucket = EntriesByKey[toMapKey(It->K)];
+      llvm::erase_value(Bucket, It);
+      if (Bucket.empty())
+        EntriesByKey.erase(toMapKey(It->K));
+      UnusedSize -= It->Size;
+      TotalSize -= It->Size;
+      It = LRU.erase(It);
+    }
+  }
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex StoreLock;
+  /// Stored preambles, most recently used first.
+  std::list<Entry> LRU;
+  /// Map from content hashes to the entries stored under them.
+  llvm::DenseMap<MapKey, SmallVector<EntryIterator, 1>> EntriesByKey;
+  std::size_t TotalSize = 0;
+  std::size_t SizeBudget;
+  unsigned NumHits = 0;
+  unsigned NumMisses = 0;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_FRONTEND_PREAMBLESTORE_H
@@ -0,0 +1,295 @@
+//===- HeaderSearchIndex.h - Index of header search directories -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines HeaderSearchIndex, a shared index of the contents of header search
+/// directories that answers most header search misses without touching the
+/// file system, and HeaderSearchIndexFileSystem, which applies it to the
+/// 'stat' and 'open' calls made by HeaderSearch::LookupFile.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_LEX_HEADERSEARCHINDEX_H
+#define LLVM_CLANG_LEX_HEADERSEARCHINDEX_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Lex/DirectoryLookup.h"
+#include "clang/Lex/HeaderSearch.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+namespace clang {
+
+/// A thread-safe index of the contents of a set of search directories.
+///
+/// \c HeaderSearch::LookupFile probes every search directory in turn, so with
+/// long include paths most probes are misses. For a path below one of the
+/// indexed search directories, the index answers whether the path can exist by
+/// checking each path component against a cached listing of its parent
+/// directory. Each directory is listed at most once (search directories
+/// eagerly, subdirectories lazily on first use), no matter how many
+/// translation units or threads query it.
+///
+/// Listings record the modification time of their directory; call
+/// \c invalidateChangedDirectories between runs to drop listings of
+/// directories in which entries were added or removed.
+class HeaderSearchIndex {
+public:
+  /// \param CaseInsensitive Whether file names should be compared ignoring
+  ///                        case, as on Windows file systems.
+  explicit HeaderSearchIndex(bool CaseInsensitive =
+#ifdef _WIN32
+                                 true
+#else
+                                 false
+#endif
+                             )
+      : CaseInsensitive(CaseInsensitive) {}
+
+  HeaderSearchIndex(const HeaderSearchIndex &) = delete;
+  HeaderSearchIndex &operator=(const HeaderSearchIndex &) = delete;
+
+  /// Adds \p Dir as a search directory and indexes its contents.
+  void addSearchDirectory(StringRef Dir, llvm::vfs::FileSystem &FS) {
+    SmallString<256> Key;
+    if (!makeKey(Dir, FS, Key))
+      return;
+    {
+      std::lock_guard<std::mutex> LockGuard(IndexLock);
+      if (!Roots.insert(Key).second)
+        return;
+    }
+    getListing(Key, FS);
+  }
+
+  /// Adds every normal and framework directory searched by \p HS.
+  void addSearchDirectories(const HeaderSearch &HS,
+                            llvm::vfs::FileSystem &FS) {
+    for (const DirectoryLookup &DL : HS.search_dir_range())
+      if (!DL.isHeaderMap())
+        addSearchDirectory(DL.getName(), FS);
+  }
+
+  /// Checks whether \p Path may exist.
+  ///
+  /// \returns None if \p Path is not below an indexed search directory, false
+  ///          if it is known not to exist, true if it may exist.
+  Optional<bool> mayExist(const Twine &Path, llvm::vfs::FileSystem &FS) {
+    SmallString<256> Key;
+    if (!makeKey(Path, FS, Key))
+      return None;
+
+    // Find the innermost indexed search directory containing Path.
+    StringRef Root = llvm::sys::path::parent_path(Key);
+    {
+      std::lock_guard<std::mutex> LockGuard(IndexLock);
+      while (!Root.empty() && !Roots.count(Root))
+        Root = llvm::sys::path::parent_path(Root);
+    }
+    if (Root.empty())
+      return None;
+
+    SmallString<256> Dir(Root);
+    StringRef Rest = StringRef(Key).drop_front(Root.size());
+    for (auto I = llvm::sys::path::begin(Rest), E = llvm::sys::path::end(Rest);
+         I != E; ++I) {
+      if (llvm::sys::path::is_separator((*I)[0]))
+        continue;
+      if (*I == "..")
+        return None;
+      std::shared_ptr<const DirectoryListing> Listing = getListing(Dir, FS);
+      if (!Listing)
+        return None;
+      if (Listing->Missing || !Listing->Entries.count(*I)) {
+        NumNegativeLookups.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      llvm::sys::path::append(Dir, *I);
+    }
+    return true;
+  }
+
+  /// Drops the listings of directories whose modification time changed, or
+  /// which appeared or disappeared, since they were listed.
+  void invalidateChangedDirectories(llvm::vfs::FileSystem &FS) {
+    std::vector<std::pair<std::string, std::shared_ptr<const DirectoryListing>>>
+        Snapshot;
+    {
+      std::lock_guard<std::mutex> LockGuard(IndexLock);
+      for (const auto &Entry : Listings)
+        Snapshot.emplace_back(Entry.getKey().str(), Entry.getValue());
+    }
+    for (const auto &Entry : Snapshot) {
+      llvm::ErrorOr<llvm::vfs::Status> Status = FS.status(Entry.first);
+      bool Unchanged = Entry.second->Missing
+                           ? !Status
+                           : Status && Status->getLastModificationTime() ==
+                                           Entry.second->ModificationTime;
+      if (!Unchanged)
+        invalidate(Entry.first);
+    }
+  }
+
+  /// Drops the listing of the directory \p Dir, which must be given as an
+  /// absolute path.
+  void invalidate(StringRef Dir) {
+    SmallString<256> Key(Dir);
+    normalize(Key);
+    std::lock_guard<std::mutex> LockGuard(IndexLock);
+    Listings.erase(Key);
+  }
+
+  /// Drops all listings. Search directories remain registered and are listed
+  /// again on demand.
+  void clear() {
+    std::lock_guard<std::mutex> LockGuard(IndexLock);
+    Listings.clear();
+  }
+
+  /// \returns The number of directories that are currently listed.
+  size_t getNumListedDirectories() const {
+    std::lock_guard<std::mutex> LockGuard(IndexLock);
+    return Listings.size();
+  }
+
+  /// \returns The number of lookups that were answered negatively without
+  ///          accessing the file system.
+  uint64_t getNumNegativeLookups() const {
+    return NumNegativeLookups.load(std::memory_order_relaxed);
+  }
+
+private:
+  /// The names of the entries of a single directory.
+  struct DirectoryListing {
+    /// Whether the directory does not exist.
+    bool Missing = false;
+    /// The modification time of the directory when it was listed.
+    llvm::sys::TimePoint<> ModificationTime;
+    /// The (case-folded, if case-insensitive) names of the entries.
+    llvm::StringSet<> Entries;
+  };
+
+  /// Returns the listing of the normalized directory \p Dir, listing it if
+  /// necessary, or nullptr if it could not be listed.
+  std::shared_ptr<const DirectoryListing>
+  getListing(StringRef Dir, llvm::vfs::FileSystem &FS) {
+    {
+      std::lock_guard<std::mutex> LockGuard(IndexLock);
+      auto It = Listings.find(Dir);
+      if (It != Listings.end())
+        return It->second;
+    }
+
+    auto Listing = std::make_shared<DirectoryListing>();
+    llvm::ErrorOr<llvm::vfs::Status> Status = FS.status(Dir);
+    if (!Status) {
+      if (Status.getError() != std::errc::no_such_file_or_directory)
+        return nullptr;
+      Listing->Missing = true;
+    } else if (!Status->isDirectory()) {
+      // A file where a directory is expected: nothing can exist below it.
+      Listing->Missing = true;
+    } else {
+      Listing->ModificationTime = Status->getLastModificationTime();
+      std::error_code EC;
+      for (llvm::vfs::directory_iterator I = FS.dir_begin(Dir, EC), E;
+           !EC && I != E; I.increment(EC)) {
+        StringRef Name = llvm::sys::path::filename(I->path());
+        Listing->Entries.insert(CaseInsensitive ? Name.lower() : Name.str());
+      }
+      if (EC)
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> LockGuard(IndexLock);
+    // Another thread may have listed the same directory in the meantime.
+    auto Inserted = Listings.insert({Dir, std::move(Listing)});
+    return Inserted.first->second;
+  }
+
+  /// Computes the normalized absolute form of \p Path used as index key.
+  /// \returns False if the path cannot be made absolute.
+  bool makeKey(const Twine &Path, llvm::vfs::FileSystem &FS,
+               SmallVectorImpl<char> &Key) const {
+    Path.toVector(Key);
+    if (FS.makeAbsolute(Key))
+      return false;
+    normalize(Key);
+    return true;
+  }
+
+  void normalize(SmallVectorImpl<char> &Key) const {
+    llvm::sys::path::native(Key);
+    llvm::sys::path::remove_dots(Key, /*remove_dot_dot=*/false);
+    if (CaseInsensitive)
+      for (char &C : Key)
+        C = llvm::toLower(C);
+  }
+
+  const bool CaseInsensitive;
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex IndexLock;
+  /// The indexed search directories.
+  llvm::StringSet<> Roots;
+  /// Map from normalized directory paths to their listings.
+  llvm::StringMap<std::shared_ptr<const DirectoryListing>> Listings;
+
+  std::atomic<uint64_t> NumNegativeLookups{0};
+};
+
+/// A file system that fails 'stat' and 'open' calls for paths that a
+/// \c HeaderSearchIndex knows do not exist, without accessing the underlying
+/// file system.
+///
+/// An instance is meant to be used by a single thread, while the index may be
+/// shared by all threads. Layer it below a \c FileManager (e.g. as the
+/// \c BaseFS of a \c ClangTool) to make header search misses a hash probe.
+class HeaderSearchIndexFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+  HeaderSearchIndexFileSystem(HeaderSearchIndex &Index,
+                              IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+      : ProxyFileSystem(std::move(FS)), Index(Index) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const Twine &Path) override {
+    if (isKnownMissing(Path))
+      return std::make_error_code(std::errc::no_such_file_or_directory);
+    return ProxyFileSystem::status(Path);
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const Twine &Path) override {
+    if (isKnownMissing(Path))
+      return std::make_error_code(std::errc::no_such_file_or_directory);
+    return ProxyFileSystem::openFileForRead(Path);
+  }
+
+private:
+  bool isKnownMissing(const Twine &Path) {
+    Optional<bool> MayExist = Index.mayExist(Path, getUnderlyingFS());
+    return MayExist && !*MayExist;
+  }
+
+  HeaderSearchIndex &Index;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_LEX_HEADERSEARCHINDEX_H
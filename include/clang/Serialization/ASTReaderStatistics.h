@@ -0,0 +1,325 @@
+//===- ASTReaderStatistics.h - Counters for AST deserialization -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+//  This file defines ASTReaderStatistics, an AST deserialization listener that
+//  counts what the ASTReader deserializes, by kind, and measures what
+//  individual queries cost.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_SERIALIZATION_ASTREADERSTATISTICS_H
+#define LLVM_CLANG_SERIALIZATION_ASTREADERSTATISTICS_H
+
+#include "clang/AST/DeclBase.h"
+#include "clang/AST/Type.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Serialization/ASTDeserializationListener.h"
+#include "clang/Serialization/ASTReader.h"
+#include "clang/Serialization/ModuleFile.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+namespace clang {
+
+/// Counts the entities that an \c ASTReader deserializes.
+///
+/// Install it by returning it from
+/// \c ASTConsumer::GetASTDeserializationListener, which lets the frontend
+/// chain it with its own listeners, such as the one of
+/// \c -dump-deserialized-pch-decls.
+///
+/// Besides the totals, declarations and types are counted per kind, and
+/// \c measure reports what a single query, such as a name lookup or a
+/// \c RecursiveASTVisitor walk, made the reader deserialize and how long it
+/// took:
+///
+/// \code
+///   class StatsConsumer : public ASTConsumer {
+///   public:
+///     ASTDeserializationListener *GetASTDeserializationListener() override {
+///       return &Stats;
+///     }
+///     void HandleTranslationUnit(ASTContext &Ctx) override {
+///       ASTReaderStatistics::Sample S = Stats.measure([&] {
+///         Ctx.getTranslationUnitDecl()->lookup(&Ctx.Idents.get("foo"));
+///       });
+///       S.Deserialized.print(llvm::errs());
+///     }
+///
+///   private:
+///     ASTReaderStatistics Stats;
+///   };
+/// \endcode
+///
+/// With \p EmitTraceEvents set and the time trace profiler enabled, each
+/// notification is also recorded as an event of the time trace, and each
+/// measured query as a section that contains them. The profiler only keeps
+/// events that last at least its granularity (500 microseconds by default
+/// with \c -ftime-trace), so the zero-length notification events are only
+/// recorded with \c -ftime-trace-granularity=0; otherwise they are dropped
+/// but still cost a begin and an end per deserialized entity, and only the
+/// query sections that took long enough remain.
+class ASTReaderStatistics : public ASTDeserializationListener {
+public:
+  /// The number of entities deserialized, by kind.
+  struct Counts {
+    unsigned Identifiers = 0;
+    unsigned Macros = 0;
+    unsigned Types = 0;
+    unsigned Decls = 0;
+    unsigned Selectors = 0;
+    unsigned MacroDefinitions = 0;
+    unsigned Submodules = 0;
+    unsigned ModuleImports = 0;
+    unsigned DeclsByKind[Decl::lastDecl + 1] = {};
+    unsigned TypesByClass[Type::TypeLast + 1] = {};
+
+    Counts &operator-=(const Counts &RHS) {
+      Identifiers -= RHS.Identifiers;
+      Macros -= RHS.Macros;
+      Types -= RHS.Types;
+      Decls -= RHS.Decls;
+      Selectors -= RHS.Selectors;
+      MacroDefinitions -= RHS.MacroDefinitions;
+      Submodules -= RHS.Submodules;
+      ModuleImports -= RHS.ModuleImports;
+      for (unsigned I = 0; I != std::size(DeclsByKind); ++I)
+        DeclsByKind[I] -= RHS.DeclsByKind[I];
+      for (unsigned I = 0; I != std::size(TypesByClass); ++I)
+        TypesByClass[I] -= RHS.TypesByClass[I];
+      return *this;
+    }
+
+    /// Prints the non-zero counts, most frequent kinds first.
+    void print(raw_ostream &OS) const {
+      OS << "  " << Identifiers << " identifiers\n"
+         << "  " << Macros << " macros\n"
+         << "  " << Selectors << " selectors\n"
+         << "  " << MacroDefinitions << " macro definitions\n"
+         << "  " << Submodules << " submodules, " << ModuleImports
+         << " module imports\n";
+      OS << "  " << Types << " types\n";
+      printByKind(OS, TypesByClass, [](unsigned TC) {
+        return getTypeClassName(static_cast<Type::TypeClass>(TC));
+      });
+      OS << "  " << Decls << " declarations\n";
+      printByKind(OS, DeclsByKind, [](unsigned K) {
+        return getDeclKindName(static_cast<Decl::Kind>(K));
+      });
+    }
+
+  private:
+    template <size_t N, typename NameFn>
+    static void printByKind(raw_ostream &OS, const unsigned (&ByKind)[N],
+                            NameFn Name) {
+      SmallVector<std::pair<unsigned, unsigned>, 32> Sorted;
+      for (unsigned I = 0; I != N; ++I)
+        if (ByKind[I])
+          Sorted.emplace_back(ByKind[I], I);
+      llvm::sort(Sorted, [](const std::pair<unsigned, unsigned> &L,
+                            const std::pair<unsigned, unsigned> &R) {
+        return L.first > R.first || (L.first == R.first && L.second < R.second);
+      });
+      for (const auto &Entry : Sorted)
+        OS << "    " << Entry.first << " " << Name(Entry.second) << "\n";
+    }
+  };
+
+  /// What a query made the reader deserialize, and how long it took.
+  struct Sample {
+    Counts Deserialized;
+    std::chrono::nanoseconds WallTime;
+  };
+
+  explicit ASTReaderStatistics(bool EmitTraceEvents = false)
+      : EmitTraceEvents(EmitTraceEvents) {}
+
+  /// Installs this object as the deserialization listener of \p Reader,
+  /// forwarding to the listener that was installed before. The reader does
+  /// not own this object.
+  ///
+  /// Only use this if the reader does not own its current listener, e.g.
+  /// when the client installed it, or there is none. The reader deletes a
+  /// listener it owns, such as the one of \c -dump-deserialized-pch-decls,
+  /// when another one is installed, and this object would then forward to a
+  /// deleted listener. Prefer \c ASTConsumer::GetASTDeserializationListener.
+  void attach(ASTReader &Reader) {
+    Previous = Reader.getDeserializationListener();
+    Reader.setDeserializationListener(this);
+    this->Reader = &Reader;
+  }
+
+  /// Returns the counts since this object was created.
+  const Counts &getCounts() const { return Current; }
+
+  /// Runs \p Query and returns what it made the reader deserialize.
+  template <typename Fn> Sample measure(Fn &&Query, StringRef Name = "") {
+    Counts Before = Current;
+    auto Start = std::chrono::steady_clock::now();
+    {
+      Optional<llvm::TimeTraceScope> Scope;
+      if (EmitTraceEvents)
+        Scope.emplace("ASTReaderQuery", Name);
+      std::forward<Fn>(Query)();
+    }
+    Sample S;
+    S.WallTime = std::chrono::steady_clock::now() - Start;
+    S.Deserialized = Current;
+    S.Deserialized -= Before;
+    return S;
+  }
+
+  /// Returns the size of the AST files that the reader loaded.
+  uint64_t getNumBytesLoaded() const {
+    uint64_t Bytes = 0;
+    if (Reader)
+      for (const serialization::ModuleFile &MF : Reader->getModuleManager())
+        Bytes += MF.Buffer->getBufferSize();
+    return Bytes;
+  }
+
+  /// Prints the counts, and how they compare to the number of entities in
+  /// the AST files.
+  void print(raw_ostream &OS) const {
+    OS << "*** AST Reader Deserialization Statistics:\n";
+    if (Reader) {
+      OS << "  " << Reader->getModuleManager().size() << " AST files, "
+         << getNumBytesLoaded() << " bytes\n";
+      printRatio(OS, "identifiers", Current.Identifiers,
+                 Reader->getTotalNumIdentifiers());
+      printRatio(OS, "macros", Current.Macros, Reader->getTotalNumMacros());
+      printRatio(OS, "types", Current.Types, Reader->getTotalNumTypes());
+      printRatio(OS, "declarations", Current.Decls,
+                 Reader->getTotalNumDecls());
+      printRatio(OS, "selectors", Current.Selectors,
+                 Reader->getTotalNumSelectors());
+      printRatio(OS, "submodules", Current.Submodules,
+                 Reader->getTotalNumSubmodules());
+    }
+    Current.print(OS);
+  }
+
+  void ReaderInitialized(ASTReader *Reader) override {
+    this->Reader = Reader;
+    if (Previous)
+      Previous->ReaderInitialized(Reader);
+  }
+  void IdentifierRead(serialization::IdentID ID, IdentifierInfo *II) override {
+    ++Current.Identifiers;
+    trace("DeserializeIdentifier");
+    if (Previous)
+      Previous->IdentifierRead(ID, II);
+  }
+  void MacroRead(serialization::MacroID ID, MacroInfo *MI) override {
+    ++Current.Macros;
+    trace("DeserializeMacro");
+    if (Previous)
+      Previous->MacroRead(ID, MI);
+  }
+  void TypeRead(serialization::TypeIdx Idx, QualType T) override {
+    ++Current.Types;
+    if (!T.isNull()) {
+      ++Current.TypesByClass[T->getTypeClass()];
+      trace("DeserializeType", getTypeClassName(T->getTypeClass()));
+    }
+    if (Previous)
+      Previous->TypeRead(Idx, T);
+  }
+  void DeclRead(serialization::DeclID ID, const Decl *D) override {
+    ++Current.Decls;
+    ++Current.DeclsByKind[D->getKind()];
+    trace("DeserializeDecl", getDeclKindName(D->getKind()));
+    if (Previous)
+      Previous->DeclRead(ID, D);
+  }
+  void SelectorRead(serialization::SelectorID ID, Selector Sel) override {
+    ++Current.Selectors;
+    trace("DeserializeSelector");
+    if (Previous)
+      Previous->SelectorRead(ID, Sel);
+  }
+  void MacroDefinitionRead(serialization::PreprocessedEntityID ID,
+                           MacroDefinitionRecord *MD) override {
+    ++Current.MacroDefinitions;
+    trace("DeserializeMacroDefinition");
+    if (Previous)
+      Previous->MacroDefinitionRead(ID, MD);
+  }
+  void ModuleRead(serialization::SubmoduleID ID, Module *Mod) override {
+    ++Current.Submodules;
+    trace("DeserializeSubmodule");
+    if (Previous)
+      Previous->ModuleRead(ID, Mod);
+  }
+  void ModuleImportRead(serialization::SubmoduleID ID,
+                        SourceLocation ImportLoc) override {
+    ++Current.ModuleImports;
+    if (Previous)
+      Previous->ModuleImportRead(ID, ImportLoc);
+  }
+
+private:
+  static StringRef getTypeClassName(Type::TypeClass TC) {
+    switch (TC) {
+#define TYPE(Class, Base)                                                      \
+  case Type::Class:                                                            \
+    return #Class;
+#define ABSTRACT_TYPE(Class, Base)
+#include "clang/AST/TypeNodes.inc"
+    }
+    llvm_unreachable("unknown type class");
+  }
+
+  static StringRef getDeclKindName(Decl::Kind K) {
+    switch (K) {
+#define DECL(Derived, Base)                                                    \
+  case Decl::Derived:                                                          \
+    return #Derived;
+#define ABSTRACT_DECL(Decl)
+#include "clang/AST/DeclNodes.inc"
+    }
+    llvm_unreachable("unknown decl kind");
+  }
+
+  static void printRatio(raw_ostream &OS, StringRef What, unsigned Read,
+                         unsigned Total) {
+    OS << "  " << Read << "/" << Total << " " << What << " read";
+    if (Total)
+      OS << llvm::format(" (%f%%)", (double)Read * 100.0 / Total);
+    OS << "\n";
+  }
+
+  /// Records a zero-length event in the time trace, which the profiler drops
+  /// unless its granularity is zero.
+  void trace(StringRef Name, StringRef Detail = "") {
+    if (!EmitTraceEvents || !llvm::timeTraceProfilerEnabled())
+      return;
+    llvm::timeTraceProfilerBegin(Name, Detail);
+    llvm::timeTraceProfilerEnd();
+  }
+
+  bool EmitTraceEvents;
+  ASTReader *Reader = nullptr;
+  ASTDeserializationListener *Previous = nullptr;
+  Counts Current;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_SERIALIZATION_ASTREADERSTATISTICS_H
@@ -0,0 +1,467 @@
+//===- InputFileValidationCache.h - Trusted input file stats ----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+/// \file
+/// Defines InputFileValidationCache, which remembers the input files of AST
+/// files that were validated recently, and the file system that lets the
+/// ASTReader skip their 'stat' calls while they are trusted.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_SERIALIZATION_INPUTFILEVALIDATIONCACHE_H
+#define LLVM_CLANG_SERIALIZATION_INPUTFILEVALIDATIONCACHE_H
+
+#include "clang/Basic/FileEntry.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Serialization/ModuleFile.h"
+#include "clang/Serialization/ModuleManager.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace clang {
+
+/// A thread-safe record of the input files of AST files that were validated
+/// recently, keyed by absolute path.
+///
+/// When the \c ASTReader loads a PCH or module, it checks the size and
+/// modification time of each input file recorded in it, which takes one
+/// 'stat' per input file and load. This cache remembers the size and
+/// modification time of the input files that were found up to date, and when
+/// they were checked; for a configurable trust window afterwards, the
+/// \c InputFileValidationFileSystem answers 'stat' calls of these files from
+/// the cache. Once the window has passed, the next 'stat' goes to the file
+/// system again and renews the entry if the file did not change, or drops it
+/// otherwise.
+///
+/// The trust window trades freshness for speed, like
+/// \c -fmodules-validate-once-per-build-session: a file modified while it is
+/// trusted is seen as unchanged until the window ends, so an AST file that
+/// depends on it is not rebuilt and may be used with contents that no longer
+/// match. A zero window disables the cache.
+///
+/// The cache can be shared by every thread of a process (see \c getGlobal),
+/// and saved to a file so that the next process trusts the same files until
+/// their window ends.
+class InputFileValidationCache {
+public:
+  explicit InputFileValidationCache(
+      std::chrono::seconds TrustWindow = std::chrono::seconds(0),
+      unsigned NumShards = 0)
+      : TrustWindow(TrustWindow),
+        NumShards(NumShards ? NumShards
+                            : std::max(2u, llvm::hardware_concurrency()
+                                                   .compute_thread_count() /
+                                               4)),
+        Shards(new CacheShard[this->NumShards]) {}
+
+  InputFileValidationCache(const InputFileValidationCache &) = delete;
+  InputFileValidationCache &
+  operator=(const InputFileValidationCache &) = delete;
+
+  /// Returns the cache shared by the whole process. Its trust window is zero
+  /// until it is set.
+  static InputFileValidationCache &getGlobal() {
+    static InputFileValidationCache Global;
+    return Global;
+  }
+
+  /// Sets how long an input file is trusted after it was validated.
+  void setTrustWindow(std::chrono::seconds Window) {
+    TrustWindow.store(Window, std::memory_order_relaxed);
+  }
+  std::chrono::seconds getTrustWindow() const {
+    return TrustWindow.load(std::memory_order_relaxed);
+  }
+
+  /// Returns the status of the absolute path \p Path if it is trusted, i.e.
+  /// it was validated within the trust window. The name of the status is
+  /// \p Path.
+  Optional<llvm::vfs::Status> lookup(StringRef Path) const {
+    const CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto It = Shard.Entries.find(Path);
+    if (It == Shard.Entries.end() || !isTrusted(It->second)) {
+      Misses.fetch_add(1, std::memory_order_relaxed);
+      return None;
+    }
+    Hits.fetch_add(1, std::memory_order_relaxed);
+    const Entry &E = It->second;
+    return llvm::vfs::Status(Path, llvm::sys::fs::UniqueID(E.Device, E.File),
+                             llvm::sys::toTimePoint(E.ModTime), /*User=*/0,
+                             /*Group=*/0, E.Size,
+                             llvm::sys::fs::file_type::regular_file,
+                             llvm::sys::fs::perms::all_read);
+  }
+
+  /// Records that the file at the absolute path \p Path was found up to date
+  /// with the given size and modification time.
+  void insert(StringRef Path, uint64_t Size, time_t ModTime,
+              llvm::sys::fs::UniqueID UID) {
+    Entry E;
+    E.Size = Size;
+    E.ModTime = ModTime;
+    E.Device = UID.getDevice();
+    E.File = UID.getFile();
+    E.ValidatedAt = now();
+    CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    Shard.Entries[Path] = E;
+  }
+
+  /// Records the input files that the AST files in \p Modules found up to
+  /// date, e.g. after the \c ASTReader loaded a PCH or module. Relative paths
+  /// are made absolute with \p FS.
+  ///
+  /// Only call this if the \c ASTReader validated input files; with
+  /// validation disabled, the files it loaded were not checked.
+  void insert(const serialization::ModuleManager &Modules,
+              llvm::vfs::FileSystem &FS) {
+    for (const serialization::ModuleFile &MF : Modules) {
+      for (const serialization::InputFile &IF : MF.InputFilesLoaded) {
+        if (IF.isOverridden() || IF.isOutOfDate() || IF.isNotFound())
+          continue;
+        Optional<FileEntryRef> File = IF.getFile();
+        if (!File)
+          continue;
+        SmallString<256> Key;
+        if (!getCacheKey(FS, File->getName(), Key))
+          continue;
+        insert(Key, File->getSize(), File->getModificationTime(),
+               File->getUniqueID());
+      }
+    }
+  }
+
+  /// Renews the entry for \p Path after a fresh 'stat' returned \p Result:
+  /// the file is trusted again if it has not changed, and forgotten
+  /// otherwise. Paths without an entry are ignored.
+  void revalidate(StringRef Path,
+                  const llvm::ErrorOr<llvm::vfs::Status> &Result) {
+    CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto It = Shard.Entries.find(Path);
+    if (It == Shard.Entries.end())
+      return;
+    Entry &E = It->second;
+    if (Result && Result->isRegularFile() && Result->getSize() == E.Size &&
+        llvm::sys::toTimeT(Result->getLastModificationTime()) == E.ModTime) {
+      E.Device = Result->getUniqueID().getDevice();
+      E.File = Result->getUniqueID().getFile();
+      E.ValidatedAt = now();
+      Revalidations.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    Shard.Entries.erase(It);
+  }
+
+  /// Forgets the entry for \p Path.
+  void invalidate(StringRef Path) {
+    CacheShard &Shard = getShard(Path);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    Shard.Entries.erase(Path);
+  }
+
+  /// Forgets all entries.
+  void clear() {
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      Shards[I].Entries.clear();
+    }
+  }
+
+  /// Writes the entries that are still trusted to \p FileName, replacing it
+  /// atomically.
+  llvm::Error save(StringRef FileName) const {
+    SmallString<0> Contents;
+    llvm::raw_svector_ostream OS(Contents);
+    llvm::support::endian::Writer LE(OS, llvm::support::little);
+    OS << "CIFV";
+    LE.write<uint32_t>(Version);
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      for (const auto &KV : Shards[I].Entries) {
+        const Entry &E = KV.second;
+        if (!isTrusted(E))
+          continue;
+        LE.write<uint32_t>(KV.first().size());
+        OS << KV.first();
+        LE.write<uint64_t>(E.Size);
+        LE.write<int64_t>(E.ModTime);
+        LE.write<uint64_t>(E.Device);
+        LE.write<uint64_t>(E.File);
+        LE.write<int64_t>(E.ValidatedAt);
+      }
+    }
+
+    SmallString<128> TempPath;
+    int FD;
+    if (std::error_code EC = llvm::sys::fs::createUniqueFile(
+            FileName + "-%%%%%%%%", FD, TempPath))
+      return llvm::errorCodeToError(EC);
+    {
+      llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+      Out << Contents;
+      Out.close();
+      if (Out.has_error()) {
+        Out.clear_error();
+        llvm::sys::fs::remove(TempPath);
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "failed writing %s",
+                                       TempPath.c_str());
+      }
+    }
+    if (std::error_code EC = llvm::sys::fs::rename(TempPath, FileName)) {
+      llvm::sys::fs::remove(TempPath);
+      return llvm::errorCodeToError(EC);
+    }
+    return llvm::Error::success();
+  }
+
+  /// Adds the entries saved to \p FileName by \c save, keeping the most
+  /// recently validated entry of each path. A missing file is not an error.
+  llvm::Error load(StringRef FileName) {
+    auto Buffer = llvm::MemoryBuffer::getFile(
+        FileName, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buffer) {
+      if (Buffer.getError() == std::errc::no_such_file_or_directory)
+        return llvm::Error::success();
+      return llvm::errorCodeToError(Buffer.getError());
+    }
+
+    using namespace llvm::support;
+    StringRef Data = (*Buffer)->getBuffer();
+    auto Malformed = [&] {
+      return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                     "malformed validation cache %s",
+                                     FileName.str().c_str());
+    };
+    if (Data.size() < 8 || !Data.startswith("CIFV") ||
+        endian::read32le(Data.data() + 4) != Version)
+      return Malformed();
+    Data = Data.drop_front(8);
+    while (!Data.empty()) {
+      if (Data.size() < 4)
+        return Malformed();
+      uint32_t PathLength = endian::read32le(Data.data());
+      if (Data.size() - 4 < uint64_t(PathLength) + EntrySize)
+        return Malformed();
+      StringRef Path = Data.substr(4, PathLength);
+      const char *P = Data.data() + 4 + PathLength;
+      Entry E;
+      E.Size = endian::read64le(P);
+      E.ModTime = static_cast<time_t>(endian::read64le(P + 8));
+      E.Device = endian::read64le(P + 16);
+      E.File = endian::read64le(P + 24);
+      E.ValidatedAt = static_cast<int64_t>(endian::read64le(P + 32));
+      Data = Data.drop_front(4 + PathLength + EntrySize);
+
+      CacheShard &Shard = getShard(Path);
+      std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+      auto Inserted = Shard.Entries.try_emplace(Path, E);
+      if (!Inserted.second &&
+          Inserted.first->second.ValidatedAt < E.ValidatedAt)
+        Inserted.first->second = E;
+    }
+    return llvm::Error::success();
+  }
+
+  /// \returns The number of 'stat' calls that were answered from the cache.
+  uint64_t getNumHits() const { return Hits.load(std::memory_order_relaxed); }
+  /// \returns The number of 'stat' calls that were not answered from the
+  /// cache.
+  uint64_t getNumMisses() const {
+    return Misses.load(std::memory_order_relaxed);
+  }
+  /// \returns The number of entries that were trusted again after their
+  /// window ended.
+  uint64_t getNumRevalidations() const {
+    return Revalidations.load(std::memory_order_relaxed);
+  }
+
+  /// Computes the absolute path used to key \p Path in the cache.
+  /// \returns False if the path cannot be made absolute.
+  static bool getCacheKey(const llvm::vfs::FileSystem &FS, const Twine &Path,
+                          SmallVectorImpl<char> &Key) {
+    Path.toVector(Key);
+    if (FS.makeAbsolute(Key))
+      return false;
+    llvm::sys::path::remove_dots(Key, /*remove_dot_dot=*/false);
+    return true;
+  }
+
+private:
+  /// The version of the format written by \c save.
+  static constexpr uint32_t Version = 1;
+  /// The size of an entry written by \c save, after its path.
+  static constexpr unsigned EntrySize = 40;
+
+  struct Entry {
+    uint64_t Size;
+    time_t ModTime;
+    uint64_t Device;
+    uint64_t File;
+    /// When the file was last found up to date, in seconds since the Epoch.
+    int64_t ValidatedAt;
+  };
+
+  struct CacheShard {
+    /// The mutex that needs to be locked before mutation of any member.
+    mutable std::mutex CacheLock;
+    /// Map from absolute paths to the last validation of the file.
+    llvm::StringMap<Entry> Entries;
+  };
+
+  static int64_t now() {
+    return llvm::sys::toTimeT(std::chrono::system_clock::now());
+  }
+
+  bool isTrusted(const Entry &E) const {
+    int64_t Age = now() - E.ValidatedAt;
+    // Entries from the future, e.g. after a clock change, are not trusted.
+    return Age >= 0 && Age < getTrustWindow().count();
+  }
+
+  CacheShard &getShard(StringRef Path) const {
+    return Shards[llvm::hash_value(Path) % NumShards];
+  }
+
+  std::atomic<std::chrono::seconds> TrustWindow;
+  const unsigned NumShards;
+  std::unique_ptr<CacheShard[]> Shards;
+  mutable std::atomic<uint64_t> Hits{0};
+  mutable std::atomic<uint64_t> Misses{0};
+  std::atomic<uint64_t> Revalidations{0};
+};
+
+/// A file system that answers 'stat' calls of trusted input files from an
+/// \c InputFileValidationCache, and renews or drops their entries when the
+/// trust window has passed.
+///
+/// Only the 'stat' calls of files recorded in the cache are affected. Their
+/// answers are not limited to the \c ASTReader: a \c FileManager that uses
+/// this file system takes the size of such a file from the cache too, and
+/// later reads that many bytes. To keep a file edited within the trust window
+/// from being read truncated or mapped past its end, files opened through this
+/// file system compare the requested size with the size of the open file, and
+/// read the whole file and drop its entry if they differ. The contents are then
+/// current, but the \c ASTReader may already have accepted the file based on
+/// the stale size and modification time.
+///
+/// An instance is meant to be used by a single thread, while the cache it
+/// refers to can be shared by all threads:
+///
+/// \code
+///   InputFileValidationCache &Cache = InputFileValidationCache::getGlobal();
+///   Cache.setTrustWindow(std::chrono::minutes(5));
+///   auto FS = llvm::makeIntrusiveRefCnt<InputFileValidationFileSystem>(
+///       Cache, llvm::vfs::getRealFileSystem());
+///   // ... load a PCH or module with FS, then:
+///   Cache.insert(CI.getASTReader()->getModuleManager(), *FS);
+/// \endcode
+class InputFileValidationFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+  InputFileValidationFileSystem(InputFileValidationCache &Cache,
+                                IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS)
+      : ProxyFileSystem(std::move(FS)), Cache(Cache) {}
+
+  llvm::ErrorOr<llvm::vfs::Status> status(const Twine &Path) override {
+    SmallString<256> Key;
+    if (!InputFileValidationCache::getCacheKey(*this, Path, Key))
+      return ProxyFileSystem::status(Path);
+    if (Optional<llvm::vfs::Status> Trusted = Cache.lookup(Key))
+      return llvm::vfs::Status::copyWithNewName(*Trusted, Path);
+    llvm::ErrorOr<llvm::vfs::Status> Result = ProxyFileSystem::status(Path);
+    Cache.revalidate(Key, Result);
+    return Result;
+  }
+
+  llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+  openFileForRead(const Twine &Path) override {
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> Result =
+        ProxyFileSystem::openFileForRead(Path);
+    SmallString<256> Key;
+    if (!Result || !InputFileValidationCache::getCacheKey(*this, Path, Key))
+      return Result;
+    return std::unique_ptr<llvm::vfs::File>(
+        std::make_unique<SizeCheckedFile>(std::move(*Result), Cache, Key));
+  }
+
+private:
+  /// A file whose contents are read with its actual size, in case the size
+  /// the caller got from a cached 'stat' is out of date.
+  class SizeCheckedFile : public llvm::vfs::File {
+  public:
+    SizeCheckedFile(std::unique_ptr<llvm::vfs::File> Underlying,
+                    InputFileValidationCache &Cache, StringRef Key)
+        : Underlying(std::move(Underlying)), Cache(Cache), Key(Key) {}
+
+    llvm::ErrorOr<llvm::vfs::Status> status() override {
+      llvm::ErrorOr<llvm::vfs::Status> Result = Underlying->status();
+      if (Result && !Path.empty())
+        return llvm::vfs::Status::copyWithNewName(*Result, Path);
+      return Result;
+    }
+
+    llvm::ErrorOr<std::string> getName() override {
+      if (!Path.empty())
+        return std::string(Path);
+      return Underlying->getName();
+    }
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+    getBuffer(const Twine &Name, int64_t FileSize, bool RequiresNullTerminator,
+              bool IsVolatile) override {
+      if (FileSize >= 0) {
+        llvm::ErrorOr<llvm::vfs::Status> Actual = Underlying->status();
+        if (Actual && Actual->getSize() != uint64_t(FileSize)) {
+          Cache.invalidate(Key);
+          FileSize = -1;
+        }
+      }
+      return Underlying->getBuffer(Name, FileSize, RequiresNullTerminator,
+                                   IsVolatile);
+    }
+
+    std::error_code close() override { return Underlying->close(); }
+
+  protected:
+    void setPath(const Twine &P) override { Path = P.str(); }
+
+  private:
+    std::unique_ptr<llvm::vfs::File> Underlying;
+    InputFileValidationCache &Cache;
+    std::string Key;
+    std::string Path;
+  };
+
+  InputFileValidationCache &Cache;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_SERIALIZATION_INPUTFILEVALIDATIONCACHE_H
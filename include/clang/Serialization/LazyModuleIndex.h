@@ -0,0 +1,529 @@
+//===--- LazyModuleIndex.h - Memory-mapped global module index --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the LazyModuleIndex class, an identifier index for the
+// module files in a module cache that is used in place without being parsed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_SERIALIZATION_LAZYMODULEINDEX_H
+#define LLVM_CLANG_SERIALIZATION_LAZYMODULEINDEX_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Serialization/ASTBitCodes.h"
+#include "clang/Serialization/PCHContainerOperations.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitstream/BitstreamReader.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/DJB.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/OnDiskHashTable.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace clang {
+
+/// An identifier index for the module files of a module cache, laid out so
+/// that it can be used straight from a memory-mapped file.
+///
+/// Like \c GlobalModuleIndex, the index tells which module files have
+/// information about an identifier. Reading a \c GlobalModuleIndex parses the
+/// records of all the module files it lists; this index is a flat file
+/// instead: a header, a table of fixed-size module records, their file names
+/// and an on-disk hash table from identifiers to module IDs. Opening it maps
+/// the file and checks the header, and each lookup only touches the hash
+/// table bucket and the module records it needs.
+///
+/// \c writeIndex reads the module files concurrently, and replaces the index
+/// atomically, so readers never see a partially written index.
+class LazyModuleIndex {
+public:
+  /// The name of the index file in the module cache directory.
+  static constexpr llvm::StringLiteral IndexFileName = "modules.lazyidx";
+
+  /// A module file listed in the index.
+  struct ModuleInfo {
+    StringRef FileName;
+    /// Size of the module file at the time the index was built.
+    uint64_t Size;
+    /// Modification time of the module file at the time the index was built.
+    time_t ModTime;
+  };
+
+  /// Read the index file for the given module cache directory.
+  ///
+  /// \param Path The path to the specific module cache where the module files
+  /// for the intended configuration reside.
+  static llvm::Expected<std::unique_ptr<LazyModuleIndex>>
+  readIndex(StringRef Path) {
+    SmallString<128> IndexPath(Path);
+    llvm::sys::path::append(IndexPath, IndexFileName);
+    auto Buffer = llvm::MemoryBuffer::getFile(
+        IndexPath, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buffer)
+      return llvm::errorCodeToError(Buffer.getError());
+    std::unique_ptr<LazyModuleIndex> Index(
+        new LazyModuleIndex(std::move(*Buffer)));
+    if (llvm::Error Err = Index->validate())
+      return Err;
+    return Index;
+  }
+
+  /// Write the index for the module files in the given directory.
+  ///
+  /// \param PCHContainerRdr The reader used to extract the AST from module
+  /// files.
+  /// \param Path The path to the directory containing module files, into
+  /// which the index will be written.
+  /// \param Strategy The threads that read module files.
+  static llvm::Error
+  writeIndex(const PCHContainerReader &PCHContainerRdr, StringRef Path,
+             llvm::ThreadPoolStrategy Strategy = llvm::hardware_concurrency()) {
+    std::vector<std::string> Files;
+    std::error_code EC;
+    for (llvm::sys::fs::recursive_directory_iterator D(Path, EC), DEnd;
+         D != DEnd && !EC; D.increment(EC))
+      if (llvm::sys::path::extension(D->path()) == ".pcm")
+        Files.push_back(D->path());
+    if (EC)
+      return llvm::errorCodeToError(EC);
+    llvm::sort(Files);
+
+    std::vector<ModuleData> Modules(Files.size());
+    std::mutex ErrorLock;
+    llvm::Error FirstError = llvm::Error::success();
+    {
+      llvm::ThreadPool Pool(Strategy);
+      for (unsigned I = 0, E = Files.size(); I != E; ++I)
+        Pool.async([&, I] {
+          llvm::Error Err =
+              loadModuleFile(PCHContainerRdr, Files[I], Modules[I]);
+          if (!Err)
+            return;
+          std::lock_guard<std::mutex> LockGuard(ErrorLock);
+          if (FirstError)
+            llvm::consumeError(std::move(Err));
+          else
+            FirstError = std::move(Err);
+        });
+      Pool.wait();
+    }
+    if (FirstError)
+      return FirstError;
+
+    SmallString<0> Contents;
+    emit(Files, Modules, Contents);
+
+    // Write to a temporary file and rename it, so that readers never see a
+    // partially written index.
+    SmallString<128> IndexPath(Path);
+    llvm::sys::path::append(IndexPath, IndexFileName);
+    SmallString<128> TempPath;
+    int FD;
+    if (std::error_code EC = llvm::sys::fs::createUniqueFile(
+            IndexPath + "-%%%%%%%%", FD, TempPath))
+      return llvm::errorCodeToError(EC);
+    {
+      llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+      Out << Contents;
+      Out.close();
+      if (Out.has_error()) {
+        Out.clear_error();
+        llvm::sys::fs::remove(TempPath);
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "failed writing %s",
+                                       TempPath.c_str());
+      }
+    }
+    if (std::error_code EC = llvm::sys::fs::rename(TempPath, IndexPath)) {
+      llvm::sys::fs::remove(TempPath);
+      return llvm::errorCodeToError(EC);
+    }
+    return llvm::Error::success();
+  }
+
+  /// Returns the number of module files listed in the index.
+  unsigned getNumModules() const { return NumModules; }
+
+  /// Returns the module file with the given ID.
+  ModuleInfo getModule(unsigned ID) const {
+    assert(ID < NumModules && "module ID out of range");
+    const char *Record = data() + ModulesOffset + ID * ModuleRecordSize;
+    using namespace llvm::support;
+    uint32_t NameOffset = endian::read32le(Record);
+    uint32_t NameLength = endian::read32le(Record + 4);
+    return {StringRef(data() + NameOffset, NameLength),
+            endian::read64le(Record + 8),
+            static_cast<time_t>(endian::read64le(Record + 16))};
+  }
+
+  /// Check whether the module file with the given ID still has the size and
+  /// modification time it had when the index was built.
+  bool isUpToDate(unsigned ID) const {
+    ModuleInfo Info = getModule(ID);
+    llvm::sys::fs::file_status Status;
+    return !llvm::sys::fs::status(Info.FileName, Status) &&
+           Status.getSize() == Info.Size &&
+           llvm::sys::toTimeT(Status.getLastModificationTime()) ==
+               Info.ModTime;
+  }
+
+  /// Look for all of the module files with information about the given
+  /// identifier, e.g., a global function, variable, or type with that name.
+  ///
+  /// \param Name The identifier to look for.
+  ///
+  /// \param ModuleIDs Will be populated with the IDs of the module files that
+  /// have information about this name.
+  ///
+  /// \returns true if the identifier is known to the index, false otherwise.
+  bool lookupIdentifier(StringRef Name, SmallVectorImpl<unsigned> &ModuleIDs) {
+    ++NumIdentifierLookups;
+    auto Known = Table->find(Name);
+    if (Known == Table->end())
+      return false;
+
+    ++NumIdentifierLookupHits;
+    const unsigned char *Data = Known.getDataPtr();
+    for (unsigned I = 0, N = Known.getDataLen() / 4; I != N; ++I)
+      ModuleIDs.push_back(llvm::support::endian::read32le(Data + 4 * I));
+    return true;
+  }
+
+  /// Print statistics to standard error.
+  void printStats() const {
+    std::fprintf(stderr, "*** Lazy Module Index Statistics:\n");
+    std::fprintf(stderr, "  %u modules, %u identifiers\n", NumModules,
+                 Table->getNumEntries());
+    if (NumIdentifierLookups)
+      std::fprintf(stderr, "  %u / %u identifier lookups succeeded (%f%%)\n",
+                   NumIdentifierLookupHits, NumIdentifierLookups,
+                   (double)NumIdentifierLookupHits * 100.0 /
+                       NumIdentifierLookups);
+    std::fprintf(stderr, "\n");
+  }
+
+private:
+  /// The version of the index file format.
+  static constexpr uint32_t Version = 1;
+  /// Magic, version, number of modules, and the offsets of the module records
+  /// and of the hash table.
+  static constexpr unsigned HeaderSize = 20;
+  /// Name offset and length, size and modification time.
+  static constexpr unsigned ModuleRecordSize = 24;
+
+  /// The identifiers of a module file, and whether each of them is
+  /// interesting, i.e. the name of an entity.
+  struct ModuleData {
+    uint64_t Size = 0;
+    time_t ModTime = 0;
+    std::vector<std::pair<std::string, bool>> Identifiers;
+  };
+
+  /// Reads the identifier table of a module file, as written by the
+  /// \c ASTWriter.
+  class ASTIdentifierTrait {
+  public:
+    using internal_key_type = StringRef;
+    using external_key_type = StringRef;
+    using data_type = std::pair<StringRef, bool>;
+    using hash_value_type = unsigned;
+    using offset_type = unsigned;
+
+    static bool EqualKey(StringRef A, StringRef B) { return A == B; }
+    static hash_value_type ComputeHash(StringRef Key) {
+      return llvm::djbHash(Key);
+    }
+    static StringRef GetInternalKey(StringRef Key) { return Key; }
+    static StringRef GetExternalKey(StringRef Key) { return Key; }
+
+    static std::pair<unsigned, unsigned>
+    ReadKeyDataLength(const unsigned char *&D) {
+      unsigned N;
+      unsigned KeyLen = llvm::decodeULEB128(D, &N);
+      D += N;
+      unsigned DataLen = llvm::decodeULEB128(D, &N);
+      D += N;
+      return std::make_pair(KeyLen, DataLen);
+    }
+
+    static StringRef ReadKey(const unsigned char *D, unsigned N) {
+      // Keys are null-terminated.
+      assert(N >= 2 && D[N - 1] == '\0');
+      return StringRef(reinterpret_cast<const char *>(D), N - 1);
+    }
+
+    static data_type ReadData(StringRef Key, const unsigned char *D,
+                              unsigned DataLen) {
+      // The first bit of the identifier ID tells whether the identifier is
+      // interesting. That's all we care about.
+      uint32_t RawID = llvm::support::endian::read32le(D);
+      return std::make_pair(Key, bool(RawID & 0x01));
+    }
+  };
+
+  /// Describes the hash table of the index.
+  class IndexTrait {
+  public:
+    using key_type = StringRef;
+    using key_type_ref = StringRef;
+    using data_type = SmallVector<unsigned, 2>;
+    using data_type_ref = const data_type &;
+    using internal_key_type = StringRef;
+    using external_key_type = StringRef;
+    using hash_value_type = unsigned;
+    using offset_type = unsigned;
+
+    static bool EqualKey(StringRef A, StringRef B) { return A == B; }
+    static hash_value_type ComputeHash(StringRef Key) {
+      return llvm::djbHash(Key);
+    }
+    static StringRef GetInternalKey(StringRef Key) { return Key; }
+    static StringRef GetExternalKey(StringRef Key) { return Key; }
+
+    std::pair<unsigned, unsigned>
+    EmitKeyDataLength(raw_ostream &Out, StringRef Key, data_type_ref Data) {
+      llvm::support::endian::Writer LE(Out, llvm::support::little);
+      unsigned DataLen = Data.size() * 4;
+      LE.write<uint32_t>(Key.size());
+      LE.write<uint32_t>(DataLen);
+      return std::make_pair(Key.size(), DataLen);
+    }
+    void EmitKey(raw_ostream &Out, StringRef Key, unsigned) { Out << Key; }
+    void EmitData(raw_ostream &Out, StringRef, data_type_ref Data, unsigned) {
+      llvm::support::endian::Writer LE(Out, llvm::support::little);
+      for (unsigned ID : Data)
+        LE.write<uint32_t>(ID);
+    }
+
+    static std::pair<unsigned, unsigned>
+    ReadKeyDataLength(const unsigned char *&D) {
+      using namespace llvm::support;
+      unsigned KeyLen = endian::readNext<uint32_t, little, unaligned>(D);
+      unsigned DataLen = endian::readNext<uint32_t, little, unaligned>(D);
+      return std::make_pair(KeyLen, DataLen);
+    }
+    static StringRef ReadKey(const unsigned char *D, unsigned N) {
+      return StringRef(reinterpret_cast<const char *>(D), N);
+    }
+    // Lookups decode the module IDs from the data themselves.
+    static bool ReadData(StringRef, const unsigned char *, unsigned) {
+      return true;
+    }
+  };
+
+  explicit LazyModuleIndex(std::unique_ptr<llvm::MemoryBuffer> Buffer)
+      : Buffer(std::move(Buffer)) {}
+
+  const char *data() const { return Buffer->getBufferStart(); }
+
+  llvm::Error validate() {
+    using namespace llvm::support;
+    auto Malformed = [&] {
+      return llvm::createStringError(
+          llvm::inconvertibleErrorCode(), "malformed module index %s",
+          Buffer->getBufferIdentifier().str().c_str());
+    };
+    StringRef Contents = Buffer->getBuffer();
+    if (Contents.size() < HeaderSize || !Contents.startswith("CLMI") ||
+        endian::read32le(data() + 4) != Version)
+      return Malformed();
+    NumModules = endian::read32le(data() + 8);
+    ModulesOffset = endian::read32le(data() + 12);
+    uint32_t BucketOffset = endian::read32le(data() + 16);
+    if (ModulesOffset < HeaderSize ||
+        uint64_t(ModulesOffset) + uint64_t(NumModules) * ModuleRecordSize >
+            Contents.size() ||
+        BucketOffset % 4 != 0 || uint64_t(BucketOffset) + 8 > Contents.size())
+      return Malformed();
+    for (unsigned ID = 0; ID != NumModules; ++ID) {
+      const char *Record = data() + ModulesOffset + ID * ModuleRecordSize;
+      if (uint64_t(endian::read32le(Record)) + endian::read32le(Record + 4) >
+          Contents.size())
+        return Malformed();
+    }
+    const auto *Base = reinterpret_cast<const unsigned char *>(data());
+    Table.reset(IndexTable::Create(Base + BucketOffset, Base));
+    return llvm::Error::success();
+  }
+
+  /// Reads the identifiers of the module file \p FileName into \p Data.
+  static llvm::Error loadModuleFile(const PCHContainerReader &PCHContainerRdr,
+                                    StringRef FileName, ModuleData &Data) {
+    llvm::sys::fs::file_status Status;
+    if (std::error_code EC = llvm::sys::fs::status(FileName, Status))
+      return llvm::errorCodeToError(EC);
+    Data.Size = Status.getSize();
+    Data.ModTime = llvm::sys::toTimeT(Status.getLastModificationTime());
+
+    auto Buffer = llvm::MemoryBuffer::getFile(
+        FileName, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buffer)
+      return llvm::errorCodeToError(Buffer.getError());
+    llvm::BitstreamCursor InStream(
+        PCHContainerRdr.ExtractPCH((*Buffer)->getMemBufferRef()));
+
+    // Sniff for the signature.
+    for (unsigned char C : {'C', 'P', 'C', 'H'}) {
+      if (llvm::Expected<llvm::SimpleBitstreamCursor::word_t> Res =
+              InStream.Read(8)) {
+        if (*Res != C)
+          return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                         "expected signature CPCH in %s",
+                                         FileName.str().c_str());
+      } else
+        return Res.takeError();
+    }
+
+    enum { Other, ControlBlock, ASTBlock } State = Other;
+    while (true) {
+      llvm::Expected<llvm::BitstreamEntry> MaybeEntry = InStream.advance();
+      if (!MaybeEntry)
+        return MaybeEntry.takeError();
+      llvm::BitstreamEntry Entry = MaybeEntry.get();
+
+      switch (Entry.Kind) {
+      case llvm::BitstreamEntry::Error:
+        return llvm::Error::success();
+
+      case llvm::BitstreamEntry::Record:
+        // In the 'other' state, just skip the record. We don't care.
+        if (State == Other) {
+          if (llvm::Expected<unsigned> Skipped = InStream.skipRecord(Entry.ID))
+            continue;
+          else
+            return Skipped.takeError();
+        }
+        // Handle potentially-interesting records below.
+        break;
+
+      case llvm::BitstreamEntry::SubBlock:
+        if (Entry.ID == serialization::CONTROL_BLOCK_ID ||
+            Entry.ID == serialization::AST_BLOCK_ID) {
+          if (llvm::Error Err = InStream.EnterSubBlock(Entry.ID))
+            return Err;
+          State = Entry.ID == serialization::CONTROL_BLOCK_ID ? ControlBlock
+                                                              : ASTBlock;
+          continue;
+        }
+        if (llvm::Error Err = InStream.SkipBlock())
+          return Err;
+        continue;
+
+      case llvm::BitstreamEntry::EndBlock:
+        // The identifier table is all we need from the AST block.
+        if (State == ASTBlock)
+          return llvm::Error::success();
+        State = Other;
+        continue;
+      }
+
+      SmallVector<uint64_t, 64> Record;
+      StringRef Blob;
+      llvm::Expected<unsigned> MaybeCode =
+          InStream.readRecord(Entry.ID, Record, &Blob);
+      if (!MaybeCode)
+        return MaybeCode.takeError();
+
+      if (State == ControlBlock && *MaybeCode == serialization::METADATA &&
+          (Record.empty() || Record[0] != serialization::VERSION_MAJOR))
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "module file %s has a different "
+                                       "format version",
+                                       FileName.str().c_str());
+
+      if (State == ASTBlock &&
+          *MaybeCode == serialization::IDENTIFIER_TABLE && !Record.empty() &&
+          Record[0] > 0) {
+        const auto *Base = reinterpret_cast<const unsigned char *>(Blob.data());
+        std::unique_ptr<ASTIdentifierTable> Table(ASTIdentifierTable::Create(
+            Base + Record[0], Base + sizeof(uint32_t), Base));
+        for (std::pair<StringRef, bool> Ident : Table->data())
+          Data.Identifiers.emplace_back(Ident.first.str(), Ident.second);
+      }
+    }
+  }
+
+  /// Lays out the index for the module files \p Files in \p Out.
+  static void emit(ArrayRef<std::string> Files, ArrayRef<ModuleData> Modules,
+                   SmallVectorImpl<char> &Out) {
+    using namespace llvm::support;
+    // Identifiers that are not interesting are still known to the index.
+    llvm::StringMap<SmallVector<unsigned, 2>> Identifiers;
+    for (unsigned ID = 0, E = Modules.size(); ID != E; ++ID)
+      for (const auto &Ident : Modules[ID].Identifiers) {
+        SmallVector<unsigned, 2> &IDs = Identifiers[Ident.first];
+        if (Ident.second)
+          IDs.push_back(ID);
+      }
+
+    llvm::raw_svector_ostream OS(Out);
+    endian::Writer LE(OS, little);
+    OS << "CLMI";
+    LE.write<uint32_t>(Version);
+    LE.write<uint32_t>(Modules.size());
+    LE.write<uint32_t>(HeaderSize);
+    LE.write<uint32_t>(0); // Bucket offset, patched below.
+
+    uint32_t NameOffset = HeaderSize + Modules.size() * ModuleRecordSize;
+    for (unsigned ID = 0, E = Modules.size(); ID != E; ++ID) {
+      LE.write<uint32_t>(NameOffset);
+      LE.write<uint32_t>(Files[ID].size());
+      LE.write<uint64_t>(Modules[ID].Size);
+      LE.write<uint64_t>(Modules[ID].ModTime);
+      NameOffset += Files[ID].size();
+    }
+    for (const std::string &File : Files)
+      OS << File;
+
+    llvm::OnDiskChainedHashTableGenerator<IndexTrait> Generator;
+    IndexTrait Trait;
+    for (auto &Entry : Identifiers)
+      Generator.insert(Entry.first(), Entry.second, Trait);
+    uint32_t BucketOffset = Generator.Emit(OS, Trait);
+    endian::write32le(Out.data() + 16, BucketOffset);
+  }
+
+  using ASTIdentifierTable =
+      llvm::OnDiskIterableChainedHashTable<ASTIdentifierTrait>;
+  using IndexTable = llvm::OnDiskChainedHashTable<IndexTrait>;
+
+  /// The index file, usually memory-mapped.
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  std::unique_ptr<IndexTable> Table;
+  unsigned NumModules = 0;
+  uint32_t ModulesOffset = 0;
+
+  /// The number of identifier lookups we performed.
+  unsigned NumIdentifierLookups = 0;
+
+  /// The number of identifier lookup hits, where we recognize the
+  /// identifier.
+  unsigned NumIdentifierLookupHits = 0;
+};
+
+} // namespace clang
+
+#endif // LLVM_CLANG_SERIALIZATION_LAZYMODULEINDEX_H
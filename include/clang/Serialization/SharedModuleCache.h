@@ -0,0 +1,287 @@
+//===- SharedModuleCache.h - Module cache shared across threads -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_SERIALIZATION_SHAREDMODULECACHE_H
+#define LLVM_CLANG_SERIALIZATION_SHAREDMODULECACHE_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SharedBufferCache.h"
+#include "clang/Serialization/InMemoryModuleCache.h"
+#include "clang/Serialization/ModuleFile.h"
+#include "clang/Serialization/ModuleManager.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Threading.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
+namespace clang {
+
+/// A thread-safe counterpart of \c InMemoryModuleCache, shared by all the
+/// threads of a process.
+///
+/// Each \c CompilerInstance has an \c InMemoryModuleCache of its own, so a
+/// multi-threaded tool run with implicit modules loads and holds a copy of
+/// every PCM per thread. This cache holds one reference-counted buffer per
+/// PCM instead, memory-mapped from disk whenever the file still has the same
+/// contents, and tracks the same states as \c InMemoryModuleCache. Threads
+/// exchange PCMs with it through their own caches:
+///
+///  - \c seed adds read-only views of the shared PCMs to the cache of a new
+///    \c CompilerInstance, so that the \c ModuleManager finds them instead of
+///    reading the files. They are added as tentative, even if they are final
+///    here: being final is an invariant of a single compilation, and a PCM
+///    that works for one translation unit may be out of date for the next,
+///    e.g. because another process rebuilt it. Each compilation validates the
+///    PCMs again, and can rebuild them;
+///
+///  - \c publish adds the PCMs that a \c ModuleManager loaded or built to the
+///    shared cache, and finalizes the shared PCMs it showed to work. A PCM
+///    that a compilation finalized replaces a different final one, so that
+///    later compilations are seeded with the most recent PCM that worked.
+///
+/// The cache is sharded by file name to reduce lock contention. Transitions
+/// of \c addPCM, \c addBuiltPCM and \c tryToDropPCM that lost a race against
+/// another thread are no-ops, like those of a single \c InMemoryModuleCache.
+class SharedModuleCache {
+public:
+  using BufferPtr = std::shared_ptr<const llvm::MemoryBuffer>;
+  using State = InMemoryModuleCache::State;
+
+  explicit SharedModuleCache(unsigned NumShards = 0)
+      : NumShards(NumShards ? NumShards
+                            : std::max(2u, llvm::hardware_concurrency()
+                                                   .compute_thread_count() /
+                                               4)),
+        Shards(new CacheShard[this->NumShards]) {}
+
+  SharedModuleCache(const SharedModuleCache &) = delete;
+  SharedModuleCache &operator=(const SharedModuleCache &) = delete;
+
+  /// Get the state of the PCM.
+  State getPCMState(StringRef Filename) const {
+    CacheShard &Shard = getShard(Filename);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto I = Shard.PCMs.find(Filename);
+    if (I == Shard.PCMs.end())
+      return InMemoryModuleCache::Unknown;
+    if (I->second.IsFinal)
+      return InMemoryModuleCache::Final;
+    return I->second.Buffer ? InMemoryModuleCache::Tentative
+                            : InMemoryModuleCache::ToBuild;
+  }
+
+  /// Store the PCM under the Filename, unless it is known already.
+  ///
+  /// \post state is not Unknown
+  /// \return the buffer stored under the Filename.
+  BufferPtr addPCM(StringRef Filename,
+                   std::unique_ptr<llvm::MemoryBuffer> Buffer) {
+    CacheShard &Shard = getShard(Filename);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto Inserted = Shard.PCMs.try_emplace(Filename);
+    if (Inserted.second)
+      Inserted.first->second.Buffer = std::move(Buffer);
+    return Inserted.first->second.Buffer;
+  }
+
+  /// Store a just-built PCM under the Filename, unless another one was built
+  /// or finalized already.
+  ///
+  /// \post state is Tentative or Final.
+  /// \return the buffer stored under the Filename.
+  BufferPtr addBuiltPCM(StringRef Filename,
+                        std::unique_ptr<llvm::MemoryBuffer> Buffer) {
+    CacheShard &Shard = getShard(Filename);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    PCM &Entry = Shard.PCMs[Filename];
+    if (!Entry.IsFinal) {
+      Entry.Buffer = std::move(Buffer);
+      Entry.IsFinal = true;
+    }
+    return Entry.Buffer;
+  }
+
+  /// Try to remove a buffer from the cache.  No effect if state is Final.
+  ///
+  /// \post Tentative => ToBuild or Final => Final.
+  /// \return false on success, i.e. if Tentative => ToBuild.
+  bool tryToDropPCM(StringRef Filename) {
+    CacheShard &Shard = getShard(Filename);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto I = Shard.PCMs.find(Filename);
+    if (I == Shard.PCMs.end() || I->second.IsFinal)
+      return true;
+    // Views handed out earlier keep the contents alive.
+    I->second.Buffer.reset();
+    return false;
+  }
+
+  /// Mark a PCM as final, if it is stored.
+  ///
+  /// \post state is Final, or ToBuild or Unknown if it was before.
+  void finalizePCM(StringRef Filename) {
+    CacheShard &Shard = getShard(Filename);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto I = Shard.PCMs.find(Filename);
+    if (I != Shard.PCMs.end() && I->second.Buffer)
+      I->second.IsFinal = true;
+  }
+
+  /// Get the PCM if it exists; else null.
+  BufferPtr lookupPCM(StringRef Filename) const {
+    CacheShard &Shard = getShard(Filename);
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    auto I = Shard.PCMs.find(Filename);
+    return I == Shard.PCMs.end() ? nullptr : I->second.Buffer;
+  }
+
+  /// Check whether the PCM is final and has been shown to work.
+  bool isPCMFinal(StringRef Filename) const {
+    return getPCMState(Filename) == InMemoryModuleCache::Final;
+  }
+
+  /// Check whether the PCM is waiting to be built.
+  bool shouldBuildPCM(StringRef Filename) const {
+    return getPCMState(Filename) == InMemoryModuleCache::ToBuild;
+  }
+
+  /// Adds views of the shared PCMs to \p Local as tentative PCMs. \p Local
+  /// must not know any of them yet, e.g. because its \c CompilerInstance was
+  /// just created.
+  void seed(InMemoryModuleCache &Local) const {
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      for (const auto &Entry : Shards[I].PCMs) {
+        StringRef Filename = Entry.first();
+        if (!Entry.second.Buffer ||
+            Local.getPCMState(Filename) != InMemoryModuleCache::Unknown)
+          continue;
+        Local.addPCM(Filename,
+                     SharedBufferCache::makeView(
+                         Entry.second.Buffer, Filename,
+                         /*RequiresNullTerminator=*/false));
+      }
+    }
+  }
+
+  /// Shares the PCMs of the modules that \p Modules loaded from or built into
+  /// \p Local.
+  void publish(const InMemoryModuleCache &Local,
+               const serialization::ModuleManager &Modules) {
+    for (const serialization::ModuleFile &MF : Modules) {
+      if (!MF.isModule())
+        continue;
+      if (const llvm::MemoryBuffer *Buffer = Local.lookupPCM(MF.FileName))
+        publish(MF.FileName, *Buffer, Local.isPCMFinal(MF.FileName));
+    }
+  }
+
+  /// Shares \p Buffer as the PCM stored under the Filename. A tentative
+  /// \p Buffer is only stored if no PCM is; a final one replaces any PCM.
+  ///
+  /// \param IsFinal Whether \p Buffer was shown to work.
+  void publish(StringRef Filename, const llvm::MemoryBuffer &Buffer,
+               bool IsFinal) {
+    CacheShard &Shard = getShard(Filename);
+    {
+      std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+      auto I = Shard.PCMs.find(Filename);
+      if (I != Shard.PCMs.end()) {
+        PCM &Entry = I->second;
+        // The buffer is a view of the shared one.
+        if (Entry.Buffer &&
+            Entry.Buffer->getBufferStart() == Buffer.getBufferStart()) {
+          Entry.IsFinal |= IsFinal;
+          return;
+        }
+        if (Entry.Buffer && !IsFinal)
+          return;
+      }
+    }
+
+    // Read the file outside of the lock.
+    std::unique_ptr<llvm::MemoryBuffer> Shared = share(Filename, Buffer);
+    if (!IsFinal) {
+      addPCM(Filename, std::move(Shared));
+      return;
+    }
+    std::lock_guard<std::mutex> LockGuard(Shard.CacheLock);
+    // Views handed out earlier keep the contents of a replaced PCM alive.
+    PCM &Entry = Shard.PCMs[Filename];
+    Entry.Buffer = std::move(Shared);
+    Entry.IsFinal = true;
+  }
+
+  /// \returns The number of PCMs stored.
+  unsigned size() const {
+    unsigned Size = 0;
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      for (const auto &Entry : Shards[I].PCMs)
+        Size += bool(Entry.second.Buffer);
+    }
+    return Size;
+  }
+
+  /// \returns The total size of the PCMs stored.
+  uint64_t getNumBytes() const {
+    uint64_t Bytes = 0;
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(Shards[I].CacheLock);
+      for (const auto &Entry : Shards[I].PCMs)
+        if (Entry.second.Buffer)
+          Bytes += Entry.second.Buffer->getBufferSize();
+    }
+    return Bytes;
+  }
+
+private:
+  struct PCM {
+    BufferPtr Buffer;
+
+    /// Track whether this PCM is known to be good (either built or
+    /// successfully imported by a CompilerInstance/ASTReader using this
+    /// cache).
+    bool IsFinal = false;
+  };
+
+  struct CacheShard {
+    /// The mutex that needs to be locked before accessing any of the members
+    /// below.
+    mutable std::mutex CacheLock;
+    /// Cache of buffers.
+    llvm::StringMap<PCM> PCMs;
+  };
+
+  /// Returns a buffer with the contents of \p Buffer that can be shared,
+  /// mapping the file if it has the same contents.
+  static std::unique_ptr<llvm::MemoryBuffer>
+  share(StringRef Filename, const llvm::MemoryBuffer &Buffer) {
+    if (auto File = llvm::MemoryBuffer::getFile(
+            Filename, /*IsText=*/false, /*RequiresNullTerminator=*/false)) {
+      if ((*File)->getBuffer() == Buffer.getBuffer())
+        return std::move(*File);
+    }
+    return llvm::MemoryBuffer::getMemBufferCopy(Buffer.getBuffer(), Filename);
+  }
+
+  CacheShard &getShard(StringRef Filename) const {
+    return Shards[llvm::hash_value(Filename) % NumShards];
+  }
+
+  const unsigned NumShards;
+  std::unique_ptr<CacheShard[]> Shards;
+};
+
+} // end namespace clang
+
+#endif // LLVM_CLANG_SERIALIZATION_SHAREDMODULECACHE_H
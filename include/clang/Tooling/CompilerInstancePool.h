@@ -0,0 +1,470 @@
+//===- CompilerInstancePool.h - Reuse compiler state across TUs -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+//  This file defines a pool of the per-invocation compiler state (target info,
+//  diagnostics engine and source manager) that ToolInvocation otherwise builds
+//  from scratch for every translation unit, and a FrontendActionFactory that
+//  runs its actions with state taken from the pool.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_COMPILERINSTANCEPOOL_H
+#define LLVM_CLANG_TOOLING_COMPILERINSTANCEPOOL_H
+
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/LangOptions.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Basic/Stack.h"
+#include "clang/Basic/TargetInfo.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/FrontendOptions.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace clang {
+namespace tooling {
+
+/// A thread-safe pool of compiler state that is reused by translation units
+/// compiled with compatible invocations.
+///
+/// Two invocations are compatible if they have the same language, target,
+/// code generation and diagnostic options, which are all that the pooled
+/// state depends on. For each group of compatible invocations the pool keeps:
+///
+///  - the \c TargetInfo, adjusted to the language options, so that targets
+///    are created and adjusted once instead of once per translation unit;
+///
+///  - if the invocations use the same \c FileManager and no remapped files,
+///    the \c DiagnosticsEngine and the \c SourceManager. The source manager
+///    is reset between translation units like \c CompilerInstance does for
+///    consecutive inputs, but keeps the contents of the files it read, so
+///    headers shared by the translation units are read once. Like the file
+///    manager itself, it assumes that files do not change during a run.
+///    Since the contents of every file read by any of the translation units
+///    are kept, a source manager is dropped once the buffers and tables it
+///    holds exceed a size limit.
+///
+/// The preprocessor (with its header search state and identifier and builtin
+/// tables) is still created per translation unit by
+/// \c FrontendAction::BeginSourceFile.
+///
+/// Invocations that need state the pool cannot reproduce (offloading and
+/// OpenCL targets, non-default floating point environments, -verify, stats,
+/// timers and diagnostic log files) are run like \c FrontendActionFactory
+/// runs them.
+class CompilerInstancePool {
+public:
+  /// \param MaxEntries The maximum number of groups of compiler state that
+  ///                   are kept, by default the number of hardware threads.
+  /// \param ReuseSourceManagers Whether source managers (and the contents of
+  ///                            the files they read) are kept.
+  /// \param MaxSourceManagerBytes The size above which a source manager is
+  ///                              not kept, counting the file contents and
+  ///                              tables it holds.
+  explicit CompilerInstancePool(unsigned MaxEntries = 0,
+                                bool ReuseSourceManagers = true,
+                                size_t MaxSourceManagerBytes = 256 << 20)
+      : MaxEntries(MaxEntries ? MaxEntries
+                              : llvm::hardware_concurrency()
+                                    .compute_thread_count()),
+        ReuseSourceManagers(ReuseSourceManagers),
+        MaxSourceManagerBytes(MaxSourceManagerBytes) {}
+
+  CompilerInstancePool(const CompilerInstancePool &) = delete;
+  CompilerInstancePool &operator=(const CompilerInstancePool &) = delete;
+
+  /// Runs \p Action on \p Invocation, as \c FrontendActionFactory does, with
+  /// compiler state taken from and returned to the pool.
+  bool run(std::unique_ptr<FrontendAction> Action,
+           std::shared_ptr<CompilerInvocation> Invocation, FileManager *Files,
+           std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+           DiagnosticConsumer *DiagConsumer) {
+    if (!isPoolable(*Invocation))
+      return runUnpooled(std::move(Action), std::move(Invocation), Files,
+                         std::move(PCHContainerOps), DiagConsumer);
+
+    // Without a consumer, print the diagnostics to stderr, as
+    // CompilerInstance::createDiagnostics does. The pooled diagnostics engine
+    // never owns its client.
+    std::unique_ptr<DiagnosticConsumer> DefaultConsumer;
+    if (!DiagConsumer) {
+      DefaultConsumer = std::make_unique<TextDiagnosticPrinter>(
+          llvm::errs(), &Invocation->getDiagnosticOpts());
+      DiagConsumer = DefaultConsumer.get();
+    }
+
+    const PreprocessorOptions &PPOpts = Invocation->getPreprocessorOpts();
+    bool CanReuseSourceManager = ReuseSourceManagers &&
+                                 PPOpts.RemappedFiles.empty() &&
+                                 PPOpts.RemappedFileBuffers.empty();
+    Entry E = checkout(computeKey(*Invocation), Files, CanReuseSourceManager);
+
+    bool Success = false;
+    {
+      CompilerInstance Compiler(std::move(PCHContainerOps));
+      Compiler.setInvocation(Invocation);
+      Compiler.setFileManager(Files);
+      // The FrontendAction can have lifetime requirements for Compiler or its
+      // members, and we need to ensure it's deleted earlier than Compiler. So
+      // we move it to an std::unique_ptr declared after the Compiler variable.
+      std::unique_ptr<FrontendAction> ScopedToolAction = std::move(Action);
+
+      if (E.Diags) {
+        E.Diags->Reset();
+        E.Diags->setClient(DiagConsumer, /*ShouldOwnClient=*/false);
+        ProcessWarningOptions(*E.Diags, Invocation->getDiagnosticOpts());
+        Compiler.setDiagnostics(E.Diags.get());
+        Compiler.setSourceManager(E.SourceMgr.get());
+        std::lock_guard<std::mutex> LockGuard(PoolLock);
+        ++NumReusedSourceManagers;
+      } else {
+        Compiler.createDiagnostics(DiagConsumer, /*ShouldOwnClient=*/false);
+        if (Compiler.hasDiagnostics())
+          Compiler.createSourceManager(*Files);
+      }
+
+      if (Compiler.hasDiagnostics()) {
+        Success = execute(Compiler, *ScopedToolAction, E);
+        Files->clearStatCache();
+
+        E.Files = Files;
+        E.Diags = &Compiler.getDiagnostics();
+        E.SourceMgr = Compiler.hasSourceManager()
+                          ? &Compiler.getSourceManager()
+                          : nullptr;
+      }
+      if (!CanReuseSourceManager || !E.SourceMgr ||
+          &E.SourceMgr->getDiagnostics() != E.Diags.get() ||
+          &E.SourceMgr->getFileManager() != Files ||
+          getSize(*E.SourceMgr) > MaxSourceManagerBytes)
+        E.dropSourceManager();
+    }
+    // Only return the state once the compiler instance that used it is gone.
+    if (E.Diags)
+      E.Diags->setClient(nullptr, /*ShouldOwnClient=*/false);
+    checkin(std::move(E));
+    return Success;
+  }
+
+  /// Drops all pooled state.
+  void clear() {
+    std::lock_guard<std::mutex> LockGuard(PoolLock);
+    Entries.clear();
+  }
+
+  /// \returns The number of translation units that reused a target.
+  unsigned getNumReusedTargets() const {
+    std::lock_guard<std::mutex> LockGuard(PoolLock);
+    return NumReusedTargets;
+  }
+
+  /// \returns The number of translation units that reused a source manager.
+  unsigned getNumReusedSourceManagers() const {
+    std::lock_guard<std::mutex> LockGuard(PoolLock);
+    return NumReusedSourceManagers;
+  }
+
+private:
+  /// The compiler state kept for a group of compatible invocations.
+  struct Entry {
+    /// The options the state depends on, as computed by \c computeKey.
+    std::string Key;
+    IntrusiveRefCntPtr<TargetInfo> Target;
+    /// The language options after \c CompilerInstance::createTarget adjusted
+    /// them for \c Target.
+    LangOptions LangOpts;
+    IntrusiveRefCntPtr<FileManager> Files;
+    IntrusiveRefCntPtr<DiagnosticsEngine> Diags;
+    IntrusiveRefCntPtr<SourceManager> SourceMgr;
+
+    void dropSourceManager() {
+      Files = nullptr;
+      Diags = nullptr;
+      SourceMgr = nullptr;
+    }
+  };
+
+  /// Checks whether running \p Invocation with pooled state is equivalent to
+  /// running it with \c CompilerInstance::ExecuteAction.
+  static bool isPoolable(const CompilerInvocation &Invocation) {
+    const LangOptions &LangOpts = *Invocation.getLangOpts();
+    const FrontendOptions &FrontendOpts = Invocation.getFrontendOpts();
+    const DiagnosticOptions &DiagOpts = Invocation.getDiagnosticOpts();
+    // These make createTarget create an auxiliary target, validate the target
+    // against the language, or adjust the language options with a warning.
+    if (LangOpts.CUDA || LangOpts.OpenMPIsDevice || LangOpts.SYCLIsDevice ||
+        LangOpts.OpenCL ||
+        LangOpts.RoundingMath ||
+        LangOpts.getDefaultExceptionMode() != LangOptions::FPE_Ignore)
+      return false;
+    // These make ExecuteAction or createDiagnostics do more than run the
+    // action.
+    return FrontendOpts.ProgramAction != frontend::RewriteObjC &&
+           !FrontendOpts.ShowStats && FrontendOpts.StatsFile.empty() &&
+           !Invocation.getCodeGenOpts().TimePasses &&
+           !Invocation.getHeaderSearchOpts().Verbose &&
+           !DiagOpts.VerifyDiagnostics && DiagOpts.DiagnosticLogFile.empty() &&
+           DiagOpts.DiagnosticSerializationFile.empty();
+  }
+
+  /// Computes a key from the options of \p Invocation that the pooled state
+  /// depends on: those that \c CompilerInstance::createTarget reads (the
+  /// language, target and code generation options) and the diagnostic
+  /// options the pooled diagnostics engine was created with.
+  static std::string computeKey(const CompilerInvocation &Invocation) {
+    std::string Key;
+    llvm::raw_string_ostream OS(Key);
+    auto AddStrings = [&](const std::vector<std::string> &Strings) {
+      OS << Strings.size() << ';';
+      for (const std::string &S : Strings)
+        OS << S << '\0';
+    };
+
+    const LangOptions &LangOpts = *Invocation.getLangOpts();
+#define LANGOPT(Name, Bits, Default, Description) OS << LangOpts.Name << ',';
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description)                   \
+  OS << static_cast<unsigned>(LangOpts.get##Name()) << ',';
+#include "clang/Basic/LangOptions.def"
+
+    const CodeGenOptions &CodeGenOpts = Invocation.getCodeGenOpts();
+#define CODEGENOPT(Name, Bits, Default) OS << CodeGenOpts.Name << ',';
+#define ENUM_CODEGENOPT(Name, Type, Bits, Default)                             \
+  OS << static_cast<unsigned>(CodeGenOpts.get##Name()) << ',';
+#include "clang/Basic/CodeGenOptions.def"
+
+    const DiagnosticOptions &DiagOpts = Invocation.getDiagnosticOpts();
+#define DIAGOPT(Name, Bits, Default) OS << DiagOpts.Name << ',';
+#define ENUM_DIAGOPT(Name, Type, Bits, Default)                                \
+  OS << static_cast<unsigned>(DiagOpts.get##Name()) << ',';
+#include "clang/Basic/DiagnosticOptions.def"
+    AddStrings(DiagOpts.Warnings);
+    AddStrings(DiagOpts.Remarks);
+
+    const TargetOptions &TargetOpts = Invocation.getTargetOpts();
+    OS << TargetOpts.Triple << '\0' << TargetOpts.HostTriple << '\0'
+       << TargetOpts.CPU << '\0' << TargetOpts.TuneCPU << '\0'
+       << TargetOpts.FPMath << '\0' << TargetOpts.ABI << '\0'
+       << static_cast<unsigned>(TargetOpts.EABIVersion) << ','
+       << TargetOpts.LinkerVersion << '\0' << TargetOpts.CodeModel << '\0'
+       << TargetOpts.SDKVersion.getAsString() << '\0'
+       << TargetOpts.DarwinTargetVariantTriple << '\0'
+       << TargetOpts.DarwinTargetVariantSDKVersion.getAsString() << '\0'
+       << TargetOpts.ForceEnableInt128 << TargetOpts.NVPTXUseShortPointers
+       << TargetOpts.AllowAMDGPUUnsafeFPAtomics << ','
+       << static_cast<unsigned>(TargetOpts.CodeObjectVersion) << ','
+       << TargetOpts.DxilValidatorVersion << '\0' << TargetOpts.HLSLEntry
+       << '\0';
+    AddStrings(TargetOpts.FeaturesAsWritten);
+    AddStrings(TargetOpts.Features);
+    AddStrings(TargetOpts.OpenCLExtensionsAsWritten);
+    return OS.str();
+  }
+
+  /// Returns the memory held by \p SM: the contents of the files it read and
+  /// its tables.
+  static size_t getSize(const SourceManager &SM) {
+    SourceManager::MemoryBufferSizes Buffers = SM.getMemoryBufferSizes();
+    return Buffers.malloc_bytes + Buffers.mmap_bytes +
+           SM.getDataStructureSizes();
+  }
+
+  /// Runs \p Action like \c CompilerInstance::ExecuteAction, except that the
+  /// target is taken from \p E if it has one.
+  bool execute(CompilerInstance &Compiler, FrontendAction &Action, Entry &E) {
+    noteBottomOfStack();
+    if (!Action.PrepareToExecute(Compiler)) {
+      Compiler.getDiagnosticClient().finish();
+      return false;
+    }
+
+    CompilerInvocation &Invocation = Compiler.getInvocation();
+    if (E.Target) {
+      // Only the options in the key are known to be the same as those the
+      // target was created with, so only those are taken from the entry.
+      LangOptions &LangOpts = *Invocation.getLangOpts();
+#define LANGOPT(Name, Bits, Default, Description)                              \
+  LangOpts.Name = E.LangOpts.Name;
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description)                   \
+  LangOpts.set##Name(E.LangOpts.get##Name());
+#include "clang/Basic/LangOptions.def"
+      Invocation.getTargetOpts() = E.Target->getTargetOpts();
+      Compiler.setTarget(E.Target.get());
+      std::lock_guard<std::mutex> LockGuard(PoolLock);
+      ++NumReusedTargets;
+    } else {
+      if (!Compiler.createTarget()) {
+        Compiler.getDiagnosticClient().finish();
+        return false;
+      }
+      E.Target = &Compiler.getTarget();
+      E.LangOpts = *Invocation.getLangOpts();
+    }
+
+    for (const FrontendInputFile &FIF : Invocation.getFrontendOpts().Inputs) {
+      // Reset the ID tables if we are reusing the SourceManager and parsing
+      // regular files.
+      if (Compiler.hasSourceManager() && !Action.isModelParsingAction())
+        Compiler.getSourceManager().clearIDTables();
+
+      if (Action.BeginSourceFile(Compiler, FIF)) {
+        if (llvm::Error Err = Action.Execute())
+          consumeError(std::move(Err));
+        Action.EndSourceFile();
+      }
+    }
+    Compiler.getDiagnosticClient().finish();
+
+    DiagnosticConsumer *Client = Compiler.getDiagnostics().getClient();
+    if (Compiler.getDiagnosticOpts().ShowCarets) {
+      unsigned NumWarnings = Client->getNumWarnings();
+      unsigned NumErrors = Client->getNumErrors();
+      raw_ostream &OS = Compiler.getVerboseOutputStream();
+      if (NumWarnings)
+        OS << NumWarnings << " warning" << (NumWarnings == 1 ? "" : "s");
+      if (NumWarnings && NumErrors)
+        OS << " and ";
+      if (NumErrors)
+        OS << NumErrors << " error" << (NumErrors == 1 ? "" : "s");
+      if (NumWarnings || NumErrors)
+        OS << " generated.\n";
+    }
+    return !Client->getNumErrors();
+  }
+
+  /// Takes the state for invocations with \p Key out of the pool, preferring
+  /// state that was used with \p Files.
+  Entry checkout(std::string Key, FileManager *Files,
+                 bool CanReuseSourceManager) {
+    std::lock_guard<std::mutex> LockGuard(PoolLock);
+    auto Best = Entries.end();
+    for (auto It = Entries.begin(), End = Entries.end(); It != End; ++It) {
+      if (It->Key != Key)
+        continue;
+      if (Best == Entries.end())
+        Best = It;
+      if (It->Files == Files) {
+        Best = It;
+        break;
+      }
+    }
+    if (Best == Entries.end()) {
+      Entry E;
+      E.Key = std::move(Key);
+      return E;
+    }
+    Entry E = std::move(*Best);
+    Entries.erase(Best);
+    if (!CanReuseSourceManager || E.Files != Files)
+      E.dropSourceManager();
+    return E;
+  }
+
+  /// Returns \p E to the pool, evicting the least recently used state if the
+  /// pool is full.
+  void checkin(Entry E) {
+    std::lock_guard<std::mutex> LockGuard(PoolLock);
+    Entries.push_front(std::move(E));
+    if (Entries.size() > MaxEntries)
+      Entries.pop_back();
+  }
+
+  /// Runs \p Action in the same way as \c FrontendActionFactory.
+  static bool
+  runUnpooled(std::unique_ptr<FrontendAction> Action,
+              std::shared_ptr<CompilerInvocation> Invocation,
+              FileManager *Files,
+              std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+              DiagnosticConsumer *DiagConsumer) {
+    CompilerInstance Compiler(std::move(PCHContainerOps));
+    Compiler.setInvocation(std::move(Invocation));
+    Compiler.setFileManager(Files);
+    std::unique_ptr<FrontendAction> ScopedToolAction = std::move(Action);
+
+    Compiler.createDiagnostics(DiagConsumer, /*ShouldOwnClient=*/false);
+    if (!Compiler.hasDiagnostics())
+      return false;
+
+    Compiler.createSourceManager(*Files);
+
+    const bool Success = Compiler.ExecuteAction(*ScopedToolAction);
+
+    Files->clearStatCache();
+    return Success;
+  }
+
+  const unsigned MaxEntries;
+  const bool ReuseSourceManagers;
+  const size_t MaxSourceManagerBytes;
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex PoolLock;
+  /// The pooled state that is not in use, most recently used first.
+  std::list<Entry> Entries;
+  unsigned NumReusedTargets = 0;
+  unsigned NumReusedSourceManagers = 0;
+};
+
+/// A \c FrontendActionFactory that runs the actions of another factory with
+/// compiler state from a \c CompilerInstancePool.
+///
+/// This factory is thread-safe and may be used from \c AllTUsToolExecutor,
+/// although source managers are only reused by translation units that share a
+/// file manager, as those run by \c ClangTool do.
+class PooledFrontendActionFactory : public FrontendActionFactory {
+public:
+  PooledFrontendActionFactory(std::unique_ptr<FrontendActionFactory> Inner,
+                              CompilerInstancePool &Pool)
+      : Inner(std::move(Inner)), Pool(Pool) {}
+
+  std::unique_ptr<FrontendAction> create() override { return Inner->create(); }
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    return Pool.run(create(), std::move(Invocation), Files,
+                    std::move(PCHContainerOps), DiagConsumer);
+  }
+
+private:
+  std::unique_ptr<FrontendActionFactory> Inner;
+  CompilerInstancePool &Pool;
+};
+
+/// Returns a new \c PooledFrontendActionFactory for the action \c T.
+///
+/// \code
+///   CompilerInstancePool Pool;
+///   Tool.run(newPooledFrontendActionFactory<SyntaxOnlyAction>(Pool).get());
+/// \endcode
+template <typename T>
+std::unique_ptr<FrontendActionFactory>
+newPooledFrontendActionFactory(CompilerInstancePool &Pool) {
+  return std::make_unique<PooledFrontendActionFactory>(
+      newFrontendActionFactory<T>(), Pool);
+}
+
+} // end namespace tooling
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_COMPILERINSTANCEPOOL_H
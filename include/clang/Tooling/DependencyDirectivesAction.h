@@ -0,0 +1,141 @@
+//===- DependencyDirectivesAction.h - Directive-only tool runs --*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+//  This file defines an opt-in ClangTool mode for preprocessor-only actions
+//  (include-graph and macro-inventory tools, for example) that preprocesses
+//  every file from the cached dependency directives produced by the dependency
+//  scanner, instead of lexing the full contents of each header.
+//
+//  The directives are cached in a DependencyScanningFilesystemSharedCache,
+//  which can be shared by all threads of a run and with a
+//  DependencyScanningService.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_DEPENDENCYDIRECTIVESACTION_H
+#define LLVM_CLANG_TOOLING_DEPENDENCYDIRECTIVESACTION_H
+
+#include "clang/Basic/FileManager.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Tooling/DependencyScanning/DependencyScanningFilesystem.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include <memory>
+#include <type_traits>
+
+namespace clang {
+namespace tooling {
+
+/// A \c FrontendActionFactory that runs the actions of another factory with
+/// the preprocessor fed from cached dependency directives.
+///
+/// The directive-only lexer skips every token that is not part of a
+/// preprocessor directive, so include directives, conditionals and macro
+/// definitions are visible while everything else is not. Only actions whose
+/// results do not depend on the other tokens are run this way: subclasses of
+/// \c PreprocessOnlyAction, which discard the tokens and only report what
+/// their \c PPCallbacks see. Other actions, including preprocessor-only ones
+/// that print or dump tokens such as \c PrintPreprocessedAction and
+/// \c DumpTokensAction, fall back to regular preprocessing.
+///
+/// Files are read through a \c DependencyScanningWorkerFilesystem layered on
+/// top of the file manager passed by \c ClangTool, so mapped virtual files are
+/// honored. Like in the dependency scanner, files are assumed not to change for
+/// the lifetime of the shared cache.
+///
+/// This factory is thread-safe and may be used from \c AllTUsToolExecutor.
+class DependencyDirectivesActionFactory : public FrontendActionFactory {
+public:
+  DependencyDirectivesActionFactory(
+      std::unique_ptr<FrontendActionFactory> Inner,
+      dependencies::DependencyScanningFilesystemSharedCache &SharedCache)
+      : Inner(std::move(Inner)), SharedCache(SharedCache) {}
+
+  std::unique_ptr<FrontendAction> create() override { return Inner->create(); }
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    llvm::IntrusiveRefCntPtr<FileManager> DepFiles;
+    std::unique_ptr<FrontendAction> NewAction(create());
+    if (isUnaffectedByDirectivesOnly(*NewAction)) {
+      auto DepFS = llvm::makeIntrusiveRefCnt<
+          dependencies::DependencyScanningWorkerFilesystem>(
+          SharedCache, Files->getVirtualFileSystemPtr());
+      DepFiles = llvm::makeIntrusiveRefCnt<FileManager>(
+          Files->getFileSystemOpts(), DepFS);
+      Invocation->getPreprocessorOpts().DependencyDirectivesForFile =
+          [DepFS](FileEntryRef File)
+          -> Optional<ArrayRef<dependency_directives_scan::Directive>> {
+        if (llvm::ErrorOr<dependencies::EntryRef> Entry =
+                DepFS->getOrCreateFileSystemEntry(File.getName()))
+          return Entry->getDirectiveTokens();
+        return None;
+      };
+      Files = DepFiles.get();
+    }
+
+    CompilerInstance Compiler(std::move(PCHContainerOps));
+    Compiler.setInvocation(std::move(Invocation));
+    Compiler.setFileManager(Files);
+    // The FrontendAction can have lifetime requirements for Compiler or its
+    // members, and we need to ensure it's deleted earlier than Compiler. So we
+    // move it to an std::unique_ptr declared after the Compiler variable.
+    std::unique_ptr<FrontendAction> ScopedToolAction = std::move(NewAction);
+
+    Compiler.createDiagnostics(DiagConsumer, /*ShouldOwnClient=*/false);
+    if (!Compiler.hasDiagnostics())
+      return false;
+
+    Compiler.createSourceManager(*Files);
+
+    const bool Success = Compiler.ExecuteAction(*ScopedToolAction);
+
+    Files->clearStatCache();
+    return Success;
+  }
+
+private:
+  /// Whether the results of \p Action are the same when the preprocessor
+  /// only sees the directives.
+  static bool isUnaffectedByDirectivesOnly(const FrontendAction &Action) {
+    return dynamic_cast<const PreprocessOnlyAction *>(&Action) != nullptr;
+  }
+
+  std::unique_ptr<FrontendActionFactory> Inner;
+  dependencies::DependencyScanningFilesystemSharedCache &SharedCache;
+};
+
+/// Returns a new \c DependencyDirectivesActionFactory for the action \c T, a
+/// subclass of \c PreprocessOnlyAction that installs its own \c PPCallbacks.
+///
+/// \code
+///   DependencyScanningFilesystemSharedCache Cache;
+///   Tool.run(newDependencyDirectivesActionFactory<IncludeGraphAction>(Cache)
+///                .get());
+/// \endcode
+template <typename T>
+std::unique_ptr<FrontendActionFactory> newDependencyDirectivesActionFactory(
+    dependencies::DependencyScanningFilesystemSharedCache &SharedCache) {
+  static_assert(std::is_base_of<PreprocessOnlyAction, T>::value,
+                "dependency directives can only drive actions that discard "
+                "the preprocessed tokens");
+  return std::make_unique<DependencyDirectivesActionFactory>(
+      newFrontendActionFactory<T>(), SharedCache);
+}
+
+} // end namespace tooling
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_DEPENDENCYDIRECTIVESACTION_H
@@ -0,0 +1,240 @@
+//===- DependencyScanningBatch.h - Parallel dependency scanning -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines DependencyScanningBatch, which scans many translation units
+// in parallel on top of a single DependencyScanningService, reusing one
+// DependencyScanningTool per thread.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_DEPENDENCYSCANNING_DEPENDENCYSCANNINGBATCH_H
+#define LLVM_CLANG_TOOLING_DEPENDENCYSCANNING_DEPENDENCYSCANNINGBATCH_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Tooling/DependencyScanning/DependencyScanningService.h"
+#include "clang/Tooling/DependencyScanning/DependencyScanningTool.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace clang {
+namespace tooling {
+namespace dependencies {
+
+/// A single translation unit to be scanned by \c DependencyScanningBatch.
+struct ScanCommand {
+  /// The clang driver command-line, including argv[0].
+  std::vector<std::string> CommandLine;
+  /// The working directory the command-line is relative to.
+  std::string WorkingDirectory;
+};
+
+/// Scans many translation units in parallel using a shared
+/// \c DependencyScanningService.
+///
+/// Each thread owns one \c DependencyScanningTool which is reused for every
+/// command it scans, including across calls to \c scanAll, so its local
+/// filesystem caches stay warm. Commands are distributed in contiguous blocks
+/// to per-thread queues; a thread that runs out of work steals from the back
+/// of another thread's queue. Commands with an identical command-line and
+/// working directory are only scanned once, and the result is reported for
+/// every occurrence.
+class DependencyScanningBatch {
+public:
+  /// Creates a new file system for each worker thread.
+  using FileSystemFactory =
+      std::function<llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>()>;
+
+  /// Receives the result for \c Commands[Index]. Calls are serialized, so the
+  /// callback does not need to be thread-safe.
+  template <typename T>
+  using ResultCallback =
+      llvm::function_ref<void(size_t Index, llvm::Expected<T> Result)>;
+
+  /// \param Concurrency The number of worker threads. If 0, this uses
+  ///                    \c llvm::hardware_concurrency.
+  /// \param CreateFS Creates the underlying file system of each worker. If
+  ///                 empty, the real file system is used.
+  DependencyScanningBatch(DependencyScanningService &Service,
+                          unsigned Concurrency = 0,
+                          FileSystemFactory CreateFS = nullptr)
+      : Service(Service), Pool(llvm::hardware_concurrency(Concurrency)),
+        CreateFS(std::move(CreateFS)) {
+    Tools.resize(Pool.getThreadCount());
+  }
+
+  /// The number of worker threads.
+  unsigned getConcurrency() const { return Tools.size(); }
+
+  /// When set, results are reported in the order of the input commands rather
+  /// than in completion order. Results that finish early are buffered until
+  /// all preceding results have been reported.
+  void setDeliverInOrder(bool Value) { DeliverInOrder = Value; }
+
+  /// Collects the full dependencies of every command in \p Commands.
+  ///
+  /// \param AlreadySeen Modules that have already been reported and should be
+  ///                    omitted from the results. It is only read, and may be
+  ///                    shared by all worker threads.
+  void scanAll(ArrayRef<ScanCommand> Commands,
+               LookupModuleOutputCallback LookupModuleOutput,
+               ResultCallback<FullDependenciesResult> Callback,
+               const llvm::StringSet<> &AlreadySeen = llvm::StringSet<>()) {
+    scanAllImpl<FullDependenciesResult>(
+        Commands, Callback,
+        [&](DependencyScanningTool &Tool, const ScanCommand &Cmd) {
+          return Tool.getFullDependencies(Cmd.CommandLine,
+                                          Cmd.WorkingDirectory, AlreadySeen,
+                                          LookupModuleOutput);
+        });
+  }
+
+  /// Computes the dependency file (in the format selected by the command-line)
+  /// of every command in \p Commands.
+  void scanAllDependencyFiles(ArrayRef<ScanCommand> Commands,
+                              ResultCallback<std::string> Callback) {
+    scanAllImpl<std::string>(
+        Commands, Callback,
+        [](DependencyScanningTool &Tool, const ScanCommand &Cmd) {
+          return Tool.getDependencyFile(Cmd.CommandLine, Cmd.WorkingDirectory);
+        });
+  }
+
+private:
+  /// Per-thread queue of indices into the unique commands.
+  struct WorkQueue {
+    std::mutex Lock;
+    std::deque<size_t> Items;
+  };
+
+  template <typename T>
+  void scanAllImpl(
+      ArrayRef<ScanCommand> Commands, ResultCallback<T> Callback,
+      llvm::function_ref<llvm::Expected<T>(DependencyScanningTool &,
+                                           const ScanCommand &)>
+          Scan) {
+    // Deduplicate identical (command-line, working directory) pairs.
+    std::vector<size_t> Unique;
+    std::vector<SmallVector<size_t, 1>> Occurrences;
+    {
+      llvm::StringMap<size_t> UniqueByKey;
+      std::string Key;
+      for (size_t I = 0, E = Commands.size(); I != E; ++I) {
+        Key = Commands[I].WorkingDirectory;
+        for (const std::string &Arg : Commands[I].CommandLine) {
+          Key += '\0';
+          Key += Arg;
+        }
+        auto Inserted = UniqueByKey.insert({Key, Unique.size()});
+        if (Inserted.second) {
+          Unique.push_back(I);
+          Occurrences.emplace_back();
+        }
+        Occurrences[Inserted.first->second].push_back(I);
+      }
+    }
+    if (Unique.empty())
+      return;
+
+    // Hand out contiguous blocks of work, which keeps related translation
+    // units (and their headers) on the same worker.
+    unsigned NumWorkers = std::min<size_t>(Tools.size(), Unique.size());
+    std::unique_ptr<WorkQueue[]> Queues(new WorkQueue[NumWorkers]);
+    for (size_t I = 0, E = Unique.size(); I != E; ++I)
+      Queues[I * NumWorkers / E].Items.push_back(I);
+
+    std::mutex ResultLock;
+    size_t NextInOrder = 0;
+    std::map<size_t, llvm::Expected<T>> Pending;
+    auto Deliver = [&](size_t Index, llvm::Expected<T> Result) {
+      if (!DeliverInOrder) {
+        Callback(Index, std::move(Result));
+        return;
+      }
+      Pending.emplace(Index, std::move(Result));
+      for (auto It = Pending.begin();
+           It != Pending.end() && It->first == NextInOrder;
+           It = Pending.erase(It), ++NextInOrder)
+        Callback(It->first, std::move(It->second));
+    };
+
+    auto Report = [&](size_t UniqueIndex, llvm::Expected<T> Result) {
+      std::lock_guard<std::mutex> LockGuard(ResultLock);
+      ArrayRef<size_t> Indices = Occurrences[UniqueIndex];
+      if (Indices.size() == 1)
+        return Deliver(Indices.front(), std::move(Result));
+      // Duplicates receive copies of the result of the first occurrence.
+      if (!Result) {
+        std::string Message = llvm::toString(Result.takeError());
+        for (size_t Index : Indices)
+          Deliver(Index, llvm::createStringError(
+                             llvm::inconvertibleErrorCode(), Message));
+        return;
+      }
+      for (size_t Index : Indices.drop_back())
+        Deliver(Index, T(*Result));
+      Deliver(Indices.back(), std::move(Result));
+    };
+
+    auto Pop = [&](unsigned Worker, size_t &Item) {
+      // Take from the front of our own queue first, then steal from the back
+      // of the others.
+      for (unsigned I = 0; I != NumWorkers; ++I) {
+        WorkQueue &Q = Queues[(Worker + I) % NumWorkers];
+        std::lock_guard<std::mutex> LockGuard(Q.Lock);
+        if (Q.Items.empty())
+          continue;
+        if (I == 0) {
+          Item = Q.Items.front();
+          Q.Items.pop_front();
+        } else {
+          Item = Q.Items.back();
+          Q.Items.pop_back();
+        }
+        return true;
+      }
+      return false;
+    };
+
+    for (unsigned Worker = 0; Worker != NumWorkers; ++Worker) {
+      Pool.async([&, Worker] {
+        std::unique_ptr<DependencyScanningTool> &Tool = Tools[Worker];
+        if (!Tool)
+          Tool = std::make_unique<DependencyScanningTool>(
+              Service, CreateFS ? CreateFS()
+                                : llvm::vfs::createPhysicalFileSystem());
+        size_t Item;
+        while (Pop(Worker, Item))
+          Report(Item, Scan(*Tool, Commands[Unique[Item]]));
+      });
+    }
+    Pool.wait();
+  }
+
+  DependencyScanningService &Service;
+  llvm::ThreadPool Pool;
+  FileSystemFactory CreateFS;
+  /// One lazily created tool per worker thread, reused across calls.
+  std::vector<std::unique_ptr<DependencyScanningTool>> Tools;
+  bool DeliverInOrder = false;
+};
+
+} // end namespace dependencies
+} // end namespace tooling
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_DEPENDENCYSCANNING_DEPENDENCYSCANNINGBATCH_H
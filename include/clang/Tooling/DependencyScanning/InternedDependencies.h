@@ -0,0 +1,477 @@
+//===- InternedDependencies.h - Deduplicated scan results -------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines a compact representation of dependency scanning results.
+// Paths, command-line arguments and the discovered module graph are interned
+// once in an \c InternedDependencyStore, and individual results only refer to
+// that storage, so scanning many translation units that include the same
+// headers does not keep a separate copy of every path per result.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_DEPENDENCYSCANNING_INTERNEDDEPENDENCIES_H
+#define LLVM_CLANG_TOOLING_DEPENDENCYSCANNING_INTERNEDDEPENDENCIES_H
+
+#include "clang/Basic/LLVM.h"
+#include "clang/Tooling/DependencyScanning/DependencyScanningTool.h"
+#include "clang/Tooling/DependencyScanning/ModuleDepCollector.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Threading.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace clang {
+namespace tooling {
+namespace dependencies {
+
+/// A string owned by an \c InternedDependencyStore.
+///
+/// Two interned strings from the same store compare equal if and only if
+/// their contents are equal, so comparison and hashing are pointer-based.
+/// The referenced storage lives as long as the owning store.
+class InternedString {
+public:
+  using EntryTy = llvm::StringMapEntry<llvm::NoneType>;
+
+  InternedString() = default;
+  explicit InternedString(const EntryTy *Entry) : Entry(Entry) {}
+
+  StringRef str() const { return Entry ? Entry->getKey() : StringRef(); }
+  operator StringRef() const { return str(); }
+
+  bool empty() const { return str().empty(); }
+
+  const EntryTy *getEntry() const { return Entry; }
+
+  friend bool operator==(InternedString LHS, InternedString RHS) {
+    return LHS.Entry == RHS.Entry;
+  }
+  friend bool operator!=(InternedString LHS, InternedString RHS) {
+    return LHS.Entry != RHS.Entry;
+  }
+  friend llvm::hash_code hash_value(InternedString S) {
+    return llvm::hash_value(S.Entry);
+  }
+
+private:
+  const EntryTy *Entry = nullptr;
+};
+
+/// An immutable, deduplicated list of interned strings. Identical lists (e.g.
+/// the same module map dependencies reported by many translation units) share
+/// the same storage.
+using InternedStringList = ArrayRef<InternedString>;
+
+/// The interned counterpart of \c ModuleID.
+struct InternedModuleID {
+  InternedString ModuleName;
+  InternedString ContextHash;
+
+  ModuleID getModuleID() const {
+    return ModuleID{ModuleName.str().str(), ContextHash.str().str()};
+  }
+
+  friend bool operator==(const InternedModuleID &LHS,
+                         const InternedModuleID &RHS) {
+    return LHS.ModuleName == RHS.ModuleName &&
+           LHS.ContextHash == RHS.ContextHash;
+  }
+  friend llvm::hash_code hash_value(const InternedModuleID &ID) {
+    return llvm::hash_combine(ID.ModuleName, ID.ContextHash);
+  }
+};
+
+/// The interned counterpart of \c PrebuiltModuleDep.
+struct InternedPrebuiltModuleDep {
+  InternedString ModuleName;
+  InternedString PCMFile;
+  InternedString ModuleMapFile;
+};
+
+/// The interned counterpart of \c Command.
+struct InternedCommand {
+  InternedString Executable;
+  InternedStringList Arguments;
+};
+
+/// The interned counterpart of \c ModuleDeps. Each module is stored exactly
+/// once per \c InternedDependencyStore, no matter how many translation units
+/// discovered it.
+struct InternedModuleDeps {
+  InternedModuleID ID;
+  bool IsSystem = false;
+  InternedString ClangModuleMapFile;
+  InternedString ImplicitModulePCMPath;
+  /// Sorted, so that equal sets of file dependencies share storage.
+  InternedStringList FileDeps;
+  InternedStringList ModuleMapFileDeps;
+  ArrayRef<InternedPrebuiltModuleDep> PrebuiltModuleDeps;
+  ArrayRef<InternedModuleID> ClangModuleDeps;
+  bool ImportedByMainFile = false;
+  InternedStringList BuildArguments;
+};
+
+/// The interned counterpart of \c FullDependencies.
+///
+/// This is a small, trivially copyable view; all referenced data is owned by
+/// the \c InternedDependencyStore that produced it. Modules are referenced by
+/// ID and can be resolved with \c InternedDependencyStore::getModule.
+struct InternedFullDependencies {
+  InternedModuleID ID;
+  InternedStringList FileDeps;
+  ArrayRef<InternedPrebuiltModuleDep> PrebuiltModuleDeps;
+  ArrayRef<InternedModuleID> ClangModuleDeps;
+  ArrayRef<InternedCommand> Commands;
+  InternedStringList DriverCommandLine;
+};
+
+} // end namespace dependencies
+} // end namespace tooling
+} // end namespace clang
+
+namespace llvm {
+template <> struct DenseMapInfo<clang::tooling::dependencies::InternedString> {
+  using InternedString = clang::tooling::dependencies::InternedString;
+  using EntryInfo = DenseMapInfo<const InternedString::EntryTy *>;
+  static inline InternedString getEmptyKey() {
+    return InternedString(EntryInfo::getEmptyKey());
+  }
+  static inline InternedString getTombstoneKey() {
+    return InternedString(EntryInfo::getTombstoneKey());
+  }
+  static unsigned getHashValue(InternedString S) {
+    return EntryInfo::getHashValue(S.getEntry());
+  }
+  static bool isEqual(InternedString LHS, InternedString RHS) {
+    return LHS == RHS;
+  }
+};
+
+template <>
+struct DenseMapInfo<clang::tooling::dependencies::InternedModuleID> {
+  using InternedModuleID = clang::tooling::dependencies::InternedModuleID;
+  using StringInfo =
+      DenseMapInfo<clang::tooling::dependencies::InternedString>;
+  static inline InternedModuleID getEmptyKey() {
+    return InternedModuleID{StringInfo::getEmptyKey(),
+                            StringInfo::getEmptyKey()};
+  }
+  static inline InternedModuleID getTombstoneKey() {
+    return InternedModuleID{StringInfo::getTombstoneKey(),
+                            StringInfo::getTombstoneKey()};
+  }
+  static unsigned getHashValue(const InternedModuleID &ID) {
+    return detail::combineHashValue(StringInfo::getHashValue(ID.ModuleName),
+                                    StringInfo::getHashValue(ID.ContextHash));
+  }
+  static bool isEqual(const InternedModuleID &LHS,
+                      const InternedModuleID &RHS) {
+    return LHS == RHS;
+  }
+};
+} // namespace llvm
+
+namespace clang {
+namespace tooling {
+namespace dependencies {
+
+/// Owns the interned paths, arguments and module graph of any number of
+/// dependency scanning results.
+///
+/// A single store is meant to live alongside a \c DependencyScanningService
+/// and be shared by all of its workers. All member functions are thread-safe.
+/// The string table is sharded by hash to reduce lock contention between
+/// worker threads, in the same way as
+/// \c DependencyScanningFilesystemSharedCache.
+class InternedDependencyStore {
+public:
+  explicit InternedDependencyStore(unsigned NumShards = 0)
+      : NumShards(NumShards ? NumShards
+                            : std::max(2u, llvm::hardware_concurrency()
+                                                   .compute_thread_count() /
+                                               4)),
+        StringShards(new StringShard[this->NumShards]) {}
+
+  InternedDependencyStore(const InternedDependencyStore &) = delete;
+  InternedDependencyStore &
+  operator=(const InternedDependencyStore &) = delete;
+
+  /// Returns the unique interned copy of \p S.
+  InternedString intern(StringRef S) {
+    StringShard &Shard = StringShards[llvm::hash_value(S) % NumShards];
+    std::lock_guard<std::mutex> LockGuard(Shard.Lock);
+    return InternedString(&*Shard.Strings.insert(S).first);
+  }
+
+  /// Returns the unique interned copy of the list \p Strings.
+  template <typename RangeT> InternedStringList internList(RangeT &&Strings) {
+    SmallVector<InternedString, 32> Interned;
+    for (const auto &S : Strings)
+      Interned.push_back(intern(S));
+    std::lock_guard<std::mutex> LockGuard(StorageLock);
+    return internListLocked(Interned);
+  }
+
+  /// Interns \p MD unless a module with the same ID has already been stored,
+  /// in which case the existing entry is returned.
+  const InternedModuleDeps &intern(const ModuleDeps &MD) {
+    InternedModuleID ID = intern(MD.ID);
+    {
+      std::lock_guard<std::mutex> LockGuard(StorageLock);
+      auto It = Modules.find(ID);
+      if (It != Modules.end())
+        return *It->second;
+    }
+
+    SmallVector<StringRef, 32> SortedFileDeps;
+    for (const auto &Entry : MD.FileDeps)
+      SortedFileDeps.push_back(Entry.getKey());
+    llvm::sort(SortedFileDeps);
+
+    SmallVector<InternedString, 32> FileDeps, ModuleMapFileDeps, BuildArgs;
+    for (StringRef Path : SortedFileDeps)
+      FileDeps.push_back(intern(Path));
+    for (const std::string &Path : MD.ModuleMapFileDeps)
+      ModuleMapFileDeps.push_back(intern(Path));
+    for (const std::string &Arg : MD.BuildArguments)
+      BuildArgs.push_back(intern(Arg));
+    SmallVector<InternedPrebuiltModuleDep, 4> PrebuiltDeps =
+        intern(MD.PrebuiltModuleDeps);
+    SmallVector<InternedModuleID, 16> ModuleDepIDs = intern(MD.ClangModuleDeps);
+    InternedString ModuleMapFile = intern(MD.ClangModuleMapFile);
+    InternedString PCMPath = intern(MD.ImplicitModulePCMPath);
+
+    std::lock_guard<std::mutex> LockGuard(StorageLock);
+    // Another thread may have stored the same module in the meantime.
+    InternedModuleDeps *&Slot = Modules[ID];
+    if (Slot)
+      return *Slot;
+    Slot = new (Alloc.Allocate<InternedModuleDeps>()) InternedModuleDeps();
+    Slot->ID = ID;
+    Slot->IsSystem = MD.IsSystem;
+    Slot->ClangModuleMapFile = ModuleMapFile;
+    Slot->ImplicitModulePCMPath = PCMPath;
+    Slot->FileDeps = internListLocked(FileDeps);
+    Slot->ModuleMapFileDeps = internListLocked(ModuleMapFileDeps);
+    Slot->PrebuiltModuleDeps =
+        copyLocked<InternedPrebuiltModuleDep>(PrebuiltDeps);
+    Slot->ClangModuleDeps = copyLocked<InternedModuleID>(ModuleDepIDs);
+    Slot->ImportedByMainFile = MD.ImportedByMainFile;
+    Slot->BuildArguments = internListLocked(BuildArgs);
+    ModuleOrder.push_back(Slot);
+    return *Slot;
+  }
+
+  /// Interns the translation unit dependencies \p FD.
+  InternedFullDependencies intern(const FullDependencies &FD) {
+    SmallVector<InternedString, 64> FileDeps;
+    for (const std::string &Path : FD.FileDeps)
+      FileDeps.push_back(intern(Path));
+    SmallVector<InternedString, 64> DriverCommandLine;
+    for (const std::string &Arg : FD.DriverCommandLine)
+      DriverCommandLine.push_back(intern(Arg));
+    SmallVector<InternedPrebuiltModuleDep, 4> PrebuiltDeps =
+        intern(FD.PrebuiltModuleDeps);
+    SmallVector<InternedModuleID, 16> ModuleDepIDs = intern(FD.ClangModuleDeps);
+
+    SmallVector<std::pair<InternedString, SmallVector<InternedString, 64>>, 2>
+        Commands;
+    for (const Command &Cmd : FD.Commands) {
+      Commands.emplace_back(intern(Cmd.Executable),
+                            SmallVector<InternedString, 64>());
+      for (const std::string &Arg : Cmd.Arguments)
+        Commands.back().second.push_back(intern(Arg));
+    }
+
+    InternedFullDependencies Result;
+    Result.ID = intern(FD.ID);
+
+    std::lock_guard<std::mutex> LockGuard(StorageLock);
+    Result.FileDeps = internListLocked(FileDeps);
+    Result.PrebuiltModuleDeps =
+        copyLocked<InternedPrebuiltModuleDep>(PrebuiltDeps);
+    Result.ClangModuleDeps = copyLocked<InternedModuleID>(ModuleDepIDs);
+    Result.DriverCommandLine = internListLocked(DriverCommandLine);
+    if (!Commands.empty()) {
+      InternedCommand *Cmds = Alloc.Allocate<InternedCommand>(Commands.size());
+      for (unsigned I = 0, E = Commands.size(); I != E; ++I)
+        new (&Cmds[I]) InternedCommand{Commands[I].first,
+                                       internListLocked(Commands[I].second)};
+      Result.Commands = llvm::makeArrayRef(Cmds, Commands.size());
+    }
+    return Result;
+  }
+
+  /// Interns the translation unit dependencies and all modules discovered
+  /// while scanning it. Modules that are already present in the store are not
+  /// stored again.
+  InternedFullDependencies intern(const FullDependenciesResult &FDR) {
+    for (const ModuleDeps &MD : FDR.DiscoveredModules)
+      intern(MD);
+    return intern(FDR.FullDeps);
+  }
+
+  /// Returns the stored module with the given ID, or nullptr if it has not
+  /// been discovered by any interned result.
+  const InternedModuleDeps *getModule(InternedModuleID ID) const {
+    std::lock_guard<std::mutex> LockGuard(StorageLock);
+    return Modules.lookup(ID);
+  }
+
+  /// Invokes \p Callback for every stored module, in the order in which they
+  /// were first interned.
+  void forEachModule(
+      llvm::function_ref<void(const InternedModuleDeps &)> Callback) const {
+    std::vector<const InternedModuleDeps *> Snapshot;
+    {
+      std::lock_guard<std::mutex> LockGuard(StorageLock);
+      Snapshot = ModuleOrder;
+    }
+    for (const InternedModuleDeps *MD : Snapshot)
+      Callback(*MD);
+  }
+
+  /// Invokes \p Callback for every module in \p Roots and every module they
+  /// transitively depend on, each exactly once, dependencies first.
+  void forEachTransitiveModule(
+      ArrayRef<InternedModuleID> Roots,
+      llvm::function_ref<void(const InternedModuleDeps &)> Callback) const {
+    llvm::DenseSet<InternedModuleID> Seen;
+    SmallVector<std::pair<const InternedModuleDeps *, unsigned>, 16> Worklist;
+    auto Push = [&](InternedModuleID ID) {
+      if (!Seen.insert(ID).second)
+        return;
+      if (const InternedModuleDeps *MD = getModule(ID))
+        Worklist.push_back({MD, 0});
+    };
+    for (InternedModuleID Root : Roots) {
+      Push(Root);
+      while (!Worklist.empty()) {
+        auto &Top = Worklist.back();
+        if (Top.second == Top.first->ClangModuleDeps.size()) {
+          const InternedModuleDeps *MD = Top.first;
+          Worklist.pop_back();
+          Callback(*MD);
+          continue;
+        }
+        Push(Top.first->ClangModuleDeps[Top.second++]);
+      }
+    }
+  }
+
+  /// \returns The number of distinct strings in the store.
+  size_t getNumStrings() const {
+    size_t Count = 0;
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(StringShards[I].Lock);
+      Count += StringShards[I].Strings.size();
+    }
+    return Count;
+  }
+
+  /// \returns The number of distinct modules in the store.
+  size_t getNumModules() const {
+    std::lock_guard<std::mutex> LockGuard(StorageLock);
+    return ModuleOrder.size();
+  }
+
+  /// \returns The number of bytes allocated for interned data.
+  size_t getTotalMemory() const {
+    size_t Bytes = 0;
+    for (unsigned I = 0; I != NumShards; ++I) {
+      std::lock_guard<std::mutex> LockGuard(StringShards[I].Lock);
+      Bytes += StringShards[I].Strings.getAllocator().getTotalMemory() +
+               StringShards[I].Strings.getNumBuckets() *
+                   (sizeof(void *) + sizeof(unsigned));
+    }
+    std::lock_guard<std::mutex> LockGuard(StorageLock);
+    return Bytes + Alloc.getTotalMemory() + Lists.getMemorySize() +
+           Modules.getMemorySize() +
+           ModuleOrder.capacity() * sizeof(ModuleOrder[0]);
+  }
+
+private:
+  struct StringShard {
+    /// The mutex that needs to be locked before mutation of any member.
+    mutable std::mutex Lock;
+    /// The interned strings. Entries are never removed, so their addresses
+    /// are stable for the lifetime of the store.
+    llvm::StringSet<llvm::BumpPtrAllocator> Strings;
+  };
+
+  InternedModuleID intern(const ModuleID &ID) {
+    return InternedModuleID{intern(ID.ModuleName), intern(ID.ContextHash)};
+  }
+
+  SmallVector<InternedModuleID, 16> intern(ArrayRef<ModuleID> IDs) {
+    SmallVector<InternedModuleID, 16> Result;
+    for (const ModuleID &ID : IDs)
+      Result.push_back(intern(ID));
+    return Result;
+  }
+
+  SmallVector<InternedPrebuiltModuleDep, 4>
+  intern(ArrayRef<PrebuiltModuleDep> Deps) {
+    SmallVector<InternedPrebuiltModuleDep, 4> Result;
+    for (const PrebuiltModuleDep &PMD : Deps)
+      Result.push_back(InternedPrebuiltModuleDep{intern(PMD.ModuleName),
+                                                 intern(PMD.PCMFile),
+                                                 intern(PMD.ModuleMapFile)});
+    return Result;
+  }
+
+  /// Returns the unique copy of \p Strings. \c StorageLock must be held.
+  InternedStringList internListLocked(ArrayRef<InternedString> Strings) {
+    if (Strings.empty())
+      return InternedStringList();
+    auto It = Lists.find(Strings);
+    if (It != Lists.end())
+      return *It;
+    InternedStringList Copy = copyLocked<InternedString>(Strings);
+    Lists.insert(Copy);
+    return Copy;
+  }
+
+  /// Copies \p Elts into the store. \c StorageLock must be held.
+  template <typename T> ArrayRef<T> copyLocked(ArrayRef<T> Elts) {
+    if (Elts.empty())
+      return ArrayRef<T>();
+    T *Storage = Alloc.Allocate<T>(Elts.size());
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Storage);
+    return llvm::makeArrayRef(Storage, Elts.size());
+  }
+
+  const unsigned NumShards;
+  std::unique_ptr<StringShard[]> StringShards;
+
+  /// The mutex that needs to be locked before mutation of any of the members
+  /// below.
+  mutable std::mutex StorageLock;
+  /// Backing storage for lists and modules. Everything allocated here is
+  /// trivially destructible.
+  llvm::BumpPtrAllocator Alloc;
+  /// The set of distinct non-empty string lists.
+  llvm::DenseSet<InternedStringList> Lists;
+  /// The module graph, keyed by module ID.
+  llvm::DenseMap<InternedModuleID, InternedModuleDeps *> Modules;
+  /// The stored modules in insertion order, for deterministic iteration.
+  std::vector<const InternedModuleDeps *> ModuleOrder;
+};
+
+} // end namespace dependencies
+} // end namespace tooling
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_DEPENDENCYSCANNING_INTERNEDDEPENDENCIES_H
@@ -0,0 +1,406 @@
+//===- ParallelASTBuilder.h - Build ASTs in parallel ------------*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+//  This file defines a parallel counterpart of ClangTool::buildASTs that keeps
+//  the built ASTs within a memory budget by spilling them to AST files, which
+//  are loaded again when they are needed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_PARALLELASTBUILDER_H
+#define LLVM_CLANG_TOOLING_PARALLELASTBUILDER_H
+
+#include "clang/AST/ASTContext.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/FileSystemOptions.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace clang {
+namespace tooling {
+
+class ParallelASTBuilder;
+
+/// A translation unit built by \c ParallelASTBuilder.
+///
+/// The AST of a handle is either resident or spilled to an AST file, from
+/// which \c get loads it again. Units are only spilled while no client holds
+/// the \c ASTUnit returned by \c get, so clients should drop it when they are
+/// done with it. Units loaded from a spill file are not saved again, so they
+/// must not be modified. Destroying the handle releases its AST and spill
+/// file.
+class ASTUnitHandle : public std::enable_shared_from_this<ASTUnitHandle> {
+public:
+  ASTUnitHandle(const ASTUnitHandle &) = delete;
+  ASTUnitHandle &operator=(const ASTUnitHandle &) = delete;
+
+  inline ~ASTUnitHandle();
+
+  /// \returns The main file of the translation unit.
+  StringRef getMainFile() const { return MainFile; }
+
+  /// Returns the AST, loading it from its spill file if necessary, or null if
+  /// it could not be loaded.
+  inline std::shared_ptr<ASTUnit> get();
+
+  /// \returns Whether the AST is currently in memory.
+  bool isResident() const {
+    std::lock_guard<std::mutex> LockGuard(HandleLock);
+    return Unit != nullptr;
+  }
+
+private:
+  friend class ParallelASTBuilder;
+
+  ASTUnitHandle(ParallelASTBuilder &Builder, std::unique_ptr<ASTUnit> Built)
+      : Builder(Builder), MainFile(Built->getMainFileName().str()),
+        FileSystemOpts(Built->getFileSystemOpts()), Unit(std::move(Built)),
+        Size(estimateMemory(*Unit)) {}
+
+  /// Returns an estimate of the memory held by \p AST.
+  static size_t estimateMemory(const ASTUnit &AST) {
+    const ASTContext &Ctx = AST.getASTContext();
+    const SourceManager &SM = AST.getSourceManager();
+    return Ctx.getASTAllocatedMemory() + Ctx.getSideTableAllocatedMemory() +
+           AST.getPreprocessor().getTotalMemory() +
+           SM.getMemoryBufferSizes().malloc_bytes + SM.getContentCacheSize() +
+           SM.getDataStructureSizes();
+  }
+
+  /// Writes the AST to a spill file (unless it was loaded from one) and
+  /// releases it, if no client holds it and it is still the AST of load
+  /// \p Generation.
+  ///
+  /// \returns Whether the AST was released.
+  inline bool spill(unsigned Generation);
+
+  ParallelASTBuilder &Builder;
+  const std::string MainFile;
+  const FileSystemOptions FileSystemOpts;
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex HandleLock;
+  /// The AST, or null if it is spilled.
+  std::shared_ptr<ASTUnit> Unit;
+  /// The estimated memory held by \c Unit.
+  size_t Size;
+  /// The number of times \c Unit was loaded from the spill file.
+  unsigned Generation = 0;
+  /// The AST file holding the AST, if it was spilled before.
+  std::string SpillPath;
+  /// Whether saving the AST failed, e.g. because it has errors.
+  bool Unspillable = false;
+};
+
+/// Builds the ASTs of a set of files on a thread pool, reporting each AST as
+/// soon as it is built.
+///
+/// Like \c ClangTool::buildASTs, but the ASTs are kept within a memory budget:
+/// when the estimated memory held by resident ASTs exceeds the budget, the
+/// least recently used ASTs that are not in use are saved to temporary AST
+/// files and released, and loaded again by \c ASTUnitHandle::get. This lets
+/// tools that need the ASTs of all files of a project process them with a
+/// bounded amount of memory.
+///
+/// The builder does not keep handles alive: the AST of a handle that the
+/// client dropped is released rather than spilled. ASTs that cannot be saved,
+/// e.g. because they have errors, and ASTs that clients hold stay resident
+/// while their handles live, and may take the resident memory over budget.
+///
+/// Each file is built by its own \c ClangTool with its own file system, as in
+/// \c AllTUsToolExecutor. The builder must outlive the handles it returns.
+class ParallelASTBuilder {
+public:
+  /// Creates a new file system for each file.
+  using FileSystemFactory =
+      std::function<IntrusiveRefCntPtr<llvm::vfs::FileSystem>()>;
+
+  /// Receives each built AST. Calls are serialized, so the callback does not
+  /// need to be thread-safe.
+  using ASTCallback = llvm::function_ref<void(std::shared_ptr<ASTUnitHandle>)>;
+
+  /// \param MemoryBudget The estimated memory, in bytes, that resident ASTs
+  ///                     may hold.
+  /// \param Concurrency The number of worker threads. If 0, this uses
+  ///                    \c llvm::hardware_concurrency.
+  /// \param CreateFS Creates the underlying file system of each file. If
+  ///                 empty, a new physical file system is used.
+  ParallelASTBuilder(const CompilationDatabase &Compilations,
+                     size_t MemoryBudget, unsigned Concurrency = 0,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps =
+                         std::make_shared<PCHContainerOperations>(),
+                     FileSystemFactory CreateFS = nullptr)
+      : Compilations(Compilations), MemoryBudget(MemoryBudget),
+        Concurrency(Concurrency), PCHContainerOps(std::move(PCHContainerOps)),
+        CreateFS(std::move(CreateFS)) {}
+
+  ParallelASTBuilder(const ParallelASTBuilder &) = delete;
+  ParallelASTBuilder &operator=(const ParallelASTBuilder &) = delete;
+
+  /// Append a command line arguments adjuster to the adjuster chain.
+  void appendArgumentsAdjuster(ArgumentsAdjuster Adjuster) {
+    if (ArgsAdjuster)
+      ArgsAdjuster =
+          combineAdjusters(std::move(ArgsAdjuster), std::move(Adjuster));
+    else
+      ArgsAdjuster = std::move(Adjuster);
+  }
+
+  /// Builds the ASTs of \p SourcePaths and passes each to \p Callback.
+  ///
+  /// \returns 0 on success; 1 if any of the ASTs failed to build; 2 if there
+  /// is no error but some files are skipped due to missing compile commands,
+  /// as \c ClangTool::buildASTs.
+  int buildASTs(ArrayRef<std::string> SourcePaths, ASTCallback Callback) {
+    std::mutex ResultLock;
+    bool AnyFailed = false;
+    bool AnySkipped = false;
+    {
+      llvm::ThreadPool Pool(llvm::hardware_concurrency(Concurrency));
+      for (const std::string &File : SourcePaths) {
+        Pool.async([&, File] {
+          ClangTool Tool(Compilations, {File}, PCHContainerOps,
+                         CreateFS ? CreateFS()
+                                  : llvm::vfs::createPhysicalFileSystem());
+          // The process working directory is shared by all threads.
+          Tool.setRestoreWorkingDir(false);
+          if (ArgsAdjuster)
+            Tool.appendArgumentsAdjuster(ArgsAdjuster);
+          std::vector<std::unique_ptr<ASTUnit>> ASTs;
+          int Result = Tool.buildASTs(ASTs);
+
+          {
+            std::lock_guard<std::mutex> LockGuard(ResultLock);
+            AnyFailed |= Result == 1;
+            AnySkipped |= Result == 2;
+            for (std::unique_ptr<ASTUnit> &AST : ASTs) {
+              std::shared_ptr<ASTUnitHandle> Handle(
+                  new ASTUnitHandle(*this, std::move(AST)));
+              addResident(Handle, /*Generation=*/0, Handle->Size);
+              Callback(std::move(Handle));
+            }
+          }
+          enforceBudget();
+        });
+      }
+      Pool.wait();
+    }
+    return AnyFailed ? 1 : AnySkipped ? 2 : 0;
+  }
+
+  /// Builds the ASTs of \p SourcePaths and appends their handles to \p ASTs.
+  int buildASTs(ArrayRef<std::string> SourcePaths,
+                std::vector<std::shared_ptr<ASTUnitHandle>> &ASTs) {
+    return buildASTs(SourcePaths, [&](std::shared_ptr<ASTUnitHandle> Handle) {
+      ASTs.push_back(std::move(Handle));
+    });
+  }
+
+  /// \returns The estimated memory, in bytes, held by resident ASTs.
+  size_t getResidentMemory() const {
+    std::lock_guard<std::mutex> LockGuard(BudgetLock);
+    return ResidentMemory;
+  }
+
+  /// \returns The number of times an AST was spilled.
+  unsigned getNumSpills() const {
+    std::lock_guard<std::mutex> LockGuard(BudgetLock);
+    return NumSpills;
+  }
+
+  /// \returns The number of times a spilled AST was loaded again.
+  unsigned getNumReloads() const {
+    std::lock_guard<std::mutex> LockGuard(BudgetLock);
+    return NumReloads;
+  }
+
+private:
+  friend class ASTUnitHandle;
+
+  /// A resident AST.
+  struct ResidentAST {
+    const ASTUnitHandle *Handle;
+    std::weak_ptr<ASTUnitHandle> Ref;
+    /// The load of the AST of \c Handle that this entry stands for.
+    unsigned Generation;
+    /// The estimated memory held by the AST.
+    size_t Size;
+  };
+
+  /// Records that load \p Generation of the AST of \p Handle, holding
+  /// \p Size bytes, became resident.
+  void addResident(const std::shared_ptr<ASTUnitHandle> &Handle,
+                   unsigned Generation, size_t Size, bool Reloaded = false) {
+    std::lock_guard<std::mutex> LockGuard(BudgetLock);
+    ResidentMemory += Size;
+    NumReloads += Reloaded;
+    Resident.push_front({Handle.get(), Handle, Generation, Size});
+  }
+
+  /// Records that load \p Generation of the AST of \p Handle was released.
+  /// A later load of the same AST stays resident.
+  void removeResident(const ASTUnitHandle *Handle, unsigned Generation) {
+    std::lock_guard<std::mutex> LockGuard(BudgetLock);
+    for (auto It = Resident.begin(), End = Resident.end(); It != End; ++It) {
+      if (It->Handle == Handle && It->Generation == Generation) {
+        ResidentMemory -= It->Size;
+        Resident.erase(It);
+        return;
+      }
+    }
+  }
+
+  /// Moves \p Handle to the front of the LRU list.
+  void touch(const ASTUnitHandle *Handle) {
+    std::lock_guard<std::mutex> LockGuard(BudgetLock);
+    for (auto It = Resident.begin(), End = Resident.end(); It != End; ++It) {
+      if (It->Handle == Handle) {
+        Resident.splice(Resident.begin(), Resident, It);
+        return;
+      }
+    }
+  }
+
+  /// Spills least recently used ASTs until the resident ones fit the budget.
+  void enforceBudget() {
+    std::vector<std::pair<std::shared_ptr<ASTUnitHandle>, unsigned>>
+        Candidates;
+    {
+      std::lock_guard<std::mutex> LockGuard(BudgetLock);
+      if (ResidentMemory <= MemoryBudget)
+        return;
+      for (auto It = Resident.rbegin(), End = Resident.rend(); It != End;
+           ++It)
+        // Handles that are being destroyed remove their own entries.
+        if (std::shared_ptr<ASTUnitHandle> Handle = It->Ref.lock())
+          Candidates.emplace_back(std::move(Handle), It->Generation);
+    }
+    // Spilling writes AST files, so do it without holding the lock.
+    for (auto &Candidate : Candidates) {
+      if (!Candidate.first->spill(Candidate.second))
+        continue;
+      removeResident(Candidate.first.get(), Candidate.second);
+      std::lock_guard<std::mutex> LockGuard(BudgetLock);
+      ++NumSpills;
+      if (ResidentMemory <= MemoryBudget)
+        return;
+    }
+  }
+
+  const CompilationDatabase &Compilations;
+  const size_t MemoryBudget;
+  const unsigned Concurrency;
+  std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+  FileSystemFactory CreateFS;
+  ArgumentsAdjuster ArgsAdjuster;
+
+  /// The mutex that needs to be locked before accessing any of the members
+  /// below.
+  mutable std::mutex BudgetLock;
+  /// The resident ASTs, most recently used first.
+  std::list<ResidentAST> Resident;
+  size_t ResidentMemory = 0;
+  unsigned NumSpills = 0;
+  unsigned NumReloads = 0;
+};
+
+ASTUnitHandle::~ASTUnitHandle() {
+  if (Unit)
+    Builder.removeResident(this, Generation);
+  if (!SpillPath.empty())
+    llvm::sys::fs::remove(SpillPath);
+}
+
+std::shared_ptr<ASTUnit> ASTUnitHandle::get() {
+  std::shared_ptr<ASTUnit> Result;
+  bool Reloaded = false;
+  unsigned LoadedGeneration;
+  size_t LoadedSize;
+  {
+    std::lock_guard<std::mutex> LockGuard(HandleLock);
+    if (!Unit) {
+      IntrusiveRefCntPtr<DiagnosticsEngine> Diags =
+          CompilerInstance::createDiagnostics(new DiagnosticOptions,
+                                              new IgnoringDiagConsumer);
+      std::unique_ptr<ASTUnit> Loaded = ASTUnit::LoadFromASTFile(
+          SpillPath, Builder.PCHContainerOps->getRawReader(),
+          ASTUnit::LoadEverything, Diags, FileSystemOpts,
+          /*UseDebugInfo=*/false, /*OnlyLocalDecls=*/false,
+          CaptureDiagsKind::None, /*AllowASTWithCompilerErrors=*/true,
+          /*UserFilesAreVolatile=*/false,
+          Builder.CreateFS ? Builder.CreateFS()
+                           : llvm::vfs::createPhysicalFileSystem());
+      if (!Loaded)
+        return nullptr;
+      Unit = std::move(Loaded);
+      Size = estimateMemory(*Unit);
+      ++Generation;
+      Reloaded = true;
+      LoadedGeneration = Generation;
+      LoadedSize = Size;
+    }
+    Result = Unit;
+  }
+
+  // The returned reference keeps this AST from being spilled to make room.
+  if (Reloaded) {
+    Builder.addResident(shared_from_this(), LoadedGeneration, LoadedSize,
+                        /*Reloaded=*/true);
+    Builder.enforceBudget();
+  } else {
+    Builder.touch(this);
+  }
+  return Result;
+}
+
+bool ASTUnitHandle::spill(unsigned Generation) {
+  std::lock_guard<std::mutex> LockGuard(HandleLock);
+  if (!Unit || Generation != this->Generation || Unit.use_count() > 1 ||
+      Unspillable)
+    return false;
+  if (SpillPath.empty()) {
+    SmallString<128> Path;
+    if (llvm::sys::fs::createTemporaryFile("ast-spill", "ast", Path))
+      return false;
+    if (Unit->Save(Path)) {
+      llvm::sys::fs::remove(Path);
+      Unspillable = true;
+      return false;
+    }
+    SpillPath = std::string(Path);
+  }
+  Unit.reset();
+  return true;
+}
+
+} // end namespace tooling
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_PARALLELASTBUILDER_H
@@ -0,0 +1,692 @@
+//===- SelectiveASTSerialization.h - Persist selected decls -----*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+//  This file defines SelectiveASTWriter, which saves a summary of the
+//  declarations and source ranges that a tool selected from an AST, and
+//  SelectiveASTReader, which reads such summaries without an ASTContext.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_SELECTIVEASTSERIALIZATION_H
+#define LLVM_CLANG_TOOLING_SELECTIVEASTSERIALIZATION_H
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/DeclCXX.h"
+#include "clang/AST/DeclTemplate.h"
+#include "clang/AST/Type.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Index/USRGeneration.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace clang {
+namespace tooling {
+
+namespace selective_ast {
+
+/// The magic number at the start of the files.
+constexpr llvm::StringLiteral Magic = "CSAS";
+/// The version of the file format.
+constexpr uint32_t Version = 1;
+/// Refers to no declaration or file.
+constexpr uint32_t NoIndex = ~0u;
+
+/// The fields of the header, each a 32-bit little-endian integer.
+enum HeaderField : unsigned {
+  HF_Magic,
+  HF_Version,
+  HF_MainFile,
+  HF_NumFiles,
+  HF_NumDecls,
+  HF_NumRanges,
+  HF_NumDependencies,
+  HF_NumUSRs,
+  HF_FilesOffset,
+  HF_DeclsOffset,
+  HF_RangesOffset,
+  HF_DependenciesOffset,
+  HF_USRsOffset,
+  HF_StringsOffset,
+  HF_StringsSize,
+  NumHeaderFields
+};
+
+/// The sizes of the records of each table.
+enum : unsigned {
+  /// Name.
+  FileRecordSize = 8,
+  /// Kind, qualified name, USR, type, parent, flags, range, first dependency
+  /// and number of dependencies.
+  DeclRecordSize = 60,
+  /// Range and label.
+  RangeRecordSize = 20,
+};
+
+/// The flags of a declaration.
+enum DeclFlags : uint32_t {
+  DF_Marked = 1 << 0,
+  DF_Definition = 1 << 1,
+};
+
+} // namespace selective_ast
+
+/// Saves a summary of selected parts of an AST to a compact file, which
+/// \c SelectiveASTReader reads without building an \c ASTContext.
+///
+/// Tools mark the declarations and source ranges that later stages need. The
+/// file then holds the marked declarations and their dependency closure: the
+/// named declarations that enclose them, and the declarations that their
+/// types, bases and templates refer to. Each declaration is summarized by its
+/// kind, qualified name, USR, type, source range and dependencies; neither
+/// bodies nor unmarked members are saved, so the file is a small fraction of
+/// the size of an AST file saved with \c ASTUnit::Save.
+///
+/// A writer is meant to be used while the AST is alive and then dropped, so
+/// that results can be streamed out one translation unit at a time, e.g. from
+/// the consumer of a \c FrontendAction or for each unit of
+/// \c ClangTool::buildASTs before the next one is built.
+class SelectiveASTWriter {
+public:
+  explicit SelectiveASTWriter(ASTContext &Ctx) : Ctx(Ctx) {}
+
+  /// Selects \p D, along with the declarations it depends on.
+  void mark(const Decl *D) {
+    if (!D || isa<TranslationUnitDecl>(D))
+      return;
+    unsigned Index = addDecl(D);
+    Decls[Index].Flags |= selective_ast::DF_Marked;
+  }
+
+  /// Selects the source range \p Range, with a label that describes it.
+  void mark(CharSourceRange Range, StringRef Label) {
+    MarkedRanges.push_back({Range, Label.str()});
+  }
+  void mark(SourceRange Range, StringRef Label) {
+    mark(CharSourceRange::getTokenRange(Range), Label);
+  }
+
+  /// Writes the selected declarations, their dependency closure and the
+  /// selected ranges to \p OS.
+  void write(raw_ostream &OS) {
+    using namespace selective_ast;
+    computeClosure();
+
+    const SourceManager &SM = Ctx.getSourceManager();
+    StringPool Strings;
+    std::vector<uint32_t> FileNames;
+    llvm::DenseMap<FileID, uint32_t> FileIndices;
+    auto GetFile = [&](FileID FID) -> uint32_t {
+      auto Inserted = FileIndices.try_emplace(FID, FileNames.size());
+      if (Inserted.second) {
+        StringRef Name;
+        if (Optional<FileEntryRef> File = SM.getFileEntryRefForID(FID))
+          Name = File->getName();
+        else
+          Name = SM.getBufferName(SM.getLocForStartOfFile(FID));
+        FileNames.push_back(Strings.add(Name));
+      }
+      return Inserted.first->second;
+    };
+    auto GetRange = [&](CharSourceRange Range, uint32_t Out[3]) {
+      Out[0] = NoIndex;
+      Out[1] = Out[2] = 0;
+      if (Range.isInvalid())
+        return;
+      Range = Lexer::getAsCharRange(SM.getExpansionRange(Range), SM,
+                                    Ctx.getLangOpts());
+      std::pair<FileID, unsigned> Begin =
+          SM.getDecomposedLoc(Range.getBegin());
+      std::pair<FileID, unsigned> End = SM.getDecomposedLoc(Range.getEnd());
+      if (Begin.first.isInvalid())
+        return;
+      Out[0] = GetFile(Begin.first);
+      Out[1] = Begin.second;
+      Out[2] = End.first == Begin.first && End.second >= Begin.second
+                   ? End.second
+                   : Begin.second;
+    };
+
+    SmallString<0> Contents;
+    llvm::raw_svector_ostream Body(Contents);
+    llvm::support::endian::Writer LE(Body, llvm::support::little);
+
+    uint32_t MainFile = NoIndex;
+    if (SM.getMainFileID().isValid())
+      MainFile = GetFile(SM.getMainFileID());
+
+    // The declarations.
+    uint32_t DeclsOffset = 0;
+    uint32_t NumDependencies = 0;
+    SmallString<128> USR;
+    std::vector<std::pair<std::string, uint32_t>> USRs;
+    for (unsigned I = 0, E = Decls.size(); I != E; ++I) {
+      const DeclEntry &Entry = Decls[I];
+      const Decl *D = Entry.D;
+      std::string Name, Type;
+      if (const auto *ND = dyn_cast<NamedDecl>(D))
+        Name = ND->getQualifiedNameAsString();
+      if (const auto *TD = dyn_cast<TypedefNameDecl>(D))
+        Type = TD->getUnderlyingType().getAsString(Ctx.getPrintingPolicy());
+      else if (const auto *VD = dyn_cast<ValueDecl>(D))
+        Type = VD->getType().getAsString(Ctx.getPrintingPolicy());
+      USR.clear();
+      if (index::generateUSRForDecl(D, USR))
+        USR.clear();
+
+      Strings.write(LE, D->getDeclKindName());
+      Strings.write(LE, Name);
+      Strings.write(LE, USR);
+      Strings.write(LE, Type);
+      uint32_t Flags = Entry.Flags;
+      if (isDefinition(D))
+        Flags |= DF_Definition;
+      LE.write<uint32_t>(Entry.Parent);
+      LE.write<uint32_t>(Flags);
+      uint32_t Range[3];
+      GetRange(CharSourceRange::getTokenRange(D->getSourceRange()), Range);
+      for (uint32_t Field : Range)
+        LE.write<uint32_t>(Field);
+      LE.write<uint32_t>(NumDependencies);
+      LE.write<uint32_t>(Entry.Dependencies.size());
+      NumDependencies += Entry.Dependencies.size();
+      if (!USR.empty())
+        USRs.emplace_back(USR.str().str(), I);
+    }
+
+    // The ranges.
+    uint32_t RangesOffset = Contents.size();
+    for (const MarkedRange &R : MarkedRanges) {
+      uint32_t Range[3];
+      GetRange(R.Range, Range);
+      for (uint32_t Field : Range)
+        LE.write<uint32_t>(Field);
+      Strings.write(LE, R.Label);
+    }
+
+    // The dependencies, and the declarations sorted by USR.
+    uint32_t DependenciesOffset = Contents.size();
+    for (const DeclEntry &Entry : Decls)
+      for (uint32_t Dependency : Entry.Dependencies)
+        LE.write<uint32_t>(Dependency);
+    uint32_t USRsOffset = Contents.size();
+    llvm::stable_sort(USRs, [](const std::pair<std::string, uint32_t> &L,
+                               const std::pair<std::string, uint32_t> &R) {
+      return L.first < R.first;
+    });
+    for (const auto &Entry : USRs)
+      LE.write<uint32_t>(Entry.second);
+
+    // The files; names were added to the string pool as they were found.
+    uint32_t FilesOffset = Contents.size();
+    for (uint32_t Name : FileNames)
+      Strings.write(LE, Name);
+    uint32_t StringsOffset = Contents.size();
+
+    // Offsets so far are relative to the end of the header.
+    const uint32_t HeaderSize = NumHeaderFields * 4;
+    llvm::support::endian::Writer Out(OS, llvm::support::little);
+    uint32_t Header[NumHeaderFields];
+    Header[HF_Magic] = llvm::support::endian::read32le(Magic.data());
+    Header[HF_Version] = Version;
+    Header[HF_MainFile] = MainFile;
+    Header[HF_NumFiles] = FileNames.size();
+    Header[HF_NumDecls] = Decls.size();
+    Header[HF_NumRanges] = MarkedRanges.size();
+    Header[HF_NumDependencies] = NumDependencies;
+    Header[HF_NumUSRs] = USRs.size();
+    Header[HF_FilesOffset] = HeaderSize + FilesOffset;
+    Header[HF_DeclsOffset] = HeaderSize + DeclsOffset;
+    Header[HF_RangesOffset] = HeaderSize + RangesOffset;
+    Header[HF_DependenciesOffset] = HeaderSize + DependenciesOffset;
+    Header[HF_USRsOffset] = HeaderSize + USRsOffset;
+    Header[HF_StringsOffset] = HeaderSize + StringsOffset;
+    Header[HF_StringsSize] = Strings.size();
+    for (uint32_t Field : Header)
+      Out.write<uint32_t>(Field);
+    OS << Contents << Strings.data();
+  }
+
+  /// Writes to the file \p Path, replacing it atomically.
+  llvm::Error writeToFile(StringRef Path) {
+    SmallString<128> TempPath;
+    int FD;
+    if (std::error_code EC =
+            llvm::sys::fs::createUniqueFile(Path + "-%%%%%%%%", FD, TempPath))
+      return llvm::errorCodeToError(EC);
+    {
+      llvm::raw_fd_ostream Out(FD, /*shouldClose=*/true);
+      write(Out);
+      Out.close();
+      if (Out.has_error()) {
+        Out.clear_error();
+        llvm::sys::fs::remove(TempPath);
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "failed writing %s",
+                                       TempPath.c_str());
+      }
+    }
+    if (std::error_code EC = llvm::sys::fs::rename(TempPath, Path)) {
+      llvm::sys::fs::remove(TempPath);
+      return llvm::errorCodeToError(EC);
+    }
+    return llvm::Error::success();
+  }
+
+private:
+  struct DeclEntry {
+    const Decl *D;
+    uint32_t Parent = selective_ast::NoIndex;
+    uint32_t Flags = 0;
+    std::vector<uint32_t> Dependencies;
+    /// Whether the parent and dependencies were computed.
+    bool Visited = false;
+  };
+
+  struct MarkedRange {
+    CharSourceRange Range;
+    std::string Label;
+  };
+
+  /// Deduplicated strings, referred to by offset and length.
+  class StringPool {
+  public:
+    uint32_t add(StringRef S) {
+      auto Inserted = Offsets.try_emplace(S, Data.size());
+      if (Inserted.second)
+        Data += S;
+      Refs.push_back({Inserted.first->second, uint32_t(S.size())});
+      return Refs.size() - 1;
+    }
+    /// Writes the offset and length of \p S, relative to the string table.
+    void write(llvm::support::endian::Writer &LE, StringRef S) {
+      write(LE, add(S));
+    }
+    void write(llvm::support::endian::Writer &LE, uint32_t Ref) {
+      LE.write<uint32_t>(Refs[Ref].first);
+      LE.write<uint32_t>(Refs[Ref].second);
+    }
+    StringRef data() const { return Data; }
+    uint32_t size() const { return Data.size(); }
+
+  private:
+    llvm::StringMap<uint32_t> Offsets;
+    std::string Data;
+    std::vector<std::pair<uint32_t, uint32_t>> Refs;
+  };
+
+  unsigned addDecl(const Decl *D) {
+    auto Inserted = Indices.try_emplace(D, Decls.size());
+    if (Inserted.second) {
+      Decls.emplace_back();
+      Decls.back().D = D;
+    }
+    return Inserted.first->second;
+  }
+
+  /// Adds the parents and dependencies of all declarations, transitively.
+  void computeClosure() {
+    SmallVector<const Decl *, 8> Dependencies;
+    for (unsigned I = 0; I != Decls.size(); ++I) {
+      if (Decls[I].Visited)
+        continue;
+      const Decl *D = Decls[I].D;
+      uint32_t Parent = selective_ast::NoIndex;
+      if (const Decl *P = getParent(D))
+        Parent = addDecl(P);
+      Dependencies.clear();
+      collectDependencies(D, Dependencies);
+      std::vector<uint32_t> DependencyIndices;
+      for (const Decl *Dependency : Dependencies) {
+        if (!Dependency || Dependency == D)
+          continue;
+        uint32_t Index = addDecl(Dependency);
+        if (!llvm::is_contained(DependencyIndices, Index))
+          DependencyIndices.push_back(Index);
+      }
+      // Decls may have grown; don't keep references across addDecl.
+      DeclEntry &Entry = Decls[I];
+      Entry.Parent = Parent;
+      Entry.Dependencies = std::move(DependencyIndices);
+      Entry.Visited = true;
+    }
+  }
+
+  /// Returns the nearest enclosing named declaration.
+  static const Decl *getParent(const Decl *D) {
+    for (const DeclContext *DC = D->getDeclContext(); DC;
+         DC = DC->getParent()) {
+      if (isa<TranslationUnitDecl>(DC))
+        return nullptr;
+      if (const auto *ND = dyn_cast<NamedDecl>(DC))
+        return ND;
+    }
+    return nullptr;
+  }
+
+  static bool isDefinition(const Decl *D) {
+    if (const auto *TD = dyn_cast<TagDecl>(D))
+      return TD->isThisDeclarationADefinition();
+    if (const auto *FD = dyn_cast<FunctionDecl>(D))
+      return FD->isThisDeclarationADefinition();
+    if (const auto *VD = dyn_cast<VarDecl>(D))
+      return VD->isThisDeclarationADefinition() != VarDecl::DeclarationOnly;
+    return false;
+  }
+
+  void collectDependencies(const Decl *D,
+                           SmallVectorImpl<const Decl *> &Dependencies) {
+    if (const auto *TD = dyn_cast<TypedefNameDecl>(D))
+      addTypeDependencies(TD->getUnderlyingType(), Dependencies);
+    else if (const auto *VD = dyn_cast<ValueDecl>(D))
+      addTypeDependencies(VD->getType(), Dependencies);
+    if (const auto *RD = dyn_cast<CXXRecordDecl>(D))
+      if (const CXXRecordDecl *Def = RD->getDefinition())
+        for (const CXXBaseSpecifier &Base : Def->bases())
+          addTypeDependencies(Base.getType(), Dependencies);
+    if (const auto *Spec = dyn_cast<ClassTemplateSpecializationDecl>(D))
+      Dependencies.push_back(Spec->getSpecializedTemplate());
+    if (const auto *FD = dyn_cast<FunctionDecl>(D))
+      Dependencies.push_back(FD->getPrimaryTemplate());
+    if (const auto *TD = dyn_cast<TemplateDecl>(D))
+      Dependencies.push_back(TD->getTemplatedDecl());
+    if (const auto *Shadow = dyn_cast<UsingShadowDecl>(D))
+      Dependencies.push_back(Shadow->getTargetDecl());
+  }
+
+  /// Adds the declarations that \p Root names, looking through pointers,
+  /// arrays, function types and sugar other than typedefs.
+  void addTypeDependencies(QualType Root,
+                           SmallVectorImpl<const Decl *> &Dependencies) {
+    SmallVector<QualType, 8> Worklist = {Root};
+    llvm::SmallPtrSet<const Type *, 8> Seen;
+    while (!Worklist.empty()) {
+      QualType T = Worklist.pop_back_val();
+      if (T.isNull() || !Seen.insert(T.getTypePtr()).second)
+        continue;
+      const Type *Ty = T.getTypePtr();
+      if (const auto *TT = dyn_cast<TypedefType>(Ty)) {
+        Dependencies.push_back(TT->getDecl());
+        continue;
+      }
+      if (const auto *TT = dyn_cast<TagType>(Ty)) {
+        Dependencies.push_back(TT->getDecl());
+        continue;
+      }
+      if (const auto *TST = dyn_cast<TemplateSpecializationType>(Ty)) {
+        Dependencies.push_back(TST->getTemplateName().getAsTemplateDecl());
+        for (const TemplateArgument &Arg : TST->template_arguments())
+          if (Arg.getKind() == TemplateArgument::Type)
+            Worklist.push_back(Arg.getAsType());
+        if (TST->isSugared())
+          Worklist.push_back(TST->desugar());
+        continue;
+      }
+      if (const auto *FT = dyn_cast<FunctionType>(Ty)) {
+        Worklist.push_back(FT->getReturnType());
+        if (const auto *FPT = dyn_cast<FunctionProtoType>(FT))
+          Worklist.append(FPT->param_type_begin(), FPT->param_type_end());
+        continue;
+      }
+      if (const auto *AT = dyn_cast<ArrayType>(Ty)) {
+        Worklist.push_back(AT->getElementType());
+        continue;
+      }
+      QualType Pointee = Ty->getPointeeType();
+      if (!Pointee.isNull()) {
+        Worklist.push_back(Pointee);
+        continue;
+      }
+      Worklist.push_back(T.getSingleStepDesugaredType(Ctx));
+    }
+  }
+
+  ASTContext &Ctx;
+  std::vector<DeclEntry> Decls;
+  llvm::DenseMap<const Decl *, unsigned> Indices;
+  std::vector<MarkedRange> MarkedRanges;
+};
+
+/// Reads a file written by \c SelectiveASTWriter in place, usually from a
+/// memory-mapped buffer.
+class SelectiveASTReader {
+public:
+  /// A range of a file, as offsets in bytes.
+  struct FileRange {
+    /// The name of the file, or empty if the range is invalid.
+    StringRef File;
+    unsigned Begin;
+    unsigned End;
+  };
+
+  /// The summary of a declaration.
+  struct DeclSummary {
+    /// The name of the declaration kind, as in \c Decl::getDeclKindName.
+    StringRef Kind;
+    /// The fully qualified name, or empty if the declaration is unnamed.
+    StringRef QualifiedName;
+    /// The USR, or empty if the declaration has none.
+    StringRef USR;
+    /// The type of values, or the underlying type of typedefs.
+    StringRef Type;
+    /// The index of the enclosing named declaration, or \c NoDecl.
+    unsigned Parent;
+    /// Whether the declaration was marked, rather than included as a
+    /// dependency of a marked one.
+    bool IsMarked;
+    bool IsDefinition;
+    FileRange Range;
+    /// The indices of the declarations that this one depends on.
+    ArrayRef<llvm::support::ulittle32_t> Dependencies;
+  };
+
+  /// A range that was marked.
+  struct MarkedRange {
+    FileRange Range;
+    StringRef Label;
+  };
+
+  static constexpr unsigned NoDecl = selective_ast::NoIndex;
+
+  /// Reads the file at \p Path.
+  static llvm::Expected<std::unique_ptr<SelectiveASTReader>>
+  open(StringRef Path) {
+    auto Buffer = llvm::MemoryBuffer::getFile(
+        Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!Buffer)
+      return llvm::errorCodeToError(Buffer.getError());
+    return create(std::move(*Buffer));
+  }
+
+  /// Reads the contents of \p Buffer.
+  static llvm::Expected<std::unique_ptr<SelectiveASTReader>>
+  create(std::unique_ptr<llvm::MemoryBuffer> Buffer) {
+    std::unique_ptr<SelectiveASTReader> Reader(
+        new SelectiveASTReader(std::move(Buffer)));
+    if (llvm::Error Err = Reader->validate())
+      return Err;
+    return Reader;
+  }
+
+  /// Returns the name of the main file of the translation unit.
+  StringRef getMainFile() const {
+    uint32_t MainFile = header(selective_ast::HF_MainFile);
+    return MainFile == selective_ast::NoIndex ? StringRef() : getFile(MainFile);
+  }
+
+  unsigned getNumDecls() const { return header(selective_ast::HF_NumDecls); }
+
+  DeclSummary getDecl(unsigned Index) const {
+    assert(Index < getNumDecls() && "decl index out of range");
+    const char *Record = data() + header(selective_ast::HF_DeclsOffset) +
+                         Index * selective_ast::DeclRecordSize;
+    DeclSummary Summary;
+    Summary.Kind = getString(Record);
+    Summary.QualifiedName = getString(Record + 8);
+    Summary.USR = getString(Record + 16);
+    Summary.Type = getString(Record + 24);
+    Summary.Parent = read(Record + 32);
+    uint32_t Flags = read(Record + 36);
+    Summary.IsMarked = Flags & selective_ast::DF_Marked;
+    Summary.IsDefinition = Flags & selective_ast::DF_Definition;
+    Summary.Range = getRange(Record + 40);
+    const auto *Dependencies =
+        reinterpret_cast<const llvm::support::ulittle32_t *>(
+            data() + header(selective_ast::HF_DependenciesOffset));
+    Summary.Dependencies =
+        llvm::makeArrayRef(Dependencies + read(Record + 52), read(Record + 56));
+    return Summary;
+  }
+
+  /// Returns the index of the declaration with the given USR, if any.
+  Optional<unsigned> lookupUSR(StringRef USR) const {
+    const auto *Begin = reinterpret_cast<const llvm::support::ulittle32_t *>(
+        data() + header(selective_ast::HF_USRsOffset));
+    const auto *End = Begin + header(selective_ast::HF_NumUSRs);
+    const auto *It =
+        std::partition_point(Begin, End, [&](llvm::support::ulittle32_t I) {
+          return getDecl(I).USR < USR;
+        });
+    if (It == End || getDecl(*It).USR != USR)
+      return None;
+    return unsigned(*It);
+  }
+
+  unsigned getNumRanges() const { return header(selective_ast::HF_NumRanges); }
+
+  MarkedRange getMarkedRange(unsigned Index) const {
+    assert(Index < getNumRanges() && "range index out of range");
+    const char *Record = data() + header(selective_ast::HF_RangesOffset) +
+                         Index * selective_ast::RangeRecordSize;
+    return {getRange(Record), getString(Record + 12)};
+  }
+
+private:
+  explicit SelectiveASTReader(std::unique_ptr<llvm::MemoryBuffer> Buffer)
+      : Buffer(std::move(Buffer)) {}
+
+  const char *data() const { return Buffer->getBufferStart(); }
+  static uint32_t read(const char *P) {
+    return llvm::support::endian::read32le(P);
+  }
+  uint32_t header(selective_ast::HeaderField Field) const {
+    return read(data() + Field * 4);
+  }
+
+  StringRef getString(const char *Ref) const {
+    return StringRef(data() + header(selective_ast::HF_StringsOffset) +
+                         read(Ref),
+                     read(Ref + 4));
+  }
+  StringRef getFile(uint32_t Index) const {
+    return getString(data() + header(selective_ast::HF_FilesOffset) +
+                     Index * selective_ast::FileRecordSize);
+  }
+  FileRange getRange(const char *Record) const {
+    uint32_t File = read(Record);
+    if (File == selective_ast::NoIndex)
+      return {StringRef(), 0, 0};
+    return {getFile(File), read(Record + 4), read(Record + 8)};
+  }
+
+  /// Checks that all tables, and all references between them, are within
+  /// bounds, so that accessors do not need to.
+  llvm::Error validate() const {
+    using namespace selective_ast;
+    auto Malformed = [&] {
+      return llvm::createStringError(
+          llvm::inconvertibleErrorCode(), "malformed AST summary %s",
+          Buffer->getBufferIdentifier().str().c_str());
+    };
+    uint64_t Size = Buffer->getBufferSize();
+    if (Size < NumHeaderFields * 4 ||
+        !Buffer->getBuffer().startswith(Magic) ||
+        header(HF_Version) != Version)
+      return Malformed();
+    auto InBounds = [&](HeaderField Offset, uint64_t TableSize) {
+      return header(Offset) % 4 == 0 &&
+             uint64_t(header(Offset)) + TableSize <= Size;
+    };
+    uint32_t NumFiles = header(HF_NumFiles);
+    uint32_t NumDecls = header(HF_NumDecls);
+    uint32_t NumDependencies = header(HF_NumDependencies);
+    if (!InBounds(HF_FilesOffset, uint64_t(NumFiles) * FileRecordSize) ||
+        !InBounds(HF_DeclsOffset, uint64_t(NumDecls) * DeclRecordSize) ||
+        !InBounds(HF_RangesOffset,
+                  uint64_t(header(HF_NumRanges)) * RangeRecordSize) ||
+        !InBounds(HF_DependenciesOffset, uint64_t(NumDependencies) * 4) ||
+        !InBounds(HF_USRsOffset, uint64_t(header(HF_NumUSRs)) * 4) ||
+        uint64_t(header(HF_StringsOffset)) + header(HF_StringsSize) > Size)
+      return Malformed();
+
+    uint32_t StringsSize = header(HF_StringsSize);
+    auto ValidString = [&](const char *Ref) {
+      return uint64_t(read(Ref)) + read(Ref + 4) <= StringsSize;
+    };
+    auto ValidRange = [&](const char *Record) {
+      uint32_t File = read(Record);
+      return File == NoIndex || File < NumFiles;
+    };
+    uint32_t MainFile = header(HF_MainFile);
+    if (MainFile != NoIndex && MainFile >= NumFiles)
+      return Malformed();
+    for (uint32_t I = 0; I != NumFiles; ++I)
+      if (!ValidString(data() + header(HF_FilesOffset) + I * FileRecordSize))
+        return Malformed();
+    for (uint32_t I = 0; I != NumDecls; ++I) {
+      const char *Record = data() + header(HF_DeclsOffset) + I * DeclRecordSize;
+      uint32_t Parent = read(Record + 32);
+      if (!ValidString(Record) || !ValidString(Record + 8) ||
+          !ValidString(Record + 16) || !ValidString(Record + 24) ||
+          (Parent != NoIndex && Parent >= NumDecls) ||
+          !ValidRange(Record + 40) ||
+          uint64_t(read(Record + 52)) + read(Record + 56) > NumDependencies)
+        return Malformed();
+    }
+    for (uint32_t I = 0, E = header(HF_NumRanges); I != E; ++I) {
+      const char *Record =
+          data() + header(HF_RangesOffset) + I * RangeRecordSize;
+      if (!ValidRange(Record) || !ValidString(Record + 12))
+        return Malformed();
+    }
+    for (uint32_t I = 0; I != NumDependencies; ++I)
+      if (read(data() + header(HF_DependenciesOffset) + I * 4) >= NumDecls)
+        return Malformed();
+    for (uint32_t I = 0, E = header(HF_NumUSRs); I != E; ++I)
+      if (read(data() + header(HF_USRsOffset) + I * 4) >= NumDecls)
+        return Malformed();
+    return llvm::Error::success();
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+};
+
+} // namespace tooling
+} // namespace clang
+
+#endif // LLVM_CLANG_TOOLING_SELECTIVEASTSERIALIZATION_H
@@ -0,0 +1,124 @@
+//===- SharedModuleCacheFactory.h - Share PCMs across tool runs -*- C++ -*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+//
+//  This file defines a FrontendActionFactory whose compiler instances exchange
+//  the PCMs they load and build through a SharedModuleCache.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_SHAREDMODULECACHEFACTORY_H
+#define LLVM_CLANG_TOOLING_SHAREDMODULECACHEFACTORY_H
+
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Basic/LLVM.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Serialization/ASTReader.h"
+#include "clang/Serialization/InMemoryModuleCache.h"
+#include "clang/Serialization/SharedModuleCache.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include <memory>
+
+namespace clang {
+namespace tooling {
+
+/// A \c FrontendActionFactory that runs the actions of another factory with
+/// module caches seeded from a \c SharedModuleCache, and publishes the PCMs
+/// that each action loaded or built back to it.
+///
+/// This factory is thread-safe and meant to be used from
+/// \c AllTUsToolExecutor: with implicit modules, each PCM is then held once
+/// for the whole run instead of once per thread.
+class SharedModuleCacheActionFactory : public FrontendActionFactory {
+public:
+  SharedModuleCacheActionFactory(std::unique_ptr<FrontendActionFactory> Inner,
+                                 SharedModuleCache &Cache)
+      : Inner(std::move(Inner)), Cache(Cache) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<PublishingAction>(Inner->create(), Cache);
+  }
+
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    IntrusiveRefCntPtr<InMemoryModuleCache> ModuleCache(
+        new InMemoryModuleCache);
+    Cache.seed(*ModuleCache);
+
+    // Create a compiler instance to handle the actual work.
+    CompilerInstance Compiler(std::move(PCHContainerOps), ModuleCache.get());
+    Compiler.setInvocation(std::move(Invocation));
+    Compiler.setFileManager(Files);
+    // The FrontendAction can have lifetime requirements for Compiler or its
+    // members, and we need to ensure it's deleted earlier than Compiler. So we
+    // pass it to an std::unique_ptr declared after the Compiler variable.
+    std::unique_ptr<FrontendAction> ScopedToolAction(create());
+
+    // Create the compiler's actual diagnostics engine.
+    Compiler.createDiagnostics(DiagConsumer, /*ShouldOwnClient=*/false);
+    if (!Compiler.hasDiagnostics())
+      return false;
+
+    Compiler.createSourceManager(*Files);
+
+    const bool Success = Compiler.ExecuteAction(*ScopedToolAction);
+
+    Files->clearStatCache();
+    return Success;
+  }
+
+private:
+  /// Publishes the PCMs of the modules that were loaded while the AST reader
+  /// is still around.
+  class PublishingAction : public WrapperFrontendAction {
+  public:
+    PublishingAction(std::unique_ptr<FrontendAction> WrappedAction,
+                     SharedModuleCache &Cache)
+        : WrapperFrontendAction(std::move(WrappedAction)), Cache(Cache) {}
+
+  protected:
+    // WrapperFrontendAction::EndSourceFile forwards to the wrapped action
+    // only, so EndSourceFileAction of this class is never called.
+    void EndSourceFile() override {
+      CompilerInstance &CI = getCompilerInstance();
+      if (IntrusiveRefCntPtr<ASTReader> Reader = CI.getASTReader())
+        Cache.publish(CI.getModuleCache(), Reader->getModuleManager());
+      WrapperFrontendAction::EndSourceFile();
+    }
+
+  private:
+    SharedModuleCache &Cache;
+  };
+
+  std::unique_ptr<FrontendActionFactory> Inner;
+  SharedModuleCache &Cache;
+};
+
+/// Returns a new \c SharedModuleCacheActionFactory for the action \c T.
+///
+/// \code
+///   SharedModuleCache Cache;
+///   Executor.execute(
+///       newSharedModuleCacheActionFactory<SyntaxOnlyAction>(Cache));
+/// \endcode
+template <typename T>
+std::unique_ptr<FrontendActionFactory>
+newSharedModuleCacheActionFactory(SharedModuleCache &Cache) {
+  return std::make_unique<SharedModuleCacheActionFactory>(
+      newFrontendActionFactory<T>(), Cache);
+}
+
+} // end namespace tooling
+} // end namespace clang
+
+#endif // LLVM_CLANG_TOOLING_SHAREDMODULECACHEFACTORY_H
@@ -0,0 +1,349 @@
+//===- CompactTokens.h - Compact, lazily lexed token storage -----*- C++-*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+// A memory-efficient alternative to TokenBuffer for tools that need the
+// expanded tokens of a translation unit and the spelled tokens of only a few
+// files.
+//
+// Tokens are stored in 4 bytes for the kind and length plus a variable-length
+// delta of the location from the previous token, which is usually one or two
+// bytes. Spelled tokens are lexed on demand, the first time the tokens of a
+// file are requested.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_SYNTAX_COMPACTTOKENS_H
+#define LLVM_CLANG_TOOLING_SYNTAX_COMPACTTOKENS_H
+
+#include "clang/Basic/IdentifierTable.h"
+#include "clang/Basic/LangOptions.h"
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Basic/TokenKinds.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Lex/RawTokenizer.h"
+#include "clang/Lex/Token.h"
+#include "clang/Tooling/Syntax/Tokens.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace clang {
+namespace syntax {
+
+/// A sequence of tokens stored compactly.
+///
+/// Random access decodes up to \c CheckpointInterval location deltas;
+/// iteration decodes one per token.
+class CompactTokenSequence {
+public:
+  /// Iterates over the tokens of the sequence, decoding them on the fly.
+  class const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = syntax::Token;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = syntax::Token;
+
+    syntax::Token operator*() const { return Seq->makeToken(Index, Raw); }
+
+    const_iterator &operator++() {
+      if (++Index < Seq->size()) {
+        if (Index % CheckpointInterval == 0) {
+          const Checkpoint &C = Seq->Checkpoints[Index / CheckpointInterval];
+          Raw = C.Location;
+          Pos = C.DeltaOffset;
+        } else {
+          Raw += Seq->readDelta(Pos);
+        }
+      }
+      return *this;
+    }
+
+    bool operator==(const const_iterator &RHS) const {
+      return Index == RHS.Index;
+    }
+    bool operator!=(const const_iterator &RHS) const { return !(*this == RHS); }
+
+    size_t index() const { return Index; }
+
+  private:
+    friend class CompactTokenSequence;
+    const_iterator(const CompactTokenSequence *Seq, size_t Index)
+        : Seq(Seq), Index(Index) {
+      if (Index < Seq->size()) {
+        const Checkpoint &C = Seq->Checkpoints[Index / CheckpointInterval];
+        Raw = C.Location;
+        Pos = C.DeltaOffset;
+        for (size_t I = Index - Index % CheckpointInterval; I != Index; ++I)
+          Raw += Seq->readDelta(Pos);
+      }
+    }
+
+    const CompactTokenSequence *Seq;
+    size_t Index;
+    SourceLocation::UIntTy Raw = 0;
+    size_t Pos = 0;
+  };
+
+  void push_back(const syntax::Token &T) {
+    SourceLocation::UIntTy Raw = T.location().getRawEncoding();
+    size_t Index = Packed.size();
+    if (Index % CheckpointInterval == 0)
+      Checkpoints.push_back({Raw, unsigned(Deltas.size())});
+    else
+      writeDelta(int64_t(Raw) - int64_t(LastRaw));
+    LastRaw = Raw;
+
+    unsigned Length = T.length();
+    if (Length >= MaxInlineLength) {
+      LongLengths[Index] = Length;
+      Length = MaxInlineLength;
+    }
+    Packed.push_back(unsigned(T.kind()) | Length << KindBits);
+  }
+
+  size_t size() const { return Packed.size(); }
+  bool empty() const { return Packed.empty(); }
+
+  syntax::Token operator[](size_t I) const {
+    assert(I < size() && "index out of range");
+    return *const_iterator(this, I);
+  }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+
+  /// Returns the tokens in [\p Begin, \p End) as \c syntax::Tokens.
+  std::vector<syntax::Token> materialize(size_t Begin, size_t End) const {
+    assert(Begin <= End && End <= size() && "invalid range");
+    std::vector<syntax::Token> Result;
+    Result.reserve(End - Begin);
+    for (const_iterator It(this, Begin), E(this, End); It != E; ++It)
+      Result.push_back(*It);
+    return Result;
+  }
+
+  void shrink_to_fit() {
+    Packed.shrink_to_fit();
+    Deltas.shrink_to_fit();
+    Checkpoints.shrink_to_fit();
+  }
+
+  /// \returns The number of bytes used by the sequence.
+  size_t getMemorySize() const {
+    return Packed.capacity() * sizeof(uint32_t) + Deltas.capacity() +
+           Checkpoints.capacity() * sizeof(Checkpoint) +
+           LongLengths.getMemorySize();
+  }
+
+private:
+  static constexpr unsigned CheckpointInterval = 32;
+  static constexpr unsigned KindBits = 12;
+  static constexpr unsigned MaxInlineLength = (1u << (32 - KindBits)) - 1;
+  static_assert(tok::NUM_TOKENS <= (1u << KindBits),
+                "token kinds do not fit in the packed representation");
+
+  struct Checkpoint {
+    /// The raw location of the token at the checkpoint.
+    SourceLocation::UIntTy Location;
+    /// The position of the delta of the next token in \c Deltas.
+    unsigned DeltaOffset;
+  };
+
+  syntax::Token makeToken(size_t Index, SourceLocation::UIntTy Raw) const {
+    uint32_t Word = Packed[Index];
+    unsigned Length = Word >> KindBits;
+    if (Length == MaxInlineLength)
+      Length = LongLengths.lookup(Index);
+    return syntax::Token(SourceLocation::getFromRawEncoding(Raw), Length,
+                         static_cast<tok::TokenKind>(Word & ((1u << KindBits) -
+                                                             1)));
+  }
+
+  /// Appends \p Delta as a zigzag-encoded LEB128 number.
+  void writeDelta(int64_t Delta) {
+    uint64_t Value = (uint64_t(Delta) << 1) ^ uint64_t(Delta >> 63);
+    do {
+      uint8_t Byte = Value & 0x7f;
+      Value >>= 7;
+      Deltas.push_back(Byte | (Value ? 0x80 : 0));
+    } while (Value);
+  }
+
+  int64_t readDelta(size_t &Pos) const {
+    uint64_t Value = 0;
+    for (unsigned Shift = 0;; Shift += 7) {
+      uint8_t Byte = Deltas[Pos++];
+      Value |= uint64_t(Byte & 0x7f) << Shift;
+      if (!(Byte & 0x80))
+        break;
+    }
+    return int64_t(Value >> 1) ^ -int64_t(Value & 1);
+  }
+
+  /// The kind of each token in the low bits, and its length in the high bits.
+  std::vector<uint32_t> Packed;
+  /// The location of each token relative to the previous one, except at
+  /// checkpoints.
+  std::vector<uint8_t> Deltas;
+  std::vector<Checkpoint> Checkpoints;
+  /// Lengths of the tokens that do not fit in \c Packed.
+  llvm::DenseMap<size_t, unsigned> LongLengths;
+  SourceLocation::UIntTy LastRaw = 0;
+};
+
+/// The expanded tokens of a translation unit and the spelled tokens of its
+/// files, stored as \c CompactTokenSequences.
+///
+/// Unlike \c TokenBuffer, spelled tokens are only lexed when
+/// \c spelledTokens is first called for a file, and there are no mappings
+/// between expanded and spelled tokens; use \c TokenBuffer for tools that
+/// need them. Not thread-safe.
+class CompactTokenBuffer {
+public:
+  CompactTokenBuffer(const SourceManager &SM, const LangOptions &LangOpts)
+      : SM(&SM), LangOpts(LangOpts) {}
+
+  /// All tokens produced by the preprocessor, ending with an eof token.
+  const CompactTokenSequence &expandedTokens() const { return Expanded; }
+
+  /// Returns the expanded tokens whose locations are in \p R, like
+  /// \c TokenBuffer::expandedTokens(SourceRange).
+  std::vector<syntax::Token> expandedTokens(SourceRange R) const {
+    if (R.isInvalid())
+      return {};
+    size_t Begin = partitionPoint([&](const syntax::Token &T) {
+      return SM->isBeforeInTranslationUnit(T.location(), R.getBegin());
+    });
+    size_t End = partitionPoint([&](const syntax::Token &T) {
+      return !SM->isBeforeInTranslationUnit(R.getEnd(), T.location());
+    });
+    if (Begin > End)
+      return {};
+    return Expanded.materialize(Begin, End);
+  }
+
+  /// Returns the spelled tokens of \p FID, lexing the file in raw mode on the
+  /// first call. The result matches \c syntax::tokenize.
+  const CompactTokenSequence &spelledTokens(FileID FID) const {
+    std::unique_ptr<CompactTokenSequence> &Tokens = Spelled[FID];
+    if (!Tokens) {
+      Tokens = std::make_unique<CompactTokenSequence>();
+      lexSpelledTokens(FID, *Tokens);
+    }
+    return *Tokens;
+  }
+
+  /// \returns Whether the spelled tokens of \p FID have been lexed.
+  bool hasSpelledTokens(FileID FID) const { return Spelled.count(FID); }
+
+  const SourceManager &sourceManager() const { return *SM; }
+
+  /// \returns The number of bytes used by the stored tokens.
+  size_t getMemorySize() const {
+    size_t Size = Expanded.getMemorySize();
+    for (const auto &Entry : Spelled)
+      Size += Entry.second->getMemorySize();
+    return Size;
+  }
+
+private:
+  friend class CompactTokenCollector;
+
+  /// Returns the index of the first expanded token not satisfying \p Pred,
+  /// which must partition the expanded tokens.
+  template <typename PredT> size_t partitionPoint(PredT Pred) const {
+    size_t Low = 0;
+    size_t High = Expanded.size();
+    while (Low < High) {
+      size_t Mid = Low + (High - Low) / 2;
+      if (Pred(Expanded[Mid]))
+        Low = Mid + 1;
+      else
+        High = Mid;
+    }
+    return Low;
+  }
+
+  void lexSpelledTokens(FileID FID, CompactTokenSequence &Tokens) const {
+    bool Invalid = false;
+    StringRef Buffer = SM->getBufferData(FID, &Invalid);
+    if (Invalid)
+      return;
+    if (!Identifiers)
+      Identifiers = std::make_unique<IdentifierTable>(LangOpts);
+    SourceLocation Start = SM->getLocForStartOfFile(FID);
+    RawTokenizer Tokenizer(LangOpts);
+    for (const RawToken &T : Tokenizer.tokenize(Buffer)) {
+      tok::TokenKind Kind = T.Kind;
+      // Fill the proper token kind for keywords, as syntax::tokenize does.
+      if (Kind == tok::raw_identifier && !T.needsCleaning() &&
+          !(T.Flags & clang::Token::HasUCN))
+        Kind = Identifiers->get(T.getRawText(Buffer)).getTokenID();
+      Tokens.push_back(
+          syntax::Token(Start.getLocWithOffset(T.Offset), T.Length, Kind));
+    }
+    Tokens.shrink_to_fit();
+  }
+
+  const SourceManager *SM;
+  LangOptions LangOpts;
+  CompactTokenSequence Expanded;
+  mutable llvm::DenseMap<FileID, std::unique_ptr<CompactTokenSequence>>
+      Spelled;
+  mutable std::unique_ptr<IdentifierTable> Identifiers;
+};
+
+/// Collects the expanded tokens of a translation unit into a
+/// \c CompactTokenBuffer. Like \c TokenCollector, an instance should be
+/// created before preprocessing starts and consumed after it finishes; the
+/// two cannot be used on the same \c Preprocessor at the same time.
+class CompactTokenCollector {
+public:
+  explicit CompactTokenCollector(Preprocessor &PP)
+      : PP(PP), Result(PP.getSourceManager(), PP.getLangOpts()) {
+    PP.setTokenWatcher([this](const clang::Token &T) {
+      if (T.isAnnotation())
+        return;
+      Result.Expanded.push_back(syntax::Token(T));
+    });
+  }
+
+  /// Finalizes token collection.
+  ///
+  /// \param LexAllFiles If true, the spelled tokens of every file entered by
+  /// the preprocessor are lexed now rather than on first use.
+  [[nodiscard]] CompactTokenBuffer consume(bool LexAllFiles = false) && {
+    PP.setTokenWatcher(nullptr);
+    Result.Expanded.shrink_to_fit();
+    if (LexAllFiles) {
+      const SourceManager &SM = PP.getSourceManager();
+      for (unsigned I = 1, E = SM.local_sloc_entry_size(); I != E; ++I) {
+        const SrcMgr::SLocEntry &Entry = SM.getLocalSLocEntry(I);
+        if (Entry.isFile())
+          Result.spelledTokens(SM.getFileID(
+              SourceLocation::getFromRawEncoding(Entry.getOffset())));
+      }
+    }
+    return std::move(Result);
+  }
+
+private:
+  Preprocessor &PP;
+  CompactTokenBuffer Result;
+};
+
+} // namespace syntax
+} // namespace clang
+
+#endif // LLVM_CLANG_TOOLING_SYNTAX_COMPACTTOKENS_H
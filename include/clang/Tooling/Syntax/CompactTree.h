@@ -0,0 +1,272 @@
+//===- CompactTree.h - compact encoding of syntax trees -------*- C++ -*-=====//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+// A read-only encoding of syntax trees that takes less than half the memory of
+// the Node objects, for clients that keep the trees of many files.
+//===----------------------------------------------------------------------===//
+#ifndef LLVM_CLANG_TOOLING_SYNTAX_COMPACTTREE_H
+#define LLVM_CLANG_TOOLING_SYNTAX_COMPACTTREE_H
+
+#include "clang/Tooling/Syntax/Nodes.h"
+#include "clang/Tooling/Syntax/TokenManager.h"
+#include "clang/Tooling/Syntax/Tokens.h"
+#include "clang/Tooling/Syntax/Tree.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/iterator.h"
+#include "llvm/ADT/iterator_range.h"
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace clang {
+namespace syntax {
+
+/// An immutable copy of a syntax tree.
+///
+/// Nodes are stored in preorder in a single array, and refer to each other by
+/// 32-bit indices instead of pointers: the first child of a tree is the node
+/// right after it and its next sibling is the node right after its subtree.
+/// Kind, role and flags are packed into 32 bits, and leaves refer to their
+/// tokens by their index in the array that the token keys point into, usually
+/// \c TokenBuffer::expandedTokens(). A node takes 20 bytes, compared to 40 for
+/// a \c Leaf and 48 for a \c Tree.
+///
+/// Nodes are accessed through \c CompactTree::NodeRef, which has the same
+/// navigation methods as \c Node and \c Tree.
+class CompactTree {
+  struct Record;
+
+public:
+  class ChildIterator;
+
+  /// A reference to a node of a \c CompactTree, or a null reference.
+  class NodeRef {
+  public:
+    NodeRef() = default;
+
+    explicit operator bool() const { return Owner != nullptr; }
+    friend bool operator==(NodeRef L, NodeRef R) {
+      return L.Owner == R.Owner && L.Index == R.Index;
+    }
+    friend bool operator!=(NodeRef L, NodeRef R) { return !(L == R); }
+
+    NodeKind getKind() const { return static_cast<NodeKind>(get().Kind); }
+    NodeRole getRole() const { return static_cast<NodeRole>(get().Role); }
+    bool isOriginal() const { return get().Flags & OriginalFlag; }
+    bool canModify() const { return get().Flags & CanModifyFlag; }
+    bool isLeaf() const { return get().Flags & LeafFlag; }
+    /// Returns the position of the node in preorder.
+    uint32_t getIndex() const { return Index; }
+
+    NodeRef getParent() const { return ref(get().Parent); }
+    NodeRef getNextSibling() const {
+      const Record &R = get();
+      if (R.Parent == Null || R.End == Owner->Records[R.Parent].End)
+        return NodeRef();
+      return ref(R.End);
+    }
+    NodeRef getPreviousSibling() const { return ref(get().PreviousSibling); }
+
+    /// Only valid for trees.
+    NodeRef getFirstChild() const {
+      assert(!isLeaf());
+      return get().End == Index + 1 ? NodeRef() : ref(Index + 1);
+    }
+    NodeRef getLastChild() const {
+      assert(!isLeaf());
+      return ref(get().Data);
+    }
+    /// Like \c Tree::findFirstLeaf, skips child trees without leaves.
+    NodeRef findFirstLeaf() const {
+      if (isLeaf())
+        return *this;
+      for (NodeRef C = getFirstChild(); C; C = C.getNextSibling())
+        if (NodeRef L = C.findFirstLeaf())
+          return L;
+      return NodeRef();
+    }
+    /// Like \c Tree::findLastLeaf, skips child trees without leaves.
+    NodeRef findLastLeaf() const {
+      if (isLeaf())
+        return *this;
+      for (NodeRef C = getLastChild(); C; C = C.getPreviousSibling())
+        if (NodeRef L = C.findLastLeaf())
+          return L;
+      return NodeRef();
+    }
+    /// Find the first child with a corresponding role.
+    NodeRef findChild(NodeRole R) const {
+      for (NodeRef C = getFirstChild(); C; C = C.getNextSibling())
+        if (C.getRole() == R)
+          return C;
+      return NodeRef();
+    }
+
+    /// Only valid for trees.
+    inline llvm::iterator_range<ChildIterator> getChildren() const;
+
+    /// Only valid for leaves. Returns the key of the token, as in
+    /// \c Leaf::getTokenKey.
+    TokenManager::Key getTokenKey() const {
+      assert(isLeaf());
+      uint32_t Data = get().Data;
+      if (Data & ExtraKeyBit)
+        return Owner->ExtraKeys[Data & ~ExtraKeyBit];
+      return reinterpret_cast<TokenManager::Key>(&Owner->Tokens[Data]);
+    }
+
+  private:
+    friend class CompactTree;
+    NodeRef(const CompactTree *Owner, uint32_t Index)
+        : Owner(Owner), Index(Index) {}
+
+    const Record &get() const {
+      assert(Owner && "null node");
+      return Owner->Records[Index];
+    }
+    NodeRef ref(uint32_t I) const {
+      return I == Null ? NodeRef() : NodeRef(Owner, I);
+    }
+
+    const CompactTree *Owner = nullptr;
+    uint32_t Index = 0;
+  };
+
+  /// Iterates over the children of a tree.
+  class ChildIterator
+      : public llvm::iterator_facade_base<ChildIterator,
+                                          std::forward_iterator_tag, NodeRef,
+                                          std::ptrdiff_t, NodeRef *, NodeRef> {
+  public:
+    ChildIterator() = default;
+    explicit ChildIterator(NodeRef N) : N(N) {}
+
+    bool operator==(const ChildIterator &RHS) const { return N == RHS.N; }
+    NodeRef operator*() const { return N; }
+    ChildIterator &operator++() {
+      N = N.getNextSibling();
+      return *this;
+    }
+
+  private:
+    NodeRef N;
+  };
+
+  /// Encodes the subtree rooted at \p Root.
+  ///
+  /// \param Tokens The array that the token keys of most leaves point into,
+  /// e.g. \c TokenBuffer::expandedTokens() for trees backed by a
+  /// \c TokenBufferTokenManager. Other keys are stored separately; they take
+  /// more memory but are preserved.
+  static CompactTree build(const Node &Root,
+                           ArrayRef<syntax::Token> Tokens = llvm::None) {
+    CompactTree T;
+    T.Tokens = Tokens;
+    T.append(Root, Null, Null);
+    T.Records.shrink_to_fit();
+    T.ExtraKeys.shrink_to_fit();
+    return T;
+  }
+
+  NodeRef getRoot() const {
+    return Records.empty() ? NodeRef() : NodeRef(this, 0);
+  }
+  /// Returns the node at position \p Index in preorder.
+  NodeRef getNode(uint32_t Index) const {
+    assert(Index < Records.size());
+    return NodeRef(this, Index);
+  }
+  /// Returns the number of nodes.
+  size_t size() const { return Records.size(); }
+
+  /// Returns the number of bytes used by the encoding.
+  size_t getMemorySize() const {
+    return Records.capacity() * sizeof(Record) +
+           ExtraKeys.capacity() * sizeof(TokenManager::Key);
+  }
+
+private:
+  enum : uint8_t {
+    LeafFlag = 1 << 0,
+    OriginalFlag = 1 << 1,
+    CanModifyFlag = 1 << 2,
+  };
+  /// The index that represents a null node.
+  static constexpr uint32_t Null = ~0u;
+  /// Set in the data of leaves whose key is in ExtraKeys.
+  static constexpr uint32_t ExtraKeyBit = 1u << 31;
+
+  struct Record {
+    uint32_t Parent;
+    /// The index after the last node of the subtree.
+    uint32_t End;
+    uint32_t PreviousSibling;
+    /// The last child of a tree, or the token of a leaf.
+    uint32_t Data;
+    uint16_t Kind;
+    uint8_t Role;
+    uint8_t Flags;
+  };
+  static_assert(sizeof(Record) == 20, "Record should stay small");
+
+  CompactTree() = default;
+
+  /// Appends \p N and its subtree, and returns its index.
+  uint32_t append(const Node &N, uint32_t Parent, uint32_t PreviousSibling) {
+    assert(Records.size() < ExtraKeyBit && "too many nodes");
+    uint32_t Index = Records.size();
+    Record R;
+    R.Parent = Parent;
+    R.End = Null;
+    R.PreviousSibling = PreviousSibling;
+    R.Data = Null;
+    R.Kind = static_cast<uint16_t>(N.getKind());
+    R.Role = static_cast<uint8_t>(N.getRole());
+    R.Flags = (N.isOriginal() ? OriginalFlag : 0) |
+              (N.canModify() ? CanModifyFlag : 0);
+    if (const auto *L = dyn_cast<Leaf>(&N)) {
+      R.Flags |= LeafFlag;
+      R.Data = encodeKey(L->getTokenKey());
+    }
+    Records.push_back(R);
+
+    if (const auto *T = dyn_cast<syntax::Tree>(&N)) {
+      uint32_t Previous = Null;
+      for (const Node &Child : T->getChildren())
+        Previous = append(Child, Index, Previous);
+      Records[Index].Data = Previous;
+    }
+    Records[Index].End = Records.size();
+    return Index;
+  }
+
+  uint32_t encodeKey(TokenManager::Key K) {
+    // Wraps around for keys before the array.
+    uintptr_t Offset = K - reinterpret_cast<uintptr_t>(Tokens.data());
+    if (Offset < Tokens.size() * sizeof(syntax::Token) &&
+        Offset % sizeof(syntax::Token) == 0)
+      return Offset / sizeof(syntax::Token);
+    ExtraKeys.push_back(K);
+    return (ExtraKeys.size() - 1) | ExtraKeyBit;
+  }
+
+  ArrayRef<syntax::Token> Tokens;
+  std::vector<Record> Records;
+  /// The keys of leaves whose tokens are not in Tokens.
+  std::vector<TokenManager::Key> ExtraKeys;
+};
+
+llvm::iterator_range<CompactTree::ChildIterator>
+CompactTree::NodeRef::getChildren() const {
+  return {ChildIterator(getFirstChild()), ChildIterator()};
+}
+
+} // namespace syntax
+} // namespace clang
+
+#endif // LLVM_CLANG_TOOLING_SYNTAX_COMPACTTREE_H
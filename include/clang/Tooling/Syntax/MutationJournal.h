@@ -0,0 +1,315 @@
+//===- MutationJournal.h - batch syntax tree mutations --------*- C++ -*-=====//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+// Records the regions of a syntax tree that mutations touch, so that the
+// textual replacements for many mutations can be computed without walking the
+// whole tree.
+//===----------------------------------------------------------------------===//
+#ifndef LLVM_CLANG_TOOLING_SYNTAX_MUTATIONJOURNAL_H
+#define LLVM_CLANG_TOOLING_SYNTAX_MUTATIONJOURNAL_H
+
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Tooling/Core/Replacement.h"
+#include "clang/Tooling/Syntax/Mutations.h"
+#include "clang/Tooling/Syntax/Nodes.h"
+#include "clang/Tooling/Syntax/TokenBufferTokenManager.h"
+#include "clang/Tooling/Syntax/Tokens.h"
+#include "clang/Tooling/Syntax/Tree.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Error.h"
+#include <algorithm>
+#include <cassert>
+#include <string>
+#include <vector>
+
+namespace clang {
+namespace syntax {
+
+/// Applies a batch of mutations to a syntax tree, and computes the textual
+/// replacements for all of them at once.
+///
+/// \c computeReplacements walks every leaf of the translation unit, so calling
+/// it after each of many mutations is quadratic. The journal instead records
+/// the tree whose children each mutation changes, together with the expanded
+/// tokens that tree covered before it was first changed. Replacements are then
+/// computed by walking only the recorded trees, outermost ones first, and
+/// skipping over unmodified subtrees in one step. The result is the same as
+/// \c computeReplacements for the whole translation unit.
+///
+/// \code
+///   MutationJournal Journal(A, TBTM);
+///   for (syntax::Statement *S : DeadStatements)
+///     Journal.removeStatement(S);
+///   tooling::Replacements Edits = Journal.computeReplacements();
+/// \endcode
+///
+/// All mutations of the tree must be done through the journal, or announced
+/// with \c willModify, from the moment it is created. A tree that is no longer
+/// original, e.g. because its descendants were changed, is recorded with the
+/// tokens of its original children and of the recorded trees inside of it.
+/// Only if those do not form a single range, i.e. not all changes inside of
+/// the tree were recorded, does the journal fall back to walking the whole
+/// translation unit. Like for \c computeReplacements, replacements
+/// are relative to the original text of the file and cover all mutations done
+/// so far.
+class MutationJournal {
+public:
+  MutationJournal(Arena &A, TokenBufferTokenManager &TBTM)
+      : A(A), TBTM(TBTM) {}
+
+  /// Records that the children of \p T are about to change. Call this before
+  /// any mutation that is not done through the journal.
+  void willModify(const syntax::Tree *T) {
+    assert(T && "cannot modify the children of a null tree");
+    if (!Root) {
+      const syntax::Node *Top = T;
+      while (Top->getParent())
+        Top = Top->getParent();
+      Root = dyn_cast<syntax::TranslationUnit>(Top);
+    }
+    if (Recorded.count(T))
+      return;
+
+    const syntax::Token *Begin = nullptr;
+    const syntax::Token *End = nullptr;
+    if (!T->isOriginal()) {
+      // Fine if the changes are inside of a recorded tree.
+      for (const syntax::Tree *P = T->getParent(); P; P = P->getParent())
+        if (Recorded.count(P))
+          return;
+      // Otherwise the tree was changed before, e.g. through one of its
+      // descendants. If all of those changes were recorded, the tree covered
+      // the original tokens of its children and of the recorded trees inside
+      // of it.
+      for (const syntax::Node &C : T->getChildren()) {
+        if (!addOriginalTokens(&C, Begin, End)) {
+          FullWalk = true;
+          return;
+        }
+      }
+    } else if (const syntax::Leaf *First = T->findFirstLeaf()) {
+      Begin = TBTM.getToken(First->getTokenKey());
+      End = TBTM.getToken(T->findLastLeaf()->getTokenKey()) + 1;
+    }
+    if (!Begin) {
+      FullWalk = true;
+      return;
+    }
+    Recorded.try_emplace(T, Regions.size());
+    Regions.push_back({T, llvm::makeArrayRef(Begin, End)});
+  }
+
+  /// Like \c syntax::removeStatement, recording the change.
+  void removeStatement(syntax::Statement *S) {
+    willModify(S->getParent());
+    syntax::removeStatement(A, TBTM, S);
+  }
+
+  /// Whether no mutations were recorded.
+  bool empty() const { return Regions.empty() && !FullWalk; }
+
+  /// Computes the textual replacements for all mutations recorded so far.
+  ///
+  /// The cost is proportional to the size of the recorded trees, so this can
+  /// be called after each batch of mutations.
+  tooling::Replacements computeReplacements() const {
+    if (FullWalk) {
+      assert(Root && "mutated tree is not part of a translation unit");
+      return syntax::computeReplacements(TBTM, *Root);
+    }
+
+    std::vector<const Region *> Live;
+    for (const Region &R : Regions)
+      if (isOutermost(R))
+        Live.push_back(&R);
+    llvm::sort(Live, [](const Region *L, const Region *R) {
+      return L->Original.begin() < R->Original.begin();
+    });
+
+    const SourceManager &SM = TBTM.sourceManager();
+    tooling::Replacements Replacements;
+    // Text inserted by the replacement we are building now.
+    std::string Replacement;
+    auto EmitReplacement = [&](ArrayRef<syntax::Token> ReplacedRange) {
+      if (ReplacedRange.empty() && Replacement.empty())
+        return;
+      llvm::cantFail(Replacements.add(tooling::Replacement(
+          SM, rangeOfExpanded(ReplacedRange), Replacement)));
+      Replacement.clear();
+    };
+    const syntax::Token *NextOriginal = nullptr;
+    auto OnSpan = [&](ArrayRef<syntax::Token> Tokens, bool IsOriginal) {
+      if (!IsOriginal) {
+        Replacement +=
+            syntax::Token::range(SM, Tokens.front(), Tokens.back()).text(SM);
+        return;
+      }
+      assert(NextOriginal <= Tokens.begin());
+      // A gap before the span is replaced; without a gap, only the pending
+      // insertions are emitted.
+      EmitReplacement(llvm::makeArrayRef(NextOriginal, Tokens.begin()));
+      NextOriginal = Tokens.end();
+    };
+
+    const syntax::Token *LastEnd = nullptr;
+    for (const Region *R : Live) {
+      if (!NextOriginal)
+        NextOriginal = R->Original.begin();
+      // The tokens between recorded trees are unchanged.
+      if (LastEnd && LastEnd != R->Original.begin())
+        OnSpan(llvm::makeArrayRef(LastEnd, R->Original.begin()),
+               /*IsOriginal=*/true);
+      enumerateTokenSpans(R->Node, OnSpan);
+      LastEnd = R->Original.end();
+    }
+    if (LastEnd)
+      EmitReplacement(llvm::makeArrayRef(NextOriginal, LastEnd));
+    return Replacements;
+  }
+
+private:
+  /// A tree whose children were changed.
+  struct Region {
+    const syntax::Tree *Node;
+    /// The expanded tokens that the tree covered before it was changed.
+    ArrayRef<syntax::Token> Original;
+  };
+
+  /// Extends the range [\p Begin, \p End) by the expanded tokens that \p N
+  /// covered before the recorded changes.
+  ///
+  /// \returns False if those tokens do not directly follow \p End, which
+  /// means that a change inside of \p N or before it was not recorded.
+  bool addOriginalTokens(const syntax::Node *N, const syntax::Token *&Begin,
+                         const syntax::Token *&End) const {
+    ArrayRef<syntax::Token> Tokens;
+    if (const auto *L = dyn_cast<syntax::Leaf>(N)) {
+      // Synthesized leaves were not part of the original text.
+      if (!L->isOriginal())
+        return true;
+      const syntax::Token *T = TBTM.getToken(L->getTokenKey());
+      Tokens = llvm::makeArrayRef(T, T + 1);
+    } else {
+      const auto *T = cast<syntax::Tree>(N);
+      auto It = Recorded.find(T);
+      if (It != Recorded.end()) {
+        Tokens = Regions[It->second].Original;
+      } else if (!T->isOriginal()) {
+        for (const syntax::Node &C : T->getChildren())
+          if (!addOriginalTokens(&C, Begin, End))
+            return false;
+        return true;
+      } else if (const syntax::Leaf *First = T->findFirstLeaf()) {
+        // The leaves of original trees are consecutive expanded tokens.
+        Tokens = llvm::makeArrayRef(
+            TBTM.getToken(First->getTokenKey()),
+            TBTM.getToken(T->findLastLeaf()->getTokenKey()) + 1);
+      }
+    }
+    if (Tokens.empty())
+      return true;
+    if (!Begin)
+      Begin = Tokens.begin();
+    else if (End != Tokens.begin())
+      return false;
+    End = Tokens.end();
+    return true;
+  }
+
+  /// Whether \p R is still part of the translation unit, and not inside of
+  /// another recorded tree.
+  bool isOutermost(const Region &R) const {
+    const syntax::Node *Top = R.Node;
+    while (const syntax::Tree *Parent = Top->getParent()) {
+      if (Recorded.count(Parent))
+        return false;
+      Top = Parent;
+    }
+    // Trees that were removed are covered by the tree they were removed from.
+    return Top == Root;
+  }
+
+  CharSourceRange rangeOfExpanded(ArrayRef<syntax::Token> Expanded) const {
+    const SourceManager &SM = TBTM.sourceManager();
+    assert(Expanded.end() < TBTM.tokenBuffer().expandedTokens().end());
+    if (Expanded.empty()) {
+      // Empty ranges always point before end().
+      SourceLocation Loc = SM.getExpansionLoc(Expanded.begin()->location());
+      return CharSourceRange::getCharRange(Loc, Loc);
+    }
+    auto Spelled = TBTM.tokenBuffer().spelledForExpanded(Expanded);
+    assert(Spelled && "could not find spelled tokens for expanded");
+    return syntax::Token::range(SM, Spelled->front(), Spelled->back())
+        .toCharRange(SM);
+  }
+
+  /// Calls \p Callback for each maximal run of consecutive tokens of \p Root
+  /// that are all original or all synthesized, in order.
+  template <typename Fn>
+  void enumerateTokenSpans(const syntax::Tree *Root, Fn &Callback) const {
+    const syntax::Token *SpanBegin = nullptr;
+    const syntax::Token *SpanEnd = nullptr;
+    bool SpanIsOriginal = false;
+    auto AddTokens = [&](const syntax::Token *Begin, const syntax::Token *End,
+                         bool IsOriginal) {
+      if (SpanEnd == Begin && SpanIsOriginal == IsOriginal) {
+        SpanEnd = End;
+        return;
+      }
+      if (SpanBegin)
+        Callback(llvm::makeArrayRef(SpanBegin, SpanEnd), SpanIsOriginal);
+      SpanBegin = Begin;
+      SpanEnd = End;
+      SpanIsOriginal = IsOriginal;
+    };
+
+    std::vector<const syntax::Node *> Stack = {Root};
+    while (!Stack.empty()) {
+      const syntax::Node *N = Stack.back();
+      Stack.pop_back();
+      if (const auto *L = dyn_cast<syntax::Leaf>(N)) {
+        const syntax::Token *T = TBTM.getToken(L->getTokenKey());
+        AddTokens(T, T + 1, L->isOriginal());
+        continue;
+      }
+      const auto *T = cast<syntax::Tree>(N);
+      // The leaves of original trees are consecutive expanded tokens.
+      if (T->isOriginal() && T != Root) {
+        if (const syntax::Leaf *First = T->findFirstLeaf())
+          AddTokens(TBTM.getToken(First->getTokenKey()),
+                    TBTM.getToken(T->findLastLeaf()->getTokenKey()) + 1,
+                    /*IsOriginal=*/true);
+        continue;
+      }
+      size_t Size = Stack.size();
+      for (const syntax::Node &C : T->getChildren())
+        Stack.push_back(&C);
+      std::reverse(Stack.begin() + Size, Stack.end());
+    }
+    if (SpanBegin)
+      Callback(llvm::makeArrayRef(SpanBegin, SpanEnd), SpanIsOriginal);
+  }
+
+  Arena &A;
+  TokenBufferTokenManager &TBTM;
+  /// The translation unit that the mutated trees belong to.
+  const syntax::TranslationUnit *Root = nullptr;
+  /// Maps recorded trees to their index in Regions.
+  llvm::DenseMap<const syntax::Tree *, unsigned> Recorded;
+  std::vector<Region> Regions;
+  /// Whether a mutation was not recorded precisely, so that the whole
+  /// translation unit has to be walked.
+  bool FullWalk = false;
+};
+
+} // namespace syntax
+} // namespace clang
+
+#endif // LLVM_CLANG_TOOLING_SYNTAX_MUTATIONJOURNAL_H
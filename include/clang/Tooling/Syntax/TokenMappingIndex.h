@@ -0,0 +1,328 @@
+//===- TokenMappingIndex.h - Constant-time token mapping queries -*- C++-*-===//
+//
+// Part of the LLVM Project, under the Apache License v2.0 with LLVM Exceptions.
+// See https://llvm.org/LICENSE.txt for license information.
+// SPDX-License-Identifier: Apache-2.0 WITH LLVM-exception
+//
+//===----------------------------------------------------------------------===//
+// An index over a TokenBuffer that answers spelledForExpanded and
+// expandedForSpelled in constant time, and maps batches of source ranges to
+// token ranges in a single pass.
+//
+// Tools that map the range of every AST node (e.g. to format or rewrite it)
+// make millions of these queries. TokenBuffer answers each one with a lookup
+// of the FileID, a hash map lookup of the file and a binary search over its
+// mappings; this index precomputes the answer of those steps for every token.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CLANG_TOOLING_SYNTAX_TOKENMAPPINGINDEX_H
+#define LLVM_CLANG_TOOLING_SYNTAX_TOKENMAPPINGINDEX_H
+
+#include "clang/Basic/SourceLocation.h"
+#include "clang/Basic/SourceManager.h"
+#include "clang/Tooling/Syntax/Tokens.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <vector>
+
+namespace clang {
+namespace syntax {
+
+/// Precomputed answers to the mapping queries of a \c TokenBuffer.
+///
+/// The results are identical to those of the \c TokenBuffer; queries that
+/// need the general algorithm (ranges inside a single macro argument, or
+/// tokens of files the index does not know about) are forwarded to it. The
+/// index refers to the buffer, which must outlive it and must not change.
+class TokenMappingIndex {
+public:
+  explicit TokenMappingIndex(const TokenBuffer &Tokens) : Tokens(Tokens) {
+    build();
+  }
+
+  TokenMappingIndex(const TokenMappingIndex &) = delete;
+  TokenMappingIndex &operator=(const TokenMappingIndex &) = delete;
+
+  /// Equivalent to \c TokenBuffer::spelledForExpanded.
+  llvm::Optional<llvm::ArrayRef<syntax::Token>>
+  spelledForExpanded(llvm::ArrayRef<syntax::Token> Expanded) const {
+    if (Expanded.empty())
+      return llvm::None;
+    llvm::ArrayRef<syntax::Token> All = Tokens.expandedTokens();
+    unsigned FirstExpanded = Expanded.begin() - All.begin();
+    unsigned LastExpanded = Expanded.end() - All.begin();
+    const ExpandedInfo &First = ExpandedInfos[FirstExpanded];
+    const ExpandedInfo &Last = ExpandedInfos[LastExpanded - 1];
+    if (First.File == NoFile || Last.File == NoFile)
+      return Tokens.spelledForExpanded(Expanded);
+    // FIXME: Handle multi-file changes by trying to map onto a common root.
+    if (First.File != Last.File)
+      return llvm::None;
+
+    // A range within one macro argument may only be part of a mapping, which
+    // needs the general algorithm.
+    const SourceManager &SM = Tokens.sourceManager();
+    if (First.MappingIndex != NoMapping &&
+        First.MappingIndex == Last.MappingIndex &&
+        SM.isMacroArgExpansion(Expanded.front().location()) &&
+        SM.isMacroArgExpansion(Expanded.back().location()))
+      return Tokens.spelledForExpanded(Expanded);
+
+    // Do not allow changes that don't cover full expansions.
+    const FileInfo &File = Files[First.File];
+    const syntax::Token *Begin = File.Spelled.data() + First.Spelled;
+    if (First.MappingIndex != NoMapping) {
+      const Mapping &M = Mappings[First.MappingIndex];
+      if (FirstExpanded != M.BeginExpanded)
+        return llvm::None;
+      Begin = File.Spelled.data() + M.BeginSpelled;
+    }
+    const syntax::Token *End = File.Spelled.data() + Last.Spelled + 1;
+    if (Last.MappingIndex != NoMapping) {
+      const Mapping &M = Mappings[Last.MappingIndex];
+      if (M.EndExpanded != LastExpanded)
+        return llvm::None;
+      End = File.Spelled.data() + M.EndSpelled;
+    }
+    return llvm::makeArrayRef(Begin, End);
+  }
+
+  /// Equivalent to \c TokenBuffer::expandedForSpelled.
+  llvm::SmallVector<llvm::ArrayRef<syntax::Token>, 1>
+  expandedForSpelled(llvm::ArrayRef<syntax::Token> Spelled) const {
+    if (Spelled.empty())
+      return {};
+    FileID FID = Tokens.sourceManager().getFileID(Spelled.front().location());
+    auto FileIt = FileIndices.find(FID);
+    if (FileIt == FileIndices.end())
+      return Tokens.expandedForSpelled(Spelled);
+    const FileInfo &File = Files[FileIt->second];
+    unsigned FrontI = &Spelled.front() - File.Spelled.data();
+    unsigned BackI = &Spelled.back() - File.Spelled.data();
+    assert(BackI < File.Spelled.size() && "spelled tokens from another file");
+
+    unsigned ExpandedBegin;
+    int Front = File.MappingBefore[FrontI];
+    if (Front == NoMapping) {
+      ExpandedBegin = File.BeginExpanded + FrontI;
+    } else if (FrontI < Mappings[Front].EndSpelled) {
+      // FIXME: support macro arguments, like TokenBuffer.
+      if (FrontI != Mappings[Front].BeginSpelled)
+        return {};
+      ExpandedBegin = Mappings[Front].BeginExpanded;
+    } else {
+      ExpandedBegin = Mappings[Front].EndExpanded +
+                      (FrontI - Mappings[Front].EndSpelled);
+    }
+
+    unsigned ExpandedEnd;
+    int Back = File.MappingBefore[BackI];
+    if (Back == NoMapping) {
+      ExpandedEnd = File.BeginExpanded + BackI + 1;
+    } else if (BackI < Mappings[Back].EndSpelled) {
+      if (BackI + 1 != Mappings[Back].EndSpelled)
+        return {};
+      ExpandedEnd = Mappings[Back].EndExpanded;
+    } else {
+      ExpandedEnd = Mappings[Back].EndExpanded +
+                    (BackI - Mappings[Back].EndSpelled) + 1;
+    }
+
+    // Avoid returning empty ranges.
+    if (ExpandedBegin == ExpandedEnd)
+      return {};
+    llvm::ArrayRef<syntax::Token> All = Tokens.expandedTokens();
+    return {All.slice(ExpandedBegin, ExpandedEnd - ExpandedBegin)};
+  }
+
+  /// Maps each of \p Ranges (closed token ranges, e.g. the source ranges of
+  /// AST nodes) to its expanded tokens like
+  /// \c TokenBuffer::expandedTokens(SourceRange), and then to its spelled
+  /// tokens like \c spelledForExpanded.
+  ///
+  /// The ranges may be in any order; their endpoints are sorted and resolved
+  /// against the sorted token locations in a single merge walk.
+  std::vector<llvm::Optional<llvm::ArrayRef<syntax::Token>>>
+  spelledForRanges(llvm::ArrayRef<SourceRange> Ranges) const {
+    std::vector<llvm::ArrayRef<syntax::Token>> Expanded =
+        expandedForRanges(Ranges);
+    std::vector<llvm::Optional<llvm::ArrayRef<syntax::Token>>> Result;
+    Result.reserve(Expanded.size());
+    for (llvm::ArrayRef<syntax::Token> E : Expanded)
+      Result.push_back(spelledForExpanded(E));
+    return Result;
+  }
+
+  /// Maps each of \p Ranges to its expanded tokens, like
+  /// \c TokenBuffer::expandedTokens(SourceRange).
+  std::vector<llvm::ArrayRef<syntax::Token>>
+  expandedForRanges(llvm::ArrayRef<SourceRange> Ranges) const {
+    // Sort all endpoints by location, then walk them together with the
+    // sorted token locations.
+    std::vector<std::pair<SourceLocation::UIntTy, unsigned>> Endpoints;
+    Endpoints.reserve(2 * Ranges.size());
+    for (unsigned I = 0, E = Ranges.size(); I != E; ++I) {
+      Endpoints.push_back({Ranges[I].getBegin().getRawEncoding(), 2 * I});
+      Endpoints.push_back({Ranges[I].getEnd().getRawEncoding(), 2 * I + 1});
+    }
+    llvm::sort(Endpoints);
+    std::vector<unsigned> TokenIndex(Endpoints.size(), NotFound);
+    size_t Cursor = 0;
+    for (const auto &Endpoint : Endpoints) {
+      while (Cursor != Locations.size() &&
+             Locations[Cursor].first < Endpoint.first)
+        ++Cursor;
+      if (Cursor != Locations.size() &&
+          Locations[Cursor].first == Endpoint.first)
+        TokenIndex[Endpoint.second] = Locations[Cursor].second;
+    }
+
+    llvm::ArrayRef<syntax::Token> All = Tokens.expandedTokens();
+    std::vector<llvm::ArrayRef<syntax::Token>> Result;
+    Result.reserve(Ranges.size());
+    for (unsigned I = 0, E = Ranges.size(); I != E; ++I) {
+      unsigned Begin = TokenIndex[2 * I];
+      unsigned Last = TokenIndex[2 * I + 1];
+      if (Ranges[I].isInvalid())
+        Result.emplace_back();
+      else if (Begin == NotFound || Last == NotFound)
+        Result.push_back(Tokens.expandedTokens(Ranges[I]));
+      else if (Begin > Last)
+        Result.emplace_back();
+      else
+        Result.push_back(All.slice(Begin, Last - Begin + 1));
+    }
+    return Result;
+  }
+
+private:
+  static constexpr unsigned NoFile = ~0u;
+  static constexpr int NoMapping = -1;
+  static constexpr unsigned NotFound = ~0u;
+
+  struct Mapping {
+    unsigned BeginSpelled;
+    unsigned EndSpelled;
+    unsigned BeginExpanded;
+    unsigned EndExpanded;
+  };
+
+  struct FileInfo {
+    llvm::ArrayRef<syntax::Token> Spelled;
+    /// The first expanded token produced for this file.
+    unsigned BeginExpanded;
+    /// For each spelled token, the last mapping of the file that starts at or
+    /// before it, or NoMapping.
+    std::vector<int> MappingBefore;
+  };
+
+  /// What TokenBuffer computes for an expanded token on every query.
+  struct ExpandedInfo {
+    unsigned File = NoFile;
+    /// The mapping that produced the token, or NoMapping.
+    int MappingIndex = NoMapping;
+    /// The index of the corresponding spelled token if the token was not
+    /// produced by a mapping.
+    unsigned Spelled = 0;
+  };
+
+  void build() {
+    const SourceManager &SM = Tokens.sourceManager();
+    llvm::ArrayRef<syntax::Token> All = Tokens.expandedTokens();
+    ExpandedInfos.resize(All.size());
+    Locations.reserve(All.size());
+    // Indices into Mappings of the mappings of each file, in order.
+    std::vector<std::vector<int>> FileMappings;
+
+    for (unsigned I = 0, E = All.size(); I != E; ++I) {
+      SourceLocation Loc = All[I].location();
+      if (Loc.isValid())
+        Locations.push_back({Loc.getRawEncoding(), I});
+      FileID FID = SM.getFileID(SM.getExpansionLoc(Loc));
+      if (FID.isInvalid())
+        continue;
+      auto Inserted = FileIndices.try_emplace(FID, Files.size());
+      if (Inserted.second) {
+        FileMappings.emplace_back();
+        addFile(FID, I, FileMappings.back());
+      }
+      unsigned FileIndex = Inserted.first->second;
+      const FileInfo &File = Files[FileIndex];
+      const std::vector<int> &Ms = FileMappings[FileIndex];
+
+      ExpandedInfo &Info = ExpandedInfos[I];
+      Info.File = FileIndex;
+      // The last mapping that starts at or before this token.
+      auto It = llvm::partition_point(
+          Ms, [&](int M) { return Mappings[M].BeginExpanded <= I; });
+      if (It == Ms.begin()) {
+        Info.Spelled = I - File.BeginExpanded;
+      } else if (I < Mappings[*std::prev(It)].EndExpanded) {
+        Info.MappingIndex = *std::prev(It);
+        Info.Spelled = Mappings[Info.MappingIndex].BeginSpelled;
+      } else {
+        const Mapping &M = Mappings[*std::prev(It)];
+        Info.Spelled = M.EndSpelled + (I - M.EndExpanded);
+      }
+    }
+
+    // For duplicate locations, the last token wins, as in
+    // TokenBuffer::indexExpandedTokens.
+    llvm::stable_sort(Locations, [](const auto &L, const auto &R) {
+      return L.first < R.first;
+    });
+    auto Kept = std::unique(
+        Locations.rbegin(), Locations.rend(),
+        [](const auto &L, const auto &R) { return L.first == R.first; });
+    Locations.erase(Locations.begin(), Kept.base());
+  }
+
+  void addFile(FileID FID, unsigned BeginExpanded,
+               std::vector<int> &FileMappings) {
+    llvm::ArrayRef<syntax::Token> Spelled = Tokens.spelledTokens(FID);
+    llvm::ArrayRef<syntax::Token> All = Tokens.expandedTokens();
+    for (const TokenBuffer::Expansion &E :
+         Tokens.expansionsOverlapping(Spelled)) {
+      FileMappings.push_back(Mappings.size());
+      Mappings.push_back(
+          {unsigned(E.Spelled.begin() - Spelled.begin()),
+           unsigned(E.Spelled.end() - Spelled.begin()),
+           unsigned(E.Expanded.begin() - All.begin()),
+           unsigned(E.Expanded.end() - All.begin())});
+    }
+
+    FileInfo File;
+    File.Spelled = Spelled;
+    File.BeginExpanded = BeginExpanded;
+    File.MappingBefore.resize(Spelled.size(), NoMapping);
+    size_t Next = 0;
+    int Current = NoMapping;
+    for (unsigned I = 0, E = Spelled.size(); I != E; ++I) {
+      while (Next != FileMappings.size() &&
+             Mappings[FileMappings[Next]].BeginSpelled <= I)
+        Current = FileMappings[Next++];
+      File.MappingBefore[I] = Current;
+    }
+    Files.push_back(std::move(File));
+  }
+
+  const TokenBuffer &Tokens;
+  std::vector<Mapping> Mappings;
+  std::vector<FileInfo> Files;
+  llvm::DenseMap<FileID, unsigned> FileIndices;
+  std::vector<ExpandedInfo> ExpandedInfos;
+  /// The locations of the expanded tokens, sorted, with their indices.
+  std::vector<std::pair<SourceLocation::UIntTy, unsigned>> Locations;
+};
+
+} // namespace syntax
+} // namespace clang
+
+#endif // LLVM_CLANG_TOOLING_SYNTAX_TOKENMAPPINGINDEX_H
@@ -23,6 +23,20 @@ def git_query(git_args, cwd=None) -> str:
 
 
 
+def read_local_includes(out: Path) -> dict:
+	# headers added by this repo; the mirror would otherwise delete them
+	local = dict()
+	with open(Path(__file__).parent / r'local_includes.txt', r'r', encoding=r'utf-8') as f:
+		for line in f:
+			line = line.strip()
+			if not line or line.startswith(r'#'):
+				continue
+			with open(out / r'include' / line, r'rb') as header:
+				local[line] = header.read()
+	return local
+
+
+
 def main():
 	args = ArgumentParser(description='Makes a self-contained clang libtooling distribution for windows builds.')
 	args.add_argument('--llvm', type=Path, default=None)
@@ -61,6 +75,9 @@ def main():
 	for _, build, mode in configurations:
 		assert_existing_directory(build / mode / r'lib')
 
+	print(r'Saving repo-local includes')
+	local_includes = read_local_includes(out)
+
 	print(r'Creating output directories')
 	delete_directory(out / r'include')
 	delete_directory(out / r'lib')
@@ -95,6 +112,16 @@ def main():
 		shutil.copytree(source, out / r'include' / dest, dirs_exist_ok=True, ignore=junk)
 	copy_file(root / r'LICENSE.txt', out / r'include')
 
+	print(r'Restoring repo-local includes')
+	for path, contents in local_includes.items():
+		dest = out / r'include' / path
+		if dest.exists():
+			raise Exception(rf'repo-local include {path} now exists upstream; remove it from local_includes.txt')
+		print(rf'  {path}')
+		os.makedirs(dest.parent, exist_ok=True)
+		with open(dest, r'wb') as f:
+			f.write(contents)
+
 	print(r'Copying libs')
 	for bits, build, mode in configurations:
 		#for lib in libs: